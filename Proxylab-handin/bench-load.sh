@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# bench-load.sh - drive the proxy with a Zipf mix of object sizes and
+#   report requests/sec, bytes/sec, hit ratio and latency percentiles
+#
+# usage: ./bench-load.sh <port> [proxy options -- ] [proxy-bench options]
+#
+#   Proxy options, if any, come before a "--". The defaults model a web
+#   workload: 2000 objects of 256 bytes to 64 KB, Zipf 0.8, 64 keep-alive
+#   clients, 3 s of warm-up then 10 s measured. Later proxy-bench options
+#   override them.
+#
+PORT=${1:?usage: $0 <port> [proxy options -- ] [proxy-bench options]}
+shift
+PROXY_OPTS=
+case " $* " in
+*" -- "*)
+  while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+    PROXY_OPTS="$PROXY_OPTS $1"
+    shift
+  done
+  shift
+  ;;
+esac
+
+make -s proxy proxy-bench || exit 1
+./proxy $PROXY_OPTS $PORT > /dev/null &
+PID=$!
+sleep 1
+./proxy-bench -p $PORT -c 64 -n 2000 -b 256 -B 65536 -z 0.8 -k -w 3 -d 10 "$@"
+kill -INT $PID
+wait $PID 2> /dev/null
@@ -0,0 +1,26 @@
+#!/bin/sh
+#
+# bench-pool.sh - compare connections/sec of the prespawned worker pool
+#   against thread per connection (proxy -t 0)
+#
+# usage: ./bench-pool.sh <port> [nthreads] [proxy-bench options]
+#
+PORT=${1:?usage: $0 <port> [nthreads] [proxy-bench options]}
+NTHREADS=${2:-16}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+
+make -s proxy proxy-bench || exit 1
+for t in 0 $NTHREADS; do
+  ./proxy -t $t $PORT > /dev/null &
+  PID=$!
+  sleep 1
+  if [ $t -eq 0 ]; then
+    echo "== thread per connection"
+  else
+    echo "== pool of $t workers"
+  fi
+  ./proxy-bench -p $PORT "$@"
+  kill -INT $PID
+  wait $PID 2> /dev/null
+done
@@ -0,0 +1,141 @@
+/*
+ * cache-bench.c - multi-threaded hit throughput microbenchmark for cache.c
+ *
+ * Fills the cache with small objects, then runs 1, 2, 4, ... threads that
+ * do nothing but pin and release random cached uris for a fixed time and
+ * reports the aggregate hits per second for each thread count.
+ *
+ * usage: ./cache-bench [-m lru|clock|gdsf] [-s shards] [-t maxthreads]
+ *                      [-n objects] [-b bytes] [-d seconds]
+ */
+#include <stdio.h>
+#include <getopt.h>
+#include "csapp.h"
+#include "cache.h"
+
+static int nobjects = 1000;
+static int objsize = 512;
+static volatile int stop;
+
+/* Per thread state, padded so counters don't share a cache block */
+typedef struct {
+  pthread_t tid;
+  unsigned int seed;
+  long hits;
+  char pad[64];
+} worker_t;
+
+static void make_uri(char *uri, int i) {
+  sprintf(uri, "http://bench.example.com/object/%d", i);
+}
+
+/* worker - Hammer the cache with lookups until told to stop */
+static void *worker(void *vargp) {
+  worker_t *me = (worker_t *)vargp;
+  char uri[MAXLINE];
+  cache_line *c_line;
+
+  while (!stop) {
+    make_uri(uri, rand_r(&me -> seed) % nobjects);
+    if ((c_line = cache_lookup(uri)) != NULL) {
+      me -> hits++;
+      cache_release(c_line);
+    }
+  }
+  return NULL;
+}
+
+/* run - Run nthreads workers for secs seconds, return hits per second */
+static double run(int nthreads, int secs) {
+  worker_t *workers = Calloc(nthreads, sizeof(worker_t));
+  struct timeval start, end;
+  long total = 0;
+  double elapsed;
+  int i;
+
+  stop = 0;
+  gettimeofday(&start, NULL);
+  for (i = 0; i < nthreads; i++) {
+    workers[i].seed = i + 1;
+    Pthread_create(&workers[i].tid, NULL, worker, &workers[i]);
+  }
+  Sleep(secs);
+  stop = 1;
+  for (i = 0; i < nthreads; i++) {
+    Pthread_join(workers[i].tid, NULL);
+    total += workers[i].hits;
+  }
+  gettimeofday(&end, NULL);
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+  Free(workers);
+  return total / elapsed;
+}
+
+static void usage(char *prog) {
+  fprintf(stderr, "usage: %s [-m lru|clock|gdsf] [-s shards] [-t maxthreads] "
+          "[-n objects] [-b bytes] [-d seconds]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int mode = CACHE_MODE_CLOCK;
+  int nshards = CACHE_SHARDS;
+  int maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  int secs = 2;
+  int c, i, nthreads;
+  char uri[MAXLINE];
+  char *content;
+  double base = 0, rate;
+
+  while ((c = getopt(argc, argv, "m:s:t:n:b:d:")) != -1) {
+    switch (c) {
+    case 'm':
+      if (!strcmp(optarg, "lru")) {
+        mode = CACHE_MODE_LRU;
+      } else if (!strcmp(optarg, "clock")) {
+        mode = CACHE_MODE_CLOCK;
+      } else if (!strcmp(optarg, "gdsf")) {
+        mode = CACHE_MODE_GDSF;
+      } else {
+        usage(argv[0]);
+      }
+      break;
+    case 's': nshards = atoi(optarg); break;
+    case 't': maxthreads = atoi(optarg); break;
+    case 'n': nobjects = atoi(optarg); break;
+    case 'b': objsize = atoi(optarg); break;
+    case 'd': secs = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (maxthreads < 1 || nobjects < 1 || objsize < 1 ||
+      objsize > MAX_OBJECT_SIZE || secs < 1) {
+    usage(argv[0]);
+  }
+
+  cache_init_mode(mode, nshards);
+  content = Malloc(objsize);
+  memset(content, 'x', objsize);
+  for (i = 0; i < nobjects; i++) {
+    make_uri(uri, i);
+    put_cached_content(uri, content, objsize);
+  }
+  Free(content);
+
+  printf("mode %s, %d shards, %d objects of %d bytes\n",
+         mode == CACHE_MODE_LRU ? "lru" :
+         mode == CACHE_MODE_CLOCK ? "clock" : "gdsf", nshards, nobjects, objsize);
+  printf("%8s %14s %8s\n", "threads", "hits/sec", "speedup");
+  for (nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+    rate = run(nthreads, secs);
+    if (nthreads == 1) {
+      base = rate;
+    }
+    printf("%8d %14.0f %7.2fx\n", nthreads, rate, rate / base);
+    if (nthreads < maxthreads && nthreads * 2 > maxthreads) {
+      nthreads = maxthreads / 2; /* make sure maxthreads itself is run */
+    }
+  }
+  free_cache();
+  return 0;
+}
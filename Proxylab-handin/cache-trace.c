@@ -0,0 +1,191 @@
+/*
+ * cache-trace.c - trace-replay benchmark of the cache's eviction and
+ *   admission policies
+ *
+ * Replays a trace of requests against each combination of cache mode and
+ * admission policy. A request is a cache_lookup; a miss stores an object
+ * of the requested size, like the proxy does after going to the server.
+ * Reports the object hit ratio and the byte hit ratio of each combination.
+ *
+ * The trace is read from a file of "uri size" lines, or made up: requests
+ * for a Zipf-popular set of objects of mixed sizes, interrupted every so
+ * often by a scan of large objects that are never asked for again.
+ *
+ * usage: ./cache-trace [-f trace] [-n requests] [-o objects] [-z alpha]
+ *                      [-s shards]
+ */
+#include <stdio.h>
+#include <getopt.h>
+#include "csapp.h"
+#include "cache.h"
+
+#define SCAN_EVERY 5000 /* made up requests between two scans */
+#define SCAN_LEN 200 /* one-off objects in a scan */
+#define MIN_SIZE 256 /* made up object sizes, log-uniform in between */
+#define MAX_SIZE (MAX_OBJECT_SIZE / 2)
+
+typedef struct {
+  char *uri;
+  int size;
+} request;
+
+static request *trace;
+static int ntrace;
+
+/* add_request - Append a request to the trace */
+static void add_request(char *uri, int size) {
+  static int max;
+  if (ntrace == max) {
+    max = max ? 2 * max : 1024;
+    trace = Realloc(trace, max * sizeof(request));
+  }
+  trace[ntrace].uri = strdup(uri);
+  trace[ntrace].size = size;
+  ntrace++;
+}
+
+/* read_trace - Load "uri size" lines from a file */
+static void read_trace(char *path) {
+  char line[MAXLINE], uri[MAXLINE];
+  int size;
+  FILE *fp;
+
+  if ((fp = fopen(path, "r")) == NULL) {
+    unix_error("cannot open trace");
+  }
+  while (fgets(line, MAXLINE, fp) != NULL) {
+    if (sscanf(line, "%s %d", uri, &size) == 2 &&
+        size > 0 && size <= MAX_OBJECT_SIZE) {
+      add_request(uri, size);
+    }
+  }
+  fclose(fp);
+}
+
+/* make_trace - Make up n requests over nobjects Zipf(alpha) objects */
+static void make_trace(int n, int nobjects, double alpha) {
+  double *cdf = Malloc(nobjects * sizeof(double));
+  int *sizes = Malloc(nobjects * sizeof(int));
+  char uri[MAXLINE];
+  unsigned int seed = 1;
+  double sum = 0, u;
+  int i, j, lo, hi, scans = 0;
+
+  for (i = 0; i < nobjects; i++) {
+    sum += 1.0 / pow(i + 1, alpha);
+    cdf[i] = sum;
+    u = rand_r(&seed) / (double)RAND_MAX;
+    sizes[i] = MIN_SIZE * pow((double)MAX_SIZE / MIN_SIZE, u);
+  }
+  for (i = 0; i < n; i++) {
+    if (i > 0 && i % SCAN_EVERY == 0) {
+      for (j = 0; j < SCAN_LEN; j++, scans++) {
+        sprintf(uri, "http://trace.example.com/scan/%d", scans);
+        add_request(uri, MAX_SIZE);
+      }
+    }
+    // binary search for the object the draw lands on
+    u = rand_r(&seed) / (double)RAND_MAX * sum;
+    for (lo = 0, hi = nobjects - 1; lo < hi; ) {
+      j = (lo + hi) / 2;
+      if (cdf[j] < u) {
+        lo = j + 1;
+      } else {
+        hi = j;
+      }
+    }
+    sprintf(uri, "http://trace.example.com/object/%d", lo);
+    add_request(uri, sizes[lo]);
+  }
+  Free(cdf);
+  Free(sizes);
+}
+
+/*
+ * replay - Run the trace on a fresh cache and report its hit ratios.
+ *   cache.c reports every miss on stdout, so stdout is muted meanwhile.
+ */
+static void replay(int mode, int policy, int nshards, char *content) {
+  long hits = 0, bytes = 0, hit_bytes = 0;
+  cache_line *c_line;
+  int i, out, null;
+
+  fflush(stdout);
+  out = dup(STDOUT_FILENO);
+  null = Open("/dev/null", O_WRONLY, 0);
+  Dup2(null, STDOUT_FILENO);
+  Close(null);
+  cache_init_mode(mode, nshards);
+  cache_set_admission(policy);
+  for (i = 0; i < ntrace; i++) {
+    bytes += trace[i].size;
+    if ((c_line = cache_lookup(trace[i].uri)) != NULL) {
+      hits++;
+      hit_bytes += trace[i].size;
+      cache_release(c_line);
+    } else {
+      put_cached_content(trace[i].uri, content, trace[i].size);
+    }
+  }
+  free_cache();
+  fflush(stdout);
+  Dup2(out, STDOUT_FILENO);
+  Close(out);
+
+  printf("%6s %8s %12.2f%% %12.2f%%\n",
+         mode == CACHE_MODE_LRU ? "lru" :
+         mode == CACHE_MODE_CLOCK ? "clock" : "gdsf",
+         policy == CACHE_ADMIT_ALL ? "all" : "tinylfu",
+         100.0 * hits / ntrace, 100.0 * hit_bytes / bytes);
+}
+
+static void usage(char *prog) {
+  fprintf(stderr, "usage: %s [-f trace] [-n requests] [-o objects] "
+          "[-z alpha] [-s shards]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  static const int modes[] = { CACHE_MODE_LRU, CACHE_MODE_CLOCK,
+                               CACHE_MODE_GDSF };
+  char *path = NULL;
+  int nrequests = 200000;
+  int nobjects = 5000;
+  double alpha = 0.8;
+  int nshards = CACHE_SHARDS;
+  int c, i;
+  char *content;
+
+  while ((c = getopt(argc, argv, "f:n:o:z:s:")) != -1) {
+    switch (c) {
+    case 'f': path = optarg; break;
+    case 'n': nrequests = atoi(optarg); break;
+    case 'o': nobjects = atoi(optarg); break;
+    case 'z': alpha = atof(optarg); break;
+    case 's': nshards = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (nrequests < 1 || nobjects < 1 || alpha <= 0) {
+    usage(argv[0]);
+  }
+
+  if (path != NULL) {
+    read_trace(path);
+    printf("trace %s, %d requests\n", path, ntrace);
+  } else {
+    make_trace(nrequests, nobjects, alpha);
+    printf("zipf %.2f over %d objects, %d requests with scans\n",
+           alpha, nobjects, ntrace);
+  }
+  content = Malloc(MAX_OBJECT_SIZE);
+  memset(content, 'x', MAX_OBJECT_SIZE);
+
+  printf("%6s %8s %13s %13s\n", "mode", "admit", "object hits", "byte hits");
+  for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+    replay(modes[i], CACHE_ADMIT_ALL, nshards, content);
+    replay(modes[i], CACHE_ADMIT_TINYLFU, nshards, content);
+  }
+  Free(content);
+  return 0;
+}
@@ -1,14 +1,70 @@
 /*
  * This cache suite using LRU algorithm to store the temporary web reponses from
  * remote server.
+ *
+ * The cache is split into shards, each with its own readers-writers lock,
+ * LRU list and hash index. In CACHE_MODE_CLOCK a hit never takes a writer
+ * lock: it sets the line's reference bit while holding the reader lock, and
+ * evict gives referenced tails a second chance by moving them to the head.
+ *
+ * In CACHE_MODE_GDSF a hit bumps the line's frequency and recomputes its
+ * priority under the reader lock too, and evict takes the line of lowest
+ * priority. A line's priority is its frequency per byte of charge plus the
+ * shard's inflation, which rises to the priority of each victim so lines
+ * that stop being hit age out. Each shard keeps its lines in a min-heap,
+ * which only changes under the writer lock: a hit never lowers a priority,
+ * so a line's heap key is a lower bound of it, and the top is keyed again
+ * and sifted down until its key is current. Finding a victim is then
+ * O(log n) for every hit since the line was last keyed.
+ *
+ * With CACHE_ADMIT_TINYLFU every lookup is counted in a per-shard
+ * frequency sketch, and a new line that needs room is only admitted if
+ * its uri was looked up more often than the line it would evict first.
+ * A scan of one-off objects then can't flush the hot ones.
+ *
+ * Lines are reference counted. Readers pin a line with cache_lookup and use
+ * its content in place; an evicted line is only freed on its last release.
+ * Evicted lines can be handed to a lower tier set with cache_set_demote,
+ * once the shard lock is dropped.
+ *
+ * A line may carry the time it goes stale. Nothing sweeps for stale lines:
+ * cache_lookup unlinks one it finds and reports a miss, and eviction does
+ * not demote them. cache_lookup_stale hands it over instead, for the proxy
+ * to revalidate with the server and, on a 304, extend with cache_refresh.
+ *
+ * cache_save writes the complete lines to a snapshot file, each shard from
+ * its LRU tail to its head, and cache_load publishes them again in that
+ * order so a restarted proxy starts with the same lines in the same order.
  */
 #include "cache.h"
+#include "hash.h"
+#include "log.h"
+
+static cache_shard *shards;
+static int nshards;
+static int cache_mode;
+static int admission; /* CACHE_ADMIT_ALL unless set */
+static long cache_size = MAX_CACHE_SIZE; /* bytes shared by the shards */
+static int max_object = MAX_OBJECT_SIZE; /* largest content cached */
+static void (*demote)(cache_line *c_line); /* takes evicted lines, if set */
+
+#define SNAPSHOT_MAGIC 0x63616369
+#define GDSF_SCALE (1ULL << 32) /* fixed point unit of a GDSF priority */
+#define SKETCH_WIDTH (1 << CACHE_SKETCH_BITS)
+#define SKETCH_MAX 15 /* counters saturate here */
+#define SKETCH_SAMPLE (10 * SKETCH_WIDTH) /* adds between two halvings */
 
-static cache_line *dummy;
-static int free_space;
+static const unsigned int sketch_seeds[CACHE_SKETCH_ROWS] = {
+  0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu
+};
 
-static int readcnt; /* Initially = 0 */
-static sem_t mutex, w; /* Both initially = 1 */
+/* Snapshot record header, followed by the uri and the content */
+typedef struct {
+  int uri_len; /* without the NUL */
+  int content_len;
+  int hdr_len;
+  long expires;
+} snapshot_record;
 
 /* unit_test - It will test the necessity of the cache suite. */
 int unit_test(int argc, char **argv) {
@@ -16,19 +72,19 @@ int unit_test(int argc, char **argv) {
   int content_len;
   cache_init();
   display_cache();
-  put_cached_content("http://www.cmu.edu", "Hello CMU", 40);
+  put_cached_content("http://www.cmu.edu", "Hello CMU", 10);
   display_cache();
-  put_cached_content("http://victorzhao1.com", "Hello Victor1", 10);
+  put_cached_content("http://victorzhao1.com", "Hello Victor1", 14);
   display_cache();
-  put_cached_content("http://victorzhao2.com", "Hello Victor2", 10);
+  put_cached_content("http://victorzhao2.com", "Hello Victor2", 14);
   display_cache();
-  put_cached_content("http://victorzhao3.com", "Hello Victor3", 10);
+  put_cached_content("http://victorzhao3.com", "Hello Victor3", 14);
   display_cache();
-  put_cached_content("http://victorzhao4.com", "Hello Victor4", 10);
+  put_cached_content("http://victorzhao4.com", "Hello Victor4", 14);
   display_cache();
-  put_cached_content("http://victorzhao5.com", "Hello Victor5", 10);
+  put_cached_content("http://victorzhao5.com", "Hello Victor5", 14);
   display_cache();
-  put_cached_content("http://victorzhao6.com", "Hello Victor6", 10);
+  put_cached_content("http://victorzhao6.com", "Hello Victor6", 14);
   display_cache();
   get_cached_obj("http://victorzhao5.com", content, &content_len);
   printf("content %s.\n", content);
@@ -38,21 +94,411 @@ int unit_test(int argc, char **argv) {
 }
 
 /*
- * cache_init - Initialize a cache structure that
- * initalize a pointer point to dummy cache_line.
- *
+ * line_alloc - Allocate a line just big enough for uri and the content
+ *   made of hdr followed by body, and copy them in. A NULL body leaves
+ *   room for body_len bytes to be filled in later. Return NULL if malloc
+ *   fails.
+ */
+static cache_line *line_alloc(char *uri, char *hdr, int hdr_len,
+                              char *body, int body_len) {
+  int uri_len = strlen(uri);
+  int content_len = hdr_len + body_len;
+  int charge = sizeof(cache_line) + content_len + 1 + uri_len + 1;
+  cache_line *c_line = (cache_line *)malloc(charge);
+
+  if (c_line == NULL) {
+    return NULL;
+  }
+  c_line -> content = c_line -> data;
+  memcpy(c_line -> content, hdr, hdr_len);
+  if (body != NULL) {
+    memcpy(c_line -> content + hdr_len, body, body_len);
+  }
+  c_line -> content[content_len] = '\0';
+  c_line -> uri = c_line -> content + content_len + 1;
+  memcpy(c_line -> uri, uri, uri_len + 1);
+  c_line -> content_len = content_len;
+  c_line -> hdr_len = hdr_len;
+  c_line -> expires = 0;
+  c_line -> refreshing = 0;
+  c_line -> charge = charge;
+  c_line -> referenced = 0;
+  c_line -> freq = 1;
+  c_line -> priority = 0;
+  c_line -> refcnt = 1;
+  c_line -> next = NULL;
+  c_line -> prev = NULL;
+  c_line -> hnext = NULL;
+  c_line -> fill_state = CACHE_FILLED;
+  c_line -> filled = content_len;
+  c_line -> fill_waiters = 0;
+  sem_init(&c_line -> fill_mutex, 0, 1);
+  sem_init(&c_line -> more, 0, 0);
+  return c_line;
+}
+
+/*
+ * cache_init - Initialize a single-shard strict LRU cache.
  */
 void cache_init() {
-  dummy = (cache_line *)malloc(sizeof(cache_line));
-  strcpy(dummy -> content, "This is dummy's content");
-  strcpy(dummy -> uri, "This is dummy's uri");
-  dummy -> content_len = 0;
-  dummy -> prev = NULL;
-  dummy -> next = NULL;
-  free_space = MAX_CACHE_SIZE;
-  readcnt = 0;
-  sem_init(&mutex, 0, 1);
-  sem_init(&w, 0, 1);
+  cache_init_mode(CACHE_MODE_LRU, 1);
+}
+
+/*
+ * cache_set_limits - Set the cache's budget in bytes and the largest
+ *   content it takes, in place of MAX_CACHE_SIZE and MAX_OBJECT_SIZE.
+ *   Takes effect at the next cache_init_mode.
+ */
+void cache_set_limits(long size, int max_obj) {
+  cache_size = size;
+  max_object = max_obj;
+}
+
+/* cache_max_object - The largest content the cache takes */
+int cache_max_object() {
+  return max_object;
+}
+
+/* cache_evictions - How many lines every shard has evicted so far */
+long cache_evictions() {
+  long n = 0;
+  int i;
+  for (i = 0; i < nshards; i++) {
+    n += __atomic_load_n(&shards[i].evictions, __ATOMIC_RELAXED);
+  }
+  return n;
+}
+
+/*
+ * cache_init_mode - Initialize a cache of nshards shards, each with a
+ *   pointer point to its own dummy cache_line. The shard count is capped
+ *   so every shard can still hold an object of the largest size.
+ */
+void cache_init_mode(int mode, int num_shards) {
+  int i;
+  cache_shard *shard;
+
+  if (num_shards < 1) {
+    num_shards = 1;
+  }
+  if (num_shards > cache_size / (max_object + MAXLINE)) {
+    num_shards = cache_size / (max_object + MAXLINE);
+  }
+  if (num_shards < 1) {
+    num_shards = 1;
+  }
+  cache_mode = mode;
+  nshards = num_shards;
+  shards = (cache_shard *)calloc(nshards, sizeof(cache_shard));
+  for (i = 0; i < nshards; i++) {
+    shard = &shards[i];
+    shard -> dummy = line_alloc("This is dummy's uri",
+                                "This is dummy's content", 0, NULL, 0);
+    shard -> dummy -> prev = shard -> dummy;
+    shard -> dummy -> next = shard -> dummy;
+    shard -> dummy -> hnext = NULL;
+    shard -> buckets = (cache_line **)calloc(CACHE_HASH_BUCKETS,
+                                             sizeof(cache_line *));
+    shard -> capacity = cache_size / nshards;
+    shard -> free_space = shard -> capacity;
+    shard -> readcnt = 0;
+    shard -> inflation = 0;
+    shard -> sketch = (unsigned char *)calloc(CACHE_SKETCH_ROWS * SKETCH_WIDTH,
+                                              sizeof(unsigned char));
+    shard -> sketch_adds = 0;
+    shard -> evictions = 0;
+    sem_init(&shard -> mutex, 0, 1);
+    sem_init(&shard -> w, 0, 1);
+  }
+}
+
+/*
+ * shard_of - Pick the shard for a hash. FNV-1a barely moves the middle
+ *   bits of uris that differ only near the end, so the hash is mixed first
+ *   and the high bits used, keeping the choice independent of the bucket
+ *   index inside the shard.
+ */
+static cache_shard *shard_of(unsigned int hash) {
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  return &shards[(hash >> 16) % nshards];
+}
+
+/* sketch_slot - The counter of a hash in one row of the sketch */
+static unsigned char *sketch_slot(cache_shard *shard, unsigned int hash,
+                                  int row) {
+  return &shard -> sketch[row * SKETCH_WIDTH +
+                          ((hash * sketch_seeds[row]) >> (32 - CACHE_SKETCH_BITS))];
+}
+
+/*
+ * sketch_add - Count one lookup of a hash. Every SKETCH_SAMPLE adds all
+ *   counters are halved, so old popularity fades. Counters are touched
+ *   with relaxed atomics and no lock; a lost update only blurs a count.
+ */
+static void sketch_add(cache_shard *shard, unsigned int hash) {
+  unsigned char *slot;
+  int i;
+  for (i = 0; i < CACHE_SKETCH_ROWS; i++) {
+    slot = sketch_slot(shard, hash, i);
+    if (__atomic_load_n(slot, __ATOMIC_RELAXED) < SKETCH_MAX) {
+      __atomic_add_fetch(slot, 1, __ATOMIC_RELAXED);
+    }
+  }
+  if (__atomic_add_fetch(&shard -> sketch_adds, 1, __ATOMIC_RELAXED)
+        == SKETCH_SAMPLE) {
+    for (i = 0; i < CACHE_SKETCH_ROWS * SKETCH_WIDTH; i++) {
+      __atomic_store_n(&shard -> sketch[i],
+                       __atomic_load_n(&shard -> sketch[i], __ATOMIC_RELAXED) / 2,
+                       __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&shard -> sketch_adds, 0, __ATOMIC_RELAXED);
+  }
+}
+
+/* sketch_estimate - How often a hash was counted, the least of its rows */
+static int sketch_estimate(cache_shard *shard, unsigned int hash) {
+  int i, n, min = SKETCH_MAX;
+  for (i = 0; i < CACHE_SKETCH_ROWS; i++) {
+    n = __atomic_load_n(sketch_slot(shard, hash, i), __ATOMIC_RELAXED);
+    if (n < min) {
+      min = n;
+    }
+  }
+  return min;
+}
+
+/* gdsf_priority - A line's priority at the shard's current inflation */
+static unsigned long long gdsf_priority(cache_shard *shard, cache_line *c_line,
+                                        int freq) {
+  return __atomic_load_n(&shard -> inflation, __ATOMIC_RELAXED) +
+         freq * GDSF_SCALE / c_line -> charge;
+}
+
+/* reader_lock/reader_unlock - First readers-writers entry/exit protocol */
+static void reader_lock(cache_shard *shard) {
+  P(&shard -> mutex);
+  shard -> readcnt++;
+  if (shard -> readcnt == 1) {
+    P(&shard -> w);
+  }
+  V(&shard -> mutex);
+}
+
+static void reader_unlock(cache_shard *shard) {
+  P(&shard -> mutex);
+  shard -> readcnt--;
+  if (shard -> readcnt == 0) {
+    V(&shard -> w);
+  }
+  V(&shard -> mutex);
+}
+
+/* hash_find - Return the line cached under uri, NULL if there is none */
+static cache_line *hash_find(cache_shard *shard, const char *uri,
+                             unsigned int hash) {
+  cache_line *c_line;
+  for (c_line = shard -> buckets[hash & (CACHE_HASH_BUCKETS - 1)];
+       c_line != NULL; c_line = c_line -> hnext) {
+    if ((c_line -> hash == hash) && !strcasecmp(c_line -> uri, uri)) {
+      return c_line;
+    }
+  }
+  return NULL;
+}
+
+/* heap_set - Put a line at index i of the shard's heap */
+static void heap_set(cache_shard *shard, int i, cache_line *c_line) {
+  shard -> heap[i] = c_line;
+  c_line -> heap_pos = i;
+}
+
+/* heap_up - Move the line at index i up to its place in the heap */
+static void heap_up(cache_shard *shard, int i) {
+  cache_line *c_line = shard -> heap[i];
+  while (i > 0 && shard -> heap[(i - 1) / 2] -> heap_key > c_line -> heap_key) {
+    heap_set(shard, i, shard -> heap[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  heap_set(shard, i, c_line);
+}
+
+/* heap_down - Move the line at index i down to its place in the heap */
+static void heap_down(cache_shard *shard, int i) {
+  cache_line *c_line = shard -> heap[i];
+  int child;
+  while ((child = 2 * i + 1) < shard -> heap_len) {
+    if (child + 1 < shard -> heap_len &&
+        shard -> heap[child + 1] -> heap_key < shard -> heap[child] -> heap_key) {
+      child++;
+    }
+    if (shard -> heap[child] -> heap_key >= c_line -> heap_key) {
+      break;
+    }
+    heap_set(shard, i, shard -> heap[child]);
+    i = child;
+  }
+  heap_set(shard, i, c_line);
+}
+
+/* heap_push - Add a line to the shard's heap at its current priority */
+static void heap_push(cache_shard *shard, cache_line *c_line) {
+  if (shard -> heap_len == shard -> heap_cap) {
+    shard -> heap_cap = shard -> heap_cap ? 2 * shard -> heap_cap : 64;
+    shard -> heap = (cache_line **)Realloc(shard -> heap,
+                                           shard -> heap_cap *
+                                           sizeof(cache_line *));
+  }
+  c_line -> heap_key = c_line -> priority;
+  heap_set(shard, shard -> heap_len++, c_line);
+  heap_up(shard, c_line -> heap_pos);
+}
+
+/* heap_remove - Take a line out of the shard's heap */
+static void heap_remove(cache_shard *shard, cache_line *c_line) {
+  int i = c_line -> heap_pos;
+  cache_line *last = shard -> heap[--shard -> heap_len];
+  if (i < shard -> heap_len) {
+    heap_set(shard, i, last);
+    heap_down(shard, i);
+    heap_up(shard, last -> heap_pos);
+  }
+}
+
+/*
+ * hash_insert - Link the line into the head of its bucket chain, and in
+ *   CACHE_MODE_GDSF into the heap
+ */
+static void hash_insert(cache_shard *shard, cache_line *c_line) {
+  cache_line **bucket =
+    &shard -> buckets[c_line -> hash & (CACHE_HASH_BUCKETS - 1)];
+  c_line -> hnext = *bucket;
+  *bucket = c_line;
+  if (cache_mode == CACHE_MODE_GDSF) {
+    heap_push(shard, c_line);
+  }
+}
+
+/* hash_delete - Unlink the line from its bucket chain, and the heap */
+static void hash_delete(cache_shard *shard, cache_line *c_line) {
+  cache_line **pp =
+    &shard -> buckets[c_line -> hash & (CACHE_HASH_BUCKETS - 1)];
+  if (cache_mode == CACHE_MODE_GDSF) {
+    heap_remove(shard, c_line);
+  }
+  while (*pp != NULL) {
+    if (*pp == c_line) {
+      *pp = c_line -> hnext;
+      return;
+    }
+    pp = &((*pp) -> hnext);
+  }
+}
+
+/*
+ * lookup - Find the line cached under uri and pin it. A stale line is
+ *   returned if stale_ok, else dropped from the cache.
+ */
+static cache_line *lookup(char *uri, int stale_ok) {
+  cache_line *c_line;
+  unsigned int hash = uri_hash(uri);
+  cache_shard *shard = shard_of(hash);
+
+  if (admission == CACHE_ADMIT_TINYLFU) {
+    sketch_add(shard, hash);
+  }
+  reader_lock(shard);
+  if ((c_line = hash_find(shard, uri, hash)) != NULL) {
+    __atomic_add_fetch(&c_line -> refcnt, 1, __ATOMIC_RELAXED);
+    if (cache_mode == CACHE_MODE_CLOCK &&
+        !__atomic_load_n(&c_line -> referenced, __ATOMIC_RELAXED)) {
+      __atomic_store_n(&c_line -> referenced, 1, __ATOMIC_RELAXED);
+    }
+    if (cache_mode == CACHE_MODE_GDSF) {
+      __atomic_store_n(&c_line -> priority,
+        gdsf_priority(shard, c_line,
+                      __atomic_add_fetch(&c_line -> freq, 1, __ATOMIC_RELAXED)),
+        __ATOMIC_RELAXED);
+    }
+  }
+  reader_unlock(shard);
+
+  if (c_line == NULL) {
+    log_debug("Cache obj not found.");
+    return NULL;
+  }
+  if (!stale_ok && cache_expired(c_line)) {
+    log_debug("Cache obj expired.");
+    P(&shard -> w);
+    if (c_line -> next != NULL) { // unless someone else dropped it first
+      shard -> free_space = shard -> free_space + c_line -> charge;
+      delete(c_line);
+      hash_delete(shard, c_line);
+      cache_release(c_line);
+    }
+    V(&shard -> w);
+    cache_release(c_line);
+    return NULL;
+  }
+  if (cache_mode == CACHE_MODE_LRU) {
+    /* Promote to the head, unless it was evicted after the reader lock */
+    P(&shard -> w);
+    if (c_line -> next != NULL) {
+      delete(c_line);
+      insert(shard, c_line);
+    }
+    V(&shard -> w);
+  }
+  return c_line;
+}
+
+/*
+ * cache_lookup - Find the line cached under uri and pin it, so its content
+ *   stays valid until cache_release even if it is evicted meanwhile.
+ *   Return NULL if it is not cached, or if it has gone stale, which drops
+ *   it from the cache.
+ */
+cache_line *cache_lookup(char *uri) {
+  return lookup(uri, 0);
+}
+
+/*
+ * cache_lookup_stale - Like cache_lookup, but a stale line is kept and
+ *   returned too, for the caller to revalidate. Check it with cache_expired.
+ */
+cache_line *cache_lookup_stale(char *uri) {
+  return lookup(uri, 1);
+}
+
+/*
+ * cache_line_new - A complete line of hdr followed by body that is not in
+ *   the cache, for content from elsewhere to be served like a hit. Return
+ *   it pinned once, for cache_release to free, or NULL if malloc fails.
+ */
+cache_line *cache_line_new(char *uri, char *hdr, int hdr_len, char *body,
+                           int body_len, long expires) {
+  cache_line *c_line = line_alloc(uri, hdr, hdr_len, body, body_len);
+
+  if (c_line != NULL) {
+    c_line -> expires = expires;
+  }
+  return c_line;
+}
+
+/* cache_pin - Take one more reference to a line already pinned */
+void cache_pin(cache_line *c_line) {
+  __atomic_add_fetch(&c_line -> refcnt, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * cache_release - Drop one reference to a line, freeing it once it has
+ *   been evicted and nobody has it pinned any more.
+ */
+void cache_release(cache_line *c_line) {
+  if (__atomic_sub_fetch(&c_line -> refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(c_line);
+  }
 }
 
 /*
@@ -61,42 +507,17 @@ void cache_init() {
  */
 int get_cached_obj(char *uri, char *content, int *content_len) {
   cache_line *c_line;
-  P(&mutex);
-  readcnt++;
-  if (readcnt == 1) {
-    P(&w);
-  }
-  V(&mutex);
-
-
-  if ((dummy -> next) != NULL) {
-    for (c_line = dummy -> next; c_line != NULL; c_line = c_line -> next) {
-      if (!strcasecmp(c_line -> uri, uri)) {
-        memcpy(content, c_line -> content, c_line -> content_len); // copy info
-        *content_len = c_line -> content_len; // same to above
-        P(&mutex);
-        readcnt--;
-        if (readcnt == 0) {
-          V(&w);
-        }
-        V(&mutex);
-        // TODO: update the cache structure
-        P(&w);
-        delete(c_line);
-        insert(c_line);
-        V(&w);
-        return 0;
-      }
-    }
+  if ((c_line = cache_lookup(uri)) == NULL) {
+    return 1;
   }
-  P(&mutex);
-  readcnt--;
-  if (readcnt == 0) {
-    V(&w);
+  if (!cache_complete(c_line)) { // not all there to copy yet
+    cache_release(c_line);
+    return 1;
   }
-  V(&mutex);
-  printf("Cache obj not found.\n");
-  return 1;
+  memcpy(content, c_line -> content, c_line -> content_len); // copy info
+  *content_len = c_line -> content_len; // same to above
+  cache_release(c_line);
+  return 0;
 }
 
 /*
@@ -104,112 +525,467 @@ int get_cached_obj(char *uri, char *content, int *content_len) {
  *  On error, return 1 instead;
  */
 int put_cached_content(char *uri, char *content, int content_len) {
-  if (content_len > MAX_OBJECT_SIZE) {
-    printf("Error: Content length exceed the maximum object length.\n");
+  return put_cached_response(uri, NULL, 0, content, content_len, 0);
+}
+
+/*
+ * gdsf_victim - The line of lowest priority in a shard, NULL if it is
+ *   empty. A top whose priority rose with hits since it was placed is
+ *   placed again, until the top's key is its priority: every other key is
+ *   at least as high, and so is every other priority.
+ *   Called with the shard's writer lock held.
+ */
+static cache_line *gdsf_victim(cache_shard *shard) {
+  cache_line *top;
+  unsigned long long priority;
+  while (shard -> heap_len > 0) {
+    top = shard -> heap[0];
+    priority = __atomic_load_n(&top -> priority, __ATOMIC_RELAXED);
+    if (priority == top -> heap_key) {
+      return top;
+    }
+    top -> heap_key = priority;
+    heap_down(shard, 0);
+  }
+  return NULL;
+}
+
+/*
+ * admit - Should a new line that needs room evict lines for it? Under
+ *   CACHE_ADMIT_TINYLFU only if its uri was looked up more often than the
+ *   first line evict would take. Called with the shard's writer lock held.
+ */
+static int admit(cache_shard *shard, cache_line *c_ins) {
+  cache_line *victim;
+  if (admission != CACHE_ADMIT_TINYLFU) {
+    return 1;
+  }
+  if (cache_mode == CACHE_MODE_GDSF) {
+    victim = gdsf_victim(shard);
+  } else {
+    victim = shard -> dummy -> prev;
+  }
+  if (victim == NULL || victim == shard -> dummy) {
     return 1;
   }
-  P(&w);
-  if (free_space < content_len) {
-    // TODO: eviction
-    evict(content_len);
+  return sketch_estimate(shard, c_ins -> hash) >
+         sketch_estimate(shard, victim -> hash);
+}
+
+/*
+ * publish - Link a new line into its shard, replacing the line already
+ *   cached for its uri and evicting as needed. On error, or if the
+ *   admission policy turns the line away, it is freed and 1 returned.
+ */
+static int publish(cache_line *c_ins) {
+  cache_line *old, *victims = NULL;
+  unsigned int hash = uri_hash(c_ins -> uri);
+  cache_shard *shard = shard_of(hash);
+  if (c_ins -> charge > shard -> capacity) {
+    log_debug("Cache line exceed the shard capacity.");
+    free(c_ins);
+    return 1;
   }
+  c_ins -> hash = hash;
 
-  cache_line *c_ins = (cache_line *)malloc(sizeof(cache_line));
-  strcpy(c_ins -> uri, uri);
-  memcpy(c_ins -> content, content, content_len);
-  c_ins -> content_len = content_len;
-  insert(c_ins);
-  free_space = free_space - content_len;
-  V(&w);
+  P(&shard -> w);
+  if ((old = hash_find(shard, c_ins -> uri, hash)) != NULL) { // newer wins
+    shard -> free_space = shard -> free_space + old -> charge;
+    delete(old);
+    hash_delete(shard, old);
+    cache_release(old);
+  }
+  if (shard -> free_space < c_ins -> charge) {
+    if (!admit(shard, c_ins)) {
+      V(&shard -> w);
+      free(c_ins);
+      return 1;
+    }
+    evict(shard, c_ins -> charge, &victims);
+  }
+  if (cache_mode == CACHE_MODE_GDSF) {
+    c_ins -> priority = gdsf_priority(shard, c_ins, c_ins -> freq);
+  }
+  insert(shard, c_ins);
+  hash_insert(shard, c_ins);
+  shard -> free_space = shard -> free_space - c_ins -> charge;
+  V(&shard -> w);
+
+  while ((old = victims) != NULL) { // demote outside the lock
+    victims = old -> hnext;
+    if (demote != NULL && cache_complete(old) && !cache_expired(old)) {
+      demote(old);
+    }
+    cache_release(old);
+  }
   return 0;
 }
 
 /*
- * insert - Insert the new cache line into cache structure,
- *  which is the the linkedlist head.
+ * cache_set_demote - Have every complete line evicted from now on passed
+ *   to fn before it is released. fn must not keep the line.
  */
-void insert(cache_line *cache_ins) {
-  if ((dummy -> next) == NULL) { // Cache is empty, just insert.
-    dummy -> next = cache_ins;
-    cache_ins -> prev = dummy;
-  } else {
-    cache_ins -> next = dummy -> next; // let cache next point to real head
-    (dummy -> next) -> prev = cache_ins; // let cache next's prev point to ins
-    dummy -> next = cache_ins; // let dummy next point to ins;
-    cache_ins -> prev = dummy; // ins prev point back to dummy;
+void cache_set_demote(void (*fn)(cache_line *c_line)) {
+  demote = fn;
+}
+
+/*
+ * cache_set_admission - Pick the admission policy, CACHE_ADMIT_ALL or
+ *   CACHE_ADMIT_TINYLFU, for lines published from now on.
+ */
+void cache_set_admission(int policy) {
+  admission = policy;
+}
+
+/*
+ * put_cached_response - Store a response given as its header and body.
+ *   The line's content is the two joined, and hdr_len records where the
+ *   body starts. It goes stale at time expires, never if 0. A line already
+ *   cached for the uri is replaced.
+ *   On error, return 1 instead;
+ */
+int put_cached_response(char *uri, char *hdr, int hdr_len,
+                        char *body, int body_len, long expires) {
+  cache_line *c_ins;
+  if (hdr_len + body_len > max_object) {
+    log_debug("Content length exceed the maximum object length.");
+    return 1;
   }
+  if ((c_ins = line_alloc(uri, hdr, hdr_len, body, body_len)) == NULL) {
+    log_error("Malloc cache line failed.");
+    return 1;
+  }
+  c_ins -> expires = expires;
+  return publish(c_ins);
 }
 
-/* delete - Remove the corresponding node from the cache list */
-void delete(cache_line *cache_ins) {
-  /* Only cache line in the list */
-  if (((dummy -> next) == cache_ins) && ((cache_ins -> next) == NULL)) {
-    dummy -> next = NULL;
+/*
+ * cache_fill_begin - Publish a line for a response whose body of body_len
+ *   bytes is still to come, so other clients can start reading it at
+ *   once. It goes stale at time expires, never if 0. Return the line
+ *   pinned for the caller, who passes the body on with cache_fill and must
+ *   finish with cache_fill_end. Return NULL if it can't be cached.
+ */
+cache_line *cache_fill_begin(char *uri, char *hdr, int hdr_len, int body_len,
+                             long expires) {
+  cache_line *c_ins;
+  if (hdr_len + body_len > max_object) {
+    return NULL;
   }
-  // point to the last line in the cache not the first line
-  else if (((cache_ins -> next) == NULL) && ((cache_ins -> prev) != dummy)) {
-    (cache_ins -> prev) -> next = NULL;
+  if ((c_ins = line_alloc(uri, hdr, hdr_len, NULL, body_len)) == NULL) {
+    log_error("Malloc cache line failed.");
+    return NULL;
   }
-  // point to the first line in cache not the last line
-  else if (((cache_ins -> prev) == dummy) &&
-           ((cache_ins -> next) -> next != NULL)) {
-    dummy -> next = cache_ins -> next; // skip
-    cache_ins -> prev = dummy; // point back
+  c_ins -> expires = expires;
+  c_ins -> fill_state = CACHE_FILLING;
+  c_ins -> filled = hdr_len;
+  c_ins -> refcnt = 2; // the cache and the filler
+  if (publish(c_ins)) {
+    return NULL;
   }
-  else if (((cache_ins -> prev) != dummy) && ((cache_ins -> next) != NULL)) {
-    (cache_ins -> prev) -> next = cache_ins -> next; // skip
-    (cache_ins -> next) -> prev = cache_ins -> prev; // point back
+  return c_ins;
+}
+
+/* wake - Wake every reader waiting on the line. Caller holds fill_mutex. */
+static void wake(cache_line *c_line) {
+  while (c_line -> fill_waiters > 0) {
+    c_line -> fill_waiters--;
+    V(&c_line -> more);
   }
 }
 
+/* cache_fill - Append the next len bytes of body to a filling line */
+void cache_fill(cache_line *c_line, char *buf, int len) {
+  if (len > c_line -> content_len - c_line -> filled) {
+    len = c_line -> content_len - c_line -> filled; // more than announced
+  }
+  memcpy(c_line -> content + c_line -> filled, buf, len);
+  P(&c_line -> fill_mutex);
+  c_line -> filled = c_line -> filled + len;
+  wake(c_line);
+  V(&c_line -> fill_mutex);
+}
+
 /*
- * evict - Evict cache line to meet the requirement
+ * cache_fill_end - The filler is done with the line. A complete line
+ *   becomes an ordinary one; an incomplete one is dropped from the cache,
+ *   and readers still on it see it aborted. Unpins the filler's reference.
  */
-void evict(int content_len) {
-  cache_line *tail = dummy;
-  cache_line *tmp;
-  while ((tail -> next) != NULL) {
-    tail = tail -> next;
+void cache_fill_end(cache_line *c_line, int complete) {
+  cache_shard *shard = shard_of(c_line -> hash);
+
+  complete = complete && c_line -> filled == c_line -> content_len;
+  if (!complete) {
+    P(&shard -> w);
+    if (c_line -> next != NULL) { // still cached
+      shard -> free_space = shard -> free_space + c_line -> charge;
+      delete(c_line);
+      hash_delete(shard, c_line);
+      cache_release(c_line);
+    }
+    V(&shard -> w);
   }
+  P(&c_line -> fill_mutex);
+  __atomic_store_n(&c_line -> fill_state,
+                   complete ? CACHE_FILLED : CACHE_ABORTED, __ATOMIC_RELEASE);
+  wake(c_line);
+  V(&c_line -> fill_mutex);
+  cache_release(c_line);
+}
 
-  while ((tail != dummy) && (free_space < content_len)) {
-    free_space = free_space + (tail -> content_len);
-    tmp = tail;
-    tail = tail -> prev;
-    delete(tmp);
-    free(tmp);
+/*
+ * cache_wait - Wait until a pinned line has more than seen bytes of
+ *   content in place, or its fill is over. Return how many bytes are in
+ *   place, or -1 if the fill was aborted.
+ */
+int cache_wait(cache_line *c_line, int seen) {
+  int filled;
+  while (1) {
+    P(&c_line -> fill_mutex);
+    if (c_line -> fill_state == CACHE_ABORTED) {
+      V(&c_line -> fill_mutex);
+      return -1;
+    }
+    if (c_line -> filled > seen || c_line -> fill_state == CACHE_FILLED) {
+      filled = c_line -> filled;
+      V(&c_line -> fill_mutex);
+      return filled;
+    }
+    c_line -> fill_waiters++;
+    V(&c_line -> fill_mutex);
+    P(&c_line -> more);
+  }
+}
+
+/* cache_expired - Has the line gone stale? */
+int cache_expired(cache_line *c_line) {
+  long expires = __atomic_load_n(&c_line -> expires, __ATOMIC_RELAXED);
+  return expires != 0 && time(NULL) >= expires;
+}
+
+/*
+ * cache_refresh - The server confirmed a stale line is still good, it
+ *   stays fresh until expires. Its content is left as it is.
+ */
+void cache_refresh(cache_line *c_line, long expires) {
+  __atomic_store_n(&c_line -> expires, expires, __ATOMIC_RELAXED);
+}
+
+/*
+ * cache_claim_refresh - Become the one revalidating a stale line in the
+ *   background. Return 1 if the caller did and must call cache_end_refresh
+ *   once done, 0 if a refresh is already on.
+ */
+int cache_claim_refresh(cache_line *c_line) {
+  return !__atomic_exchange_n(&c_line -> refreshing, 1, __ATOMIC_ACQ_REL);
+}
+
+/* cache_end_refresh - The background refresh claimed on a line is over */
+void cache_end_refresh(cache_line *c_line) {
+  __atomic_store_n(&c_line -> refreshing, 0, __ATOMIC_RELEASE);
+}
+
+/* cache_complete - Is the line's whole content in place? */
+int cache_complete(cache_line *c_line) {
+  return __atomic_load_n(&c_line -> fill_state, __ATOMIC_ACQUIRE)
+           == CACHE_FILLED;
+}
+
+/*
+ * insert - Insert the new cache line into cache structure,
+ *  which is the the linkedlist head.
+ */
+void insert(cache_shard *shard, cache_line *cache_ins) {
+  cache_line *dummy = shard -> dummy;
+  cache_ins -> next = dummy -> next; // let cache next point to real head
+  cache_ins -> prev = dummy; // ins prev point back to dummy
+  (dummy -> next) -> prev = cache_ins; // real head (or dummy) point back
+  dummy -> next = cache_ins; // let dummy next point to ins
+}
+
+/* delete - Remove the corresponding node from the cache list */
+void delete(cache_line *cache_ins) {
+  (cache_ins -> prev) -> next = cache_ins -> next; // skip
+  (cache_ins -> next) -> prev = cache_ins -> prev; // point back
+  cache_ins -> next = NULL;
+  cache_ins -> prev = NULL;
+}
+
+/*
+ * evict - Evict cache line from the LRU tail to meet the requirement.
+ *   In CACHE_MODE_CLOCK a referenced tail has its bit cleared and goes back
+ *   to the head instead; every line is passed over at most once.
+ *   In CACHE_MODE_GDSF the line of lowest priority goes instead of the
+ *   tail, and the shard's inflation rises to its priority.
+ *   Evicted lines are chained on *victims through hnext, still holding the
+ *   cache's reference for the caller to drop.
+ *   Called with the shard's writer lock held.
+ */
+void evict(cache_shard *shard, int charge, cache_line **victims) {
+  cache_line *dummy = shard -> dummy;
+  cache_line *tail;
+  while (((tail = dummy -> prev) != dummy) &&
+         (shard -> free_space < charge)) {
+    if (cache_mode == CACHE_MODE_GDSF) {
+      tail = gdsf_victim(shard);
+      __atomic_store_n(&shard -> inflation, tail -> priority, __ATOMIC_RELAXED);
+    } else if (__atomic_load_n(&tail -> referenced, __ATOMIC_RELAXED)) {
+      __atomic_store_n(&tail -> referenced, 0, __ATOMIC_RELAXED);
+      delete(tail);
+      insert(shard, tail);
+      continue;
+    }
+    shard -> free_space = shard -> free_space + (tail -> charge);
+    delete(tail);
+    hash_delete(shard, tail);
+    tail -> hnext = *victims;
+    *victims = tail;
+    __atomic_store_n(&shard -> evictions, shard -> evictions + 1,
+                     __ATOMIC_RELAXED);
   }
-  if (free_space < content_len) {
-    printf("Freeing all content doesn't not meet the requirement.\n");
+  if (shard -> free_space < charge) {
+    log_warn("Freeing all content doesn't not meet the requirement.");
   }
 }
 
 /* free_cache - Free the whole cache structure after the malloc */
 void free_cache() {
-  P(&w);
-  cache_line *ptr = dummy;
-  while (ptr != NULL) {
-    cache_line *tmp = ptr;
-    ptr = ptr -> next;
-    free(tmp);
+  int i;
+  cache_line *ptr, *tmp;
+  for (i = 0; i < nshards; i++) {
+    P(&shards[i].w);
+    ptr = shards[i].dummy -> next;
+    while (ptr != shards[i].dummy) {
+      tmp = ptr;
+      ptr = ptr -> next;
+      cache_release(tmp);
+    }
+    free(shards[i].dummy);
+    free(shards[i].buckets);
+    free(shards[i].sketch);
+    free(shards[i].heap);
+    V(&shards[i].w);
   }
-  V(&w);
+  free(shards);
+  shards = NULL;
+  nshards = 0;
+}
+
+/*
+ * cache_save - Write every complete, fresh line to a snapshot at path,
+ *   oldest first within each shard. The file is written beside path and
+ *   renamed over it, so an old snapshot is only replaced by a whole one.
+ *   Return 0 on success, 1 on error.
+ */
+int cache_save(char *path) {
+  char tmp[MAXLINE];
+  unsigned int magic = SNAPSHOT_MAGIC;
+  snapshot_record rec;
+  cache_line *ptr;
+  int fd, i, rc = 0;
+
+  snprintf(tmp, MAXLINE, "%s.tmp", path);
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    return 1;
+  }
+  if (rio_writen(fd, &magic, sizeof(magic)) < 0) {
+    rc = 1;
+  }
+  memset(&rec, 0, sizeof(rec)); // no stray stack bytes in its padding
+  for (i = 0; i < nshards && !rc; i++) {
+    P(&shards[i].w);
+    for (ptr = shards[i].dummy -> prev; ptr != shards[i].dummy && !rc;
+         ptr = ptr -> prev) {
+      if (!cache_complete(ptr) || cache_expired(ptr)) {
+        continue;
+      }
+      rec.uri_len = strlen(ptr -> uri);
+      rec.content_len = ptr -> content_len;
+      rec.hdr_len = ptr -> hdr_len;
+      rec.expires = ptr -> expires;
+      if (rio_writen(fd, &rec, sizeof(rec)) < 0 ||
+          rio_writen(fd, ptr -> uri, rec.uri_len) < 0 ||
+          rio_writen(fd, ptr -> content, rec.content_len) < 0) {
+        rc = 1;
+      }
+    }
+    V(&shards[i].w);
+  }
+  if (close(fd) < 0 || rc || rename(tmp, path) < 0) {
+    unlink(tmp);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * cache_load - Map a snapshot written by cache_save and publish its lines
+ *   in order, which rebuilds each shard's LRU order. Lines that went stale
+ *   meanwhile are skipped, and lines that no longer fit are evicted as
+ *   usual. Return the number of lines loaded, or -1 if
+ *   there is no usable snapshot at path.
+ */
+int cache_load(char *path) {
+  struct stat st;
+  snapshot_record rec;
+  char *map, *p, *end, uri[MAXLINE];
+  int fd, n = 0;
+
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    return -1;
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(unsigned int) ||
+      (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+        == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  if (*(unsigned int *)map != SNAPSHOT_MAGIC) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+  end = map + st.st_size;
+  for (p = map + sizeof(unsigned int); end - p >= sizeof(rec); ) {
+    memcpy(&rec, p, sizeof(rec));
+    p += sizeof(rec);
+    if (rec.uri_len < 0 || rec.uri_len >= MAXLINE || rec.content_len < 0 ||
+        rec.hdr_len < 0 || rec.hdr_len > rec.content_len ||
+        end - p < (long)rec.uri_len + rec.content_len) {
+      break; // truncated or corrupt, keep what came before
+    }
+    memcpy(uri, p, rec.uri_len);
+    uri[rec.uri_len] = '\0';
+    p += rec.uri_len;
+    if ((rec.expires == 0 || rec.expires > time(NULL)) &&
+        !put_cached_response(uri, p, rec.hdr_len, p + rec.hdr_len,
+                             rec.content_len - rec.hdr_len, rec.expires)) {
+      n++;
+    }
+    p += rec.content_len;
+  }
+  munmap(map, st.st_size);
+  return n;
 }
 
 /* display_cache - Display the cache structure */
 void display_cache() {
-  char c[CONTENT_DISPLAY_LEN];
   cache_line *ptr;
-  strncpy(c, dummy -> content, CONTENT_DISPLAY_LEN);
+  int i;
   printf("****************************************\n");
   printf("Display the cache structure.\n");
-  printf("Cache uri: %s, content length: %d, content: %s\n",
-    dummy -> uri, dummy -> content_len, c);
-  for (ptr = dummy -> next; ptr != NULL; ptr = ptr -> next) {
-      strncpy(c, ptr -> content, CONTENT_DISPLAY_LEN);
-      printf("Cache uri: %s, content length: %d, content: %s\n",
-        ptr -> uri, ptr -> content_len, c);
-  }
-  printf("Current remaining space is %d.\n", free_space);
+  for (i = 0; i < nshards; i++) {
+    printf("Shard %d\n", i);
+    printf("Cache uri: %s, content length: %d, content: %.*s\n",
+      shards[i].dummy -> uri, shards[i].dummy -> content_len,
+      CONTENT_DISPLAY_LEN, shards[i].dummy -> content);
+    for (ptr = shards[i].dummy -> next; ptr != shards[i].dummy;
+         ptr = ptr -> next) {
+      printf("Cache uri: %s, content length: %d, charge: %d, content: %.*s\n",
+        ptr -> uri, ptr -> content_len, ptr -> charge,
+        CONTENT_DISPLAY_LEN, ptr -> content);
+    }
+    printf("Current remaining space is %ld.\n", shards[i].free_space);
+  }
   printf("****************************************\n");
 }
@@ -3,27 +3,122 @@
 #include <stdlib.h>
 #include <semaphore.h>
 #include "csapp.h"
-/* Recommended max cache and object sizes */
+/* Default max cache and object sizes, see cache_set_limits */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 #define CONTENT_DISPLAY_LEN 50
 #define	MAXLINE	 8192  /* Max text line length */
+#define CACHE_HASH_BUCKETS 4096 /* Per shard, must be a power of 2 */
+#define CACHE_SHARDS 8 /* Shards used by the concurrent mode */
+#define CACHE_SKETCH_BITS 12 /* log2 of the counters per sketch row */
+#define CACHE_SKETCH_ROWS 4 /* Hashes per uri in the frequency sketch */
 
-/* Cache line definition, which is simply a node of doubly linkedlist */
+/* Fill states of a line */
+#define CACHE_FILLED 0  /* content complete, read it without any lock */
+#define CACHE_FILLING 1 /* content still arriving, wait for more bytes */
+#define CACHE_ABORTED 2 /* the server failed, content will stay partial */
+
+/* Cache modes */
+#define CACHE_MODE_LRU 0   /* Strict LRU, a hit promotes under the writer lock */
+#define CACHE_MODE_CLOCK 1 /* Second chance, a hit only sets the ref bit */
+#define CACHE_MODE_GDSF 2  /* Greedy-Dual-Size-Frequency, evict the line of
+                              least frequency per byte, aged by inflation */
+
+/* Admission policies, checked when a new line would evict others */
+#define CACHE_ADMIT_ALL 0     /* Admit every line that fits */
+#define CACHE_ADMIT_TINYLFU 1 /* Admit only if seen more than the victim */
+
+/*
+ * Cache line definition, which is a node of the circular doubly linkedlist
+ * (LRU order) and of one hash bucket chain (lookup by uri). The uri and
+ * content never change once the line is inserted, so a pinned line can be
+ * read without holding any lock.
+ *
+ * A line is a single allocation sized to fit: uri and content live in the
+ * trailing data array, and charge is the whole block counted against the
+ * shard's budget.
+ *
+ * A line can be published while its content is still being downloaded.
+ * Until fill_state leaves CACHE_FILLING only the first filled bytes are
+ * valid, and readers wait on more for the rest.
+ */
 typedef struct cache {
-  char content[MAX_OBJECT_SIZE];
-  char uri[MAXLINE];
+  char *content; /* content_len bytes in data, NUL terminated for display */
+  char *uri; /* NUL terminated, in data after content */
   struct cache *next;
   struct cache *prev;
+  struct cache *hnext; /* next line in the same hash bucket */
+  unsigned int hash; /* precomputed hash of uri */
+  int referenced; /* CLOCK reference bit, set by hits with an atomic store */
+  int freq; /* GDSF hit count, bumped by hits atomically */
+  unsigned long long priority; /* GDSF key, the lowest is evicted first */
+  unsigned long long heap_key; /* priority when last placed in the heap */
+  int heap_pos; /* index in the shard's GDSF heap */
+  int refcnt; /* One for the cache while linked, plus one per pinned hit */
   int content_len;
+  int hdr_len; /* content starts with a header this long, 0 if unknown */
+  long expires; /* time the line goes stale, 0 if it never does */
+  int refreshing; /* a background revalidation is on, see cache_claim_refresh */
+  int charge; /* bytes of memory this line costs */
+  int fill_state; /* CACHE_FILLED unless published by cache_fill_begin */
+  int filled; /* bytes of content in place while filling */
+  int fill_waiters; /* readers blocked on more */
+  sem_t fill_mutex; /* Initially = 1, protects the three fields above */
+  sem_t more; /* posted once per waiter when bytes land or the fill ends */
+  char data[];
 } cache_line;
 
+/*
+ * One independently locked slice of the cache. A uri always maps to the
+ * same shard, and each shard owns an equal part of the cache's budget.
+ */
+typedef struct {
+  cache_line *dummy; /* dummy -> next is the head, dummy -> prev the tail */
+  cache_line **buckets; /* uri hash index into the list */
+  long capacity; /* this shard's part of the budget */
+  long free_space;
+  int readcnt; /* Initially = 0 */
+  unsigned long long inflation; /* GDSF clock, priority of the last victim */
+  cache_line **heap; /* GDSF min-heap of the lines by heap_key */
+  int heap_len, heap_cap;
+  unsigned char *sketch; /* count-min rows of 4 bit counters by uri hash */
+  int sketch_adds; /* counted since the sketch was last halved */
+  long evictions; /* lines evicted, under the writer lock */
+  sem_t mutex, w; /* Both initially = 1 */
+} cache_shard;
+
 /* Proto for cache */
 void cache_init();
+void cache_init_mode(int mode, int nshards);
+void cache_set_limits(long size, int max_object);
+int cache_max_object();
+long cache_evictions();
 void free_cache();
+cache_line *cache_lookup(char *uri);
+cache_line *cache_lookup_stale(char *uri);
+cache_line *cache_line_new(char *uri, char *hdr, int hdr_len, char *body,
+                           int body_len, long expires);
+void cache_pin(cache_line *c_line);
+void cache_release(cache_line *c_line);
 int get_cached_obj(char *uri, char *content, int *content_len);
 int put_cached_content(char *uri, char *content, int content_len);
-void insert(cache_line *cache_ins);
+int put_cached_response(char *uri, char *hdr, int hdr_len,
+                        char *body, int body_len, long expires);
+cache_line *cache_fill_begin(char *uri, char *hdr, int hdr_len, int body_len,
+                             long expires);
+int cache_expired(cache_line *c_line);
+void cache_refresh(cache_line *c_line, long expires);
+int cache_claim_refresh(cache_line *c_line);
+void cache_end_refresh(cache_line *c_line);
+void cache_fill(cache_line *c_line, char *buf, int len);
+void cache_fill_end(cache_line *c_line, int complete);
+int cache_wait(cache_line *c_line, int seen);
+int cache_complete(cache_line *c_line);
+void insert(cache_shard *shard, cache_line *cache_ins);
 void delete(cache_line *cache_ins);
-void evict(int content_len);
+void evict(cache_shard *shard, int charge, cache_line **victims);
+void cache_set_demote(void (*fn)(cache_line *c_line));
+void cache_set_admission(int policy);
+int cache_save(char *path);
+int cache_load(char *path);
 void display_cache();
@@ -0,0 +1,320 @@
+/*
+ * disk.c - second cache tier, a log of memory-mapped segment files
+ *
+ * Lines evicted from the in-memory cache are demoted here. The tier is a
+ * circular log of fixed-size segment files, each mapped into memory: an
+ * object is appended to the active segment as a record (a disk_record
+ * header, the uri, then the content), and an in-memory index maps the uri
+ * to its latest record. Hits are served from the segment's file with
+ * sendfile, after the header is taken from the mapping.
+ *
+ * When the active segment is full the log moves on to the next one, which
+ * is the oldest, skipping any segment a hit is still sending from. Before
+ * it is reused the cleaner goes over its records: objects hit since they
+ * were written are compacted to the front of the segment and kept, the
+ * rest are dropped from the index. If what is kept leaves no room for the
+ * new object, the log moves on again. Kept objects lose their mark, so
+ * once it has gone round every segment the next one cleaned is emptied:
+ * an object gets one second chance per round. The tier never holds more
+ * than nsegments * segment_size bytes. Stale objects are dropped by the
+ * lookup that finds them, and by the cleaner.
+ *
+ * One semaphore protects the index and the log. A hit pins its segment
+ * rather than holding the lock while it sends. Hits only pin a segment
+ * under the lock, so one found unpinned under it stays that way while it
+ * is cleaned; nothing ever waits on a reader with the lock held, however
+ * slow its client.
+ */
+#include <sys/sendfile.h>
+#include "disk.h"
+#include "hash.h"
+#include "log.h"
+
+#define DISK_MAGIC 0x70726f78
+#define DISK_ALIGN(n) (((n) + 7) & ~7)
+
+/* Record header, at an 8 byte aligned offset in a segment */
+typedef struct {
+  unsigned int magic;
+  int uri_len; /* including the NUL */
+  int content_len;
+  int hdr_len;
+  long expires; /* time the object goes stale, 0 if it never does */
+} disk_record;
+
+/* Where the latest copy of a uri is */
+typedef struct disk_entry {
+  char *uri;
+  unsigned int hash;
+  int seg;
+  int offset; /* of the record in the segment */
+  int referenced; /* hit since written, the cleaner keeps it */
+  struct disk_entry *next; /* next entry in the same bucket */
+} disk_entry;
+
+typedef struct {
+  int fd;
+  char *map;
+  int used; /* bytes of records, the append offset */
+  int readers; /* hits still sending from it */
+} segment_t;
+
+static segment_t *segs;
+static int nsegs;
+static int seg_size;
+static int active; /* segment being appended to */
+static disk_entry **buckets;
+static sem_t mutex; /* Initially = 1 */
+
+/*
+ * disk_init - Create the log of nsegments files of segment_size bytes in
+ *   dir, empty. Segment files a previous run left there are truncated:
+ *   the index only lives in memory, so their records can't be found
+ *   again. Return 0 on success, 1 if the files can't be set up, in which
+ *   case the tier stays off.
+ */
+int disk_init(char *dir, int nsegments, int segment_size) {
+  char path[MAXLINE];
+  int i;
+
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+    log_error("Disk cache: cannot create %s: %s", dir, strerror(errno));
+    return 1;
+  }
+  segs = (segment_t *)Calloc(nsegments, sizeof(segment_t));
+  for (i = 0; i < nsegments; i++) {
+    snprintf(path, MAXLINE, "%s/segment-%03d", dir, i);
+    segs[i].map = MAP_FAILED;
+    if ((segs[i].fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ||
+        ftruncate(segs[i].fd, segment_size) < 0 ||
+        (segs[i].map = mmap(NULL, segment_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, segs[i].fd, 0)) == MAP_FAILED) {
+      log_error("Disk cache: cannot map %s: %s", path, strerror(errno));
+      nsegs = i + 1; // what disk_free has to undo
+      seg_size = segment_size;
+      disk_free();
+      return 1;
+    }
+  }
+  nsegs = nsegments;
+  seg_size = segment_size;
+  active = 0;
+  buckets = (disk_entry **)Calloc(DISK_BUCKETS, sizeof(disk_entry *));
+  Sem_init(&mutex, 0, 1);
+  return 0;
+}
+
+/* find - Return the index entry of uri, or NULL. Caller holds mutex. */
+static disk_entry **find(char *uri, unsigned int hash) {
+  disk_entry **pp;
+  for (pp = &buckets[hash & (DISK_BUCKETS - 1)]; *pp != NULL;
+       pp = &(*pp) -> next) {
+    if ((*pp) -> hash == hash && !strcasecmp((*pp) -> uri, uri)) {
+      return pp;
+    }
+  }
+  return NULL;
+}
+
+/* drop - Unlink and free the entry *pp points to. Caller holds mutex. */
+static void drop(disk_entry **pp) {
+  disk_entry *e = *pp;
+  *pp = e -> next;
+  free(e -> uri);
+  Free(e);
+}
+
+/* stale - Has the record's object gone stale? */
+static int stale(disk_record *rec) {
+  return rec -> expires != 0 && time(NULL) >= rec -> expires;
+}
+
+/*
+ * next_segment - The segment the log moves on to, the oldest one no hit
+ *   is sending from, possibly the active one again. Return -1 if all are
+ *   pinned. Caller holds mutex.
+ */
+static int next_segment() {
+  int i, seg;
+  for (i = 1; i <= nsegs; i++) {
+    seg = (active + i) % nsegs;
+    if (__atomic_load_n(&segs[seg].readers, __ATOMIC_ACQUIRE) == 0) {
+      return seg;
+    }
+  }
+  return -1;
+}
+
+/*
+ * clean - Make segment seg reusable. Records still indexed and hit since
+ *   they were written and still fresh are compacted to its front, every
+ *   other record is dropped. Return 1 if need more bytes now fit after
+ *   them, else 0. Caller holds mutex and seg has no readers.
+ */
+static int clean(int seg, int need) {
+  segment_t *s = &segs[seg];
+  disk_record *rec;
+  disk_entry **pp;
+  int off, len, kept = 0;
+  char *uri;
+
+  for (off = 0; off < s -> used; off += len) {
+    rec = (disk_record *)(s -> map + off);
+    len = DISK_ALIGN(sizeof(disk_record) + rec -> uri_len + rec -> content_len);
+    uri = (char *)(rec + 1);
+    pp = find(uri, uri_hash(uri));
+    if (pp == NULL || (*pp) -> seg != seg || (*pp) -> offset != off) {
+      continue; // a newer copy was written since
+    }
+    if (!(*pp) -> referenced || stale(rec)) {
+      drop(pp);
+      continue;
+    }
+    memmove(s -> map + kept, rec, len); // kept <= off, never overlaps ahead
+    (*pp) -> offset = kept;
+    (*pp) -> referenced = 0;
+    kept += len;
+  }
+  s -> used = kept;
+  return kept + need <= seg_size;
+}
+
+/*
+ * disk_put - Append an object to the log and point the index at it. It
+ *   goes stale at time expires, never if 0. An object bigger than a
+ *   segment is not kept.
+ */
+void disk_put(char *uri, char *content, int content_len, int hdr_len,
+              long expires) {
+  unsigned int hash = uri_hash(uri);
+  int uri_len = strlen(uri) + 1;
+  int len = DISK_ALIGN(sizeof(disk_record) + uri_len + content_len);
+  disk_record *rec;
+  disk_entry **pp, *e;
+  int seg;
+
+  if (segs == NULL || len > seg_size) {
+    return;
+  }
+  P(&mutex);
+  if (segs[active].used + len > seg_size) {
+    // move on to the oldest segment and clean it, until one has room;
+    // within a round every kept object loses its mark, so this ends
+    do {
+      if ((seg = next_segment()) < 0) {
+        V(&mutex); // every segment is being sent from, don't keep it
+        return;
+      }
+      active = seg;
+    } while (!clean(active, len));
+  }
+  rec = (disk_record *)(segs[active].map + segs[active].used);
+  rec -> magic = DISK_MAGIC;
+  rec -> uri_len = uri_len;
+  rec -> content_len = content_len;
+  rec -> hdr_len = hdr_len;
+  rec -> expires = expires;
+  memcpy(rec + 1, uri, uri_len);
+  memcpy((char *)(rec + 1) + uri_len, content, content_len);
+
+  if ((pp = find(uri, hash)) != NULL) {
+    e = *pp;
+  } else {
+    e = (disk_entry *)Malloc(sizeof(disk_entry));
+    e -> uri = strdup(uri);
+    e -> hash = hash;
+    e -> next = buckets[hash & (DISK_BUCKETS - 1)];
+    buckets[hash & (DISK_BUCKETS - 1)] = e;
+  }
+  e -> seg = active;
+  e -> offset = segs[active].used;
+  e -> referenced = 0;
+  segs[active].used += len;
+  V(&mutex);
+}
+
+/*
+ * disk_lookup - Find the object cached under uri and pin its segment.
+ *   Return 0 and fill in ref if found, 1 otherwise. A stale object is
+ *   dropped from the index and not found.
+ */
+int disk_lookup(char *uri, disk_ref *ref) {
+  disk_entry **pp;
+  disk_record *rec;
+
+  if (segs == NULL) {
+    return 1;
+  }
+  P(&mutex);
+  if ((pp = find(uri, uri_hash(uri))) == NULL) {
+    V(&mutex);
+    return 1;
+  }
+  rec = (disk_record *)(segs[(*pp) -> seg].map + (*pp) -> offset);
+  if (stale(rec)) {
+    drop(pp);
+    V(&mutex);
+    return 1;
+  }
+  (*pp) -> referenced = 1;
+  ref -> seg = (*pp) -> seg;
+  ref -> fd = segs[ref -> seg].fd;
+  ref -> offset = (*pp) -> offset + sizeof(disk_record) + rec -> uri_len;
+  ref -> content = segs[ref -> seg].map + ref -> offset;
+  ref -> content_len = rec -> content_len;
+  ref -> hdr_len = rec -> hdr_len;
+  __atomic_add_fetch(&segs[ref -> seg].readers, 1, __ATOMIC_ACQ_REL);
+  V(&mutex);
+  return 0;
+}
+
+/*
+ * disk_send - Send len bytes of the content of a found object, from byte
+ *   from on, to fd with sendfile. Return 0 on success, -1 on error.
+ */
+int disk_send(int fd, disk_ref *ref, int from, int len) {
+  off_t off = ref -> offset + from;
+  size_t left = len;
+  ssize_t n;
+
+  while (left > 0) {
+    if ((n = sendfile(fd, ref -> fd, &off, left)) <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    left -= n;
+  }
+  return 0;
+}
+
+/* disk_release - Unpin the segment of an object found by disk_lookup */
+void disk_release(disk_ref *ref) {
+  __atomic_sub_fetch(&segs[ref -> seg].readers, 1, __ATOMIC_ACQ_REL);
+}
+
+/* disk_free - Drop the index and unmap and close the segments */
+void disk_free() {
+  disk_entry **pp;
+  int i;
+
+  for (i = 0; buckets != NULL && i < DISK_BUCKETS; i++) {
+    for (pp = &buckets[i]; *pp != NULL; ) {
+      drop(pp);
+    }
+  }
+  for (i = 0; i < nsegs; i++) {
+    if (segs[i].map != MAP_FAILED) {
+      munmap(segs[i].map, seg_size);
+    }
+    if (segs[i].fd >= 0) {
+      close(segs[i].fd);
+    }
+  }
+  free(buckets);
+  free(segs);
+  buckets = NULL;
+  segs = NULL;
+  nsegs = 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * disk.h - second cache tier, a log of memory-mapped segment files
+ */
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "csapp.h"
+
+#define DISK_SEGMENT_SIZE (32 * 1024 * 1024) /* Bytes per segment file */
+#define DISK_SEGMENTS 64 /* Segments in the log, DISK_SEGMENT_SIZE each */
+#define DISK_BUCKETS 4096 /* Index buckets, must be a power of 2 */
+
+/* An object found on disk, pinned until disk_release */
+typedef struct {
+  int seg; /* segment holding it */
+  int fd; /* the segment's file, for sendfile */
+  off_t offset; /* where content starts in the file */
+  char *content; /* the same bytes through the mapping */
+  int content_len;
+  int hdr_len; /* content starts with a header this long, 0 if unknown */
+} disk_ref;
+
+int disk_init(char *dir, int nsegments, int segment_size);
+void disk_put(char *uri, char *content, int content_len, int hdr_len,
+              long expires);
+int disk_lookup(char *uri, disk_ref *ref);
+int disk_send(int fd, disk_ref *ref, int from, int len);
+void disk_release(disk_ref *ref);
+void disk_free();
+
+#endif /* __DISK_H__ */
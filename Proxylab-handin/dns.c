@@ -0,0 +1,242 @@
+/*
+ * dns.c - shared cache of resolved server addresses
+ *
+ * Every miss used to resolve its server twice, once in host_verify and
+ * again in open_clientfd. Both now go through dns_lookup, which keeps the
+ * getaddrinfo result of each (host, port) for DNS_TTL_SECS and a failure
+ * for DNS_NEG_TTL_SECS, so a hot server is resolved about once a minute.
+ * getaddrinfo does not tell the record's own TTL, hence the fixed ones.
+ *
+ * Entries are refcounted like cache lines: an expired or forgotten entry
+ * leaves the table at once but its addresses stay valid until the last
+ * holder releases it. The resolver itself runs outside the lock; two
+ * threads missing the same host at once both resolve and the later result
+ * wins.
+ */
+#include "dns.h"
+#include "hash.h"
+#include "log.h"
+#include <poll.h>
+
+static dns_entry **buckets;
+static sem_t mutex; /* Initially = 1 */
+
+/* dns_init - Initialize an empty cache */
+void dns_init() {
+  buckets = (dns_entry **)Calloc(DNS_BUCKETS, sizeof(dns_entry *));
+  Sem_init(&mutex, 0, 1);
+}
+
+/* key_hash - Hash of a (host, port) key */
+static unsigned int key_hash(char *host, char *port) {
+  return hash_add(hash_add(HASH_SEED, host), port);
+}
+
+/* put - Drop a reference, freeing the entry with the last one */
+static void put(dns_entry *e) {
+  if (__atomic_sub_fetch(&e -> refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+    if (e -> addrs != NULL) {
+      freeaddrinfo(e -> addrs);
+    }
+    free(e -> host);
+    free(e -> port);
+    Free(e);
+  }
+}
+
+/* unlink_entry - Take e off its bucket. Caller holds mutex. */
+static void unlink_entry(dns_entry **bucket, dns_entry *e) {
+  dns_entry **pp;
+  for (pp = bucket; *pp != NULL; pp = &(*pp) -> next) {
+    if (*pp == e) {
+      *pp = e -> next;
+      put(e); // the table's reference
+      return;
+    }
+  }
+}
+
+/*
+ * find - Return the live entry of (host, port), pinned, or NULL. Expired
+ *   entries met on the way are dropped. Caller holds mutex.
+ */
+static dns_entry *find(dns_entry **bucket, char *host, char *port,
+                       time_t now) {
+  dns_entry *e, *next, *found = NULL;
+
+  for (e = *bucket; e != NULL; e = next) {
+    next = e -> next;
+    if (now >= e -> expires) {
+      unlink_entry(bucket, e);
+    } else if (!strcasecmp(e -> host, host) && !strcmp(e -> port, port)) {
+      found = e;
+    }
+  }
+  if (found != NULL) {
+    __atomic_add_fetch(&found -> refcnt, 1, __ATOMIC_ACQ_REL);
+  }
+  return found;
+}
+
+/*
+ * dns_lookup - Resolve (host, port), from the cache if possible. Return
+ *   the entry pinned for the caller, who must dns_release it; its addrs are
+ *   NULL and *rc holds the getaddrinfo error if the name did not resolve.
+ */
+dns_entry *dns_lookup(char *host, char *port, int *rc) {
+  dns_entry **bucket = &buckets[key_hash(host, port) & (DNS_BUCKETS - 1)];
+  dns_entry *e, *old;
+  struct addrinfo hints;
+  time_t now = time(NULL);
+
+  P(&mutex);
+  e = find(bucket, host, port, now);
+  V(&mutex);
+  if (e != NULL) {
+    *rc = e -> rc;
+    return e;
+  }
+
+  e = (dns_entry *)Calloc(1, sizeof(dns_entry));
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+  if ((e -> rc = getaddrinfo(host, port, &hints, &e -> addrs)) != 0) {
+    log_warn("getaddrinfo error: %s", gai_strerror(e -> rc));
+    e -> addrs = NULL;
+  }
+  *rc = e -> rc;
+  e -> host = strdup(host);
+  e -> port = strdup(port);
+  if (e -> rc == EAI_AGAIN || e -> rc == EAI_SYSTEM ||
+      e -> rc == EAI_MEMORY) { // worth trying again at once, don't keep it
+    e -> refcnt = 1;
+    return e;
+  }
+  e -> expires = now + (e -> rc ? DNS_NEG_TTL_SECS : DNS_TTL_SECS);
+  e -> refcnt = 2; // the table and the caller
+
+  P(&mutex);
+  if ((old = find(bucket, host, port, now)) != NULL) { // lost a race
+    unlink_entry(bucket, old);
+    put(old);
+  }
+  e -> next = *bucket;
+  *bucket = e;
+  V(&mutex);
+  return e;
+}
+
+/*
+ * dns_cached - dns_lookup from the cache alone, for a caller that must not
+ *   block on the resolver. Return NULL if (host, port) is not in it.
+ */
+dns_entry *dns_cached(char *host, char *port, int *rc) {
+  dns_entry **bucket = &buckets[key_hash(host, port) & (DNS_BUCKETS - 1)];
+  dns_entry *e;
+
+  P(&mutex);
+  e = find(bucket, host, port, time(NULL));
+  V(&mutex);
+  if (e != NULL) {
+    *rc = e -> rc;
+  }
+  return e;
+}
+
+/* dns_release - Unpin an entry returned by dns_lookup */
+void dns_release(dns_entry *e) {
+  put(e);
+}
+
+/*
+ * dns_forget - Drop a pinned entry from the cache, say when none of its
+ *   addresses answers any more, so the next lookup resolves afresh
+ */
+void dns_forget(dns_entry *e) {
+  P(&mutex);
+  unlink_entry(&buckets[key_hash(e -> host, e -> port) & (DNS_BUCKETS - 1)],
+               e);
+  V(&mutex);
+}
+
+/*
+ * connect_within - connect fd to addr, giving up after msecs unless 0.
+ *   Return 0 once connected, -1 on error or timeout.
+ */
+static int connect_within(int fd, struct sockaddr *addr, socklen_t addrlen,
+                          long msecs) {
+  struct pollfd pfd;
+  socklen_t len = sizeof(int);
+  int flags, err = 0, n;
+
+  if (msecs <= 0) {
+    return connect(fd, addr, addrlen);
+  }
+  if ((flags = fcntl(fd, F_GETFL, 0)) < 0 ||
+      fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    return -1;
+  }
+  if (connect(fd, addr, addrlen) < 0) {
+    if (errno != EINPROGRESS) {
+      return -1;
+    }
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    while ((n = poll(&pfd, 1, msecs)) < 0 && errno == EINTR) {
+    }
+    if (n == 0) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    if (n < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+        err != 0) {
+      return -1;
+    }
+  }
+  return fcntl(fd, F_SETFL, flags); // blocking again for rio
+}
+
+/*
+ * dns_connect - open_clientfd over the cached addresses of (host, port),
+ *   each address given msecs to answer unless 0. Return a connected
+ *   descriptor, or -1 with *rc set to the getaddrinfo error if the name
+ *   did not resolve and to 0 if nothing answered.
+ */
+int dns_connect(char *host, char *port, int *rc, long msecs) {
+  dns_entry *e = dns_lookup(host, port, rc);
+  struct addrinfo *p;
+  int fd = -1;
+
+  for (p = e -> addrs; p; p = p -> ai_next) {
+    if ((fd = socket(p -> ai_family, p -> ai_socktype, p -> ai_protocol)) < 0) {
+      continue;
+    }
+    if (connect_within(fd, p -> ai_addr, p -> ai_addrlen, msecs) != -1) {
+      break; // Success
+    }
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0 && e -> addrs != NULL) {
+    dns_forget(e);
+  }
+  dns_release(e);
+  return fd;
+}
+
+/* dns_free - Empty the cache and free it */
+void dns_free() {
+  dns_entry *e, *next;
+  int i;
+
+  P(&mutex);
+  for (i = 0; i < DNS_BUCKETS; i++) {
+    for (e = buckets[i]; e != NULL; e = next) {
+      next = e -> next;
+      put(e);
+    }
+    buckets[i] = NULL;
+  }
+  V(&mutex);
+}
@@ -0,0 +1,32 @@
+/*
+ * dns.h - shared cache of resolved server addresses
+ */
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include "csapp.h"
+
+#define DNS_BUCKETS 256 /* Must be a power of 2 */
+#define DNS_TTL_SECS 60 /* How long a resolved address is trusted */
+#define DNS_NEG_TTL_SECS 5 /* How long a failed lookup is remembered */
+
+/* One resolved (host, port), pinned by whoever holds it */
+typedef struct dns_entry {
+  char *host;
+  char *port;
+  struct addrinfo *addrs; /* NULL if the lookup failed */
+  int rc; /* getaddrinfo error of a failed lookup */
+  time_t expires;
+  int refcnt; /* one for the table while listed, one per holder */
+  struct dns_entry *next; /* next entry in the same bucket */
+} dns_entry;
+
+void dns_init();
+dns_entry *dns_lookup(char *host, char *port, int *rc);
+dns_entry *dns_cached(char *host, char *port, int *rc);
+void dns_release(dns_entry *e);
+void dns_forget(dns_entry *e);
+int dns_connect(char *host, char *port, int *rc, long msecs);
+void dns_free();
+
+#endif /* __DNS_H__ */
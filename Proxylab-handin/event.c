@@ -0,0 +1,898 @@
+/*
+ * event.c - event-driven front end for the proxy
+ *
+ * Instead of a thread per connection, a few event loop threads each run
+ * their own epoll instance over non-blocking sockets. Every client
+ * connection is a small state machine:
+ *
+ *   CONN_REQUEST  read the request line and headers from the client
+ *   CONN_RESOLVE  wait for the server's name to resolve
+ *   CONN_CONNECT  wait for the non-blocking connect to the server
+ *   CONN_SEND     write the rewritten request to the server
+ *   CONN_RELAY    read a block from the server, write it to the client
+ *   CONN_REPLY    write a cached object or an error to the client
+ *
+ * A connection is only ever registered with the epoll instance of the loop
+ * that accepted it, so its state needs no locking. Each of its sockets is
+ * registered with a pointer to it, so an event finds its connection
+ * without a table indexed by descriptor. A connection closed while events
+ * for it are still to be dispatched is freed once they all are.
+ *
+ * getaddrinfo blocks, so a server name that is not in the DNS cache is
+ * resolved by a small pool of resolver threads. The loop carries on with
+ * its other connections meanwhile and is woken through an eventfd when
+ * the name is in.
+ *
+ * Requests are parsed and rewritten with the same routines as doit, and
+ * responses go through the same cache calls. A response is cached the way
+ * do_server caches it: its head as read_response_hdrs leaves it, with a
+ * Content-Length, and only once its body is in whole. A chunked one is
+ * relayed but not cached.
+ *
+ * Each loop also keeps a timer wheel of its connections' deadlines: the
+ * header limit until the request is in, then the transfer limit, cut
+ * short after the idle limit without progress. A connection past its
+ * deadline is closed when the wheel next ticks, between two epoll waits.
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "proxy.h"
+#include "dns.h"
+#include "stats.h"
+#include "log.h"
+#include "shm.h"
+#include "timer.h"
+#include "sbuf.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define EVENT_MAX_EVENTS 64
+#define EVENT_REQUEST_MAX (4 * MAXLINE) /* request line plus headers */
+#define EVENT_RESOLVERS 4 /* threads resolving server names for the loops */
+#define EVENT_RESOLVE_SLOTS 256 /* names waiting for them */
+
+/* Connection states */
+#define CONN_REQUEST 0
+#define CONN_RESOLVE 1
+#define CONN_CONNECT 2
+#define CONN_SEND 3
+#define CONN_RELAY 4
+#define CONN_REPLY 5
+
+typedef struct conn conn_t;
+typedef struct resolve_job resolve_job;
+
+/* An event loop and what its connections share */
+typedef struct {
+  int epfd;
+  timer_wheel wheel; /* deadlines of its connections */
+  int wakefd; /* eventfd, readable while resolved holds jobs */
+  sem_t mutex; /* Initially = 1, protects resolved */
+  resolve_job *resolved; /* names the resolvers are done with */
+  conn_t *closed; /* closed during this round of events, freed after it */
+} loop_t;
+
+/* A socket of a connection, what its epoll events point at */
+typedef struct {
+  conn_t *c;
+  int server; /* the server socket, else the client's */
+} conn_end;
+
+/* A server name to resolve off the loop, see resolver */
+struct resolve_job {
+  loop_t *loop;
+  conn_t *c; /* NULL once c is closed meanwhile */
+  char host[MAXLINE];
+  char port[MAXLINE];
+  dns_entry *e; /* the result, pinned */
+  int rc;
+  resolve_job *next; /* on the loop's resolved list */
+};
+
+struct conn {
+  int state;
+  loop_t *loop; /* the owning loop */
+  conn_end client, server; /* epoll data of the two sockets */
+  deadline_t dl; /* on the loop's wheel while the connection is open */
+  int clientfd;
+  int serverfd; /* -1 until a miss connects to the server */
+  resolve_job *resolving; /* in CONN_RESOLVE */
+  int closed; /* waiting on the loop's closed list to be freed */
+  conn_t *next_closed;
+
+  char request[EVENT_REQUEST_MAX + 1]; /* raw request from the client */
+  int request_len;
+  http_request head; /* request parsed in place as it arrives */
+  char uri[MAXLINE]; /* the cache key, see parse_request */
+  int auth; /* the request carries Authorization */
+  long started; /* stats_now once the request is in, 0 before */
+  int first_byte; /* the response has started going out */
+
+  char *wbuf; /* pending bytes for CONN_SEND or CONN_REPLY */
+  int wbuf_len;
+  int wbuf_off;
+  int wbuf_owned; /* free wbuf when done, it is not a cached line */
+  cache_line *cached; /* pinned line being replied from */
+
+  char buf[MAXBUF]; /* server to client relay block */
+  int buf_len;
+  int buf_off;
+
+  char *fill; /* response so far, for the cache */
+  int fill_len;
+  int fill_cap;
+  int too_big; /* not cached, too big or not cacheable */
+  response_t resp; /* what the head of the response says */
+  int head_len; /* of the response head, 0 until it is all in */
+  long expires; /* when the cached response goes stale */
+  long relayed; /* bytes of the response read from the server */
+  int relay_done; /* the whole response is in, close once it is out */
+};
+
+static int listenfd;
+static sbuf_t resolve_q; /* resolve_job for the resolvers */
+
+static void conn_close(conn_t *c);
+
+/* set_nonblock - Put a descriptor into non-blocking mode */
+static int set_nonblock(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0) {
+    return -1;
+  }
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* end_of - The epoll data of c's socket fd */
+static conn_end *end_of(conn_t *c, int fd) {
+  return fd == c -> serverfd ? &c -> server : &c -> client;
+}
+
+/* watch - Change the events a registered descriptor is polled for */
+static void watch(conn_t *c, int fd, unsigned int events) {
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = end_of(c, fd);
+  if (epoll_ctl(c -> loop -> epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+    log_error("epoll_ctl error: %s", strerror(errno));
+  }
+}
+
+/*
+ * pause/resume - Take a registered descriptor out of its loop and put it
+ *   back. Unlike watching for no events, a paused descriptor does not keep
+ *   reporting a hangup while c is busy with the other end.
+ */
+static void pause_fd(conn_t *c, int fd) {
+  if (epoll_ctl(c -> loop -> epfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+    log_error("epoll_ctl error: %s", strerror(errno));
+  }
+}
+
+static void resume_fd(conn_t *c, int fd, unsigned int events) {
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = end_of(c, fd);
+  if (epoll_ctl(c -> loop -> epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    log_error("epoll_ctl error: %s", strerror(errno));
+  }
+}
+
+/* track - Register a descriptor of c with its loop */
+static int track(conn_t *c, int fd, unsigned int events) {
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = end_of(c, fd);
+  if (epoll_ctl(c -> loop -> epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    log_error("epoll_ctl error: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/* conn_expired - Timer routine, c's deadline may have passed */
+static void conn_expired(void *arg) {
+  conn_t *c = (conn_t *)arg;
+  long left = deadline_left(&c -> dl, timer_now());
+
+  if (left > 0) { // made progress since, look again when it may be due
+    wheel_add(&c -> loop -> wheel, &c -> dl.t, left);
+    return;
+  }
+  log_debug("Deadline passed on descriptor %d, closing it.", c -> clientfd);
+  stats_add(STAT_TIMEOUTS, 1);
+  conn_close(c);
+}
+
+/* conn_deadline - Start c's deadline over as one of kind */
+static void conn_deadline(conn_t *c, int kind) {
+  long left;
+
+  wheel_del(&c -> loop -> wheel, &c -> dl.t);
+  if ((left = deadline_begin(&c -> dl, kind)) > 0) {
+    wheel_add(&c -> loop -> wheel, &c -> dl.t, left);
+  }
+}
+
+/* first_byte - Time c's first response byte, once */
+static void first_byte(conn_t *c) {
+  if (c -> started && !c -> first_byte) {
+    c -> first_byte = 1;
+    stats_time(STAT_TTFB, stats_now() - c -> started);
+  }
+}
+
+/* reply - Switch c to writing len bytes of buf to the client, then close */
+static void reply(conn_t *c, char *buf, int len, int owned) {
+  first_byte(c);
+  stats_add(STAT_BYTES_SERVED, len);
+  c -> wbuf = buf;
+  c -> wbuf_len = len;
+  c -> wbuf_off = 0;
+  c -> wbuf_owned = owned;
+  c -> state = CONN_REPLY;
+  watch(c, c -> clientfd, EPOLLOUT);
+}
+
+/* reply_error - Reply with an error page, as clienterror does */
+static void reply_error(conn_t *c, char *cause, char *errnum,
+                        char *shortmsg, char *longmsg) {
+  char *buf = Malloc(MAXLINE + MAXBUF);
+  int len = build_clienterror(buf, cause, errnum, shortmsg, longmsg);
+  reply(c, buf, len, 1);
+}
+
+/*
+ * write_pending - Write as much of c's pending bytes to fd as the socket
+ *   takes. Return 1 once everything is written, 0 if the socket is full
+ *   and -1 on error.
+ */
+static int write_pending(conn_t *c, int fd) {
+  ssize_t n;
+  while (c -> wbuf_off < c -> wbuf_len) {
+    n = write(fd, c -> wbuf + c -> wbuf_off, c -> wbuf_len - c -> wbuf_off);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    c -> wbuf_off += n;
+    deadline_touch(&c -> dl);
+  }
+  return 1;
+}
+
+/* drop_wbuf - Release whatever c's pending bytes point at */
+static void drop_wbuf(conn_t *c) {
+  if (c -> wbuf_owned) {
+    Free(c -> wbuf);
+  }
+  c -> wbuf = NULL;
+  c -> wbuf_owned = 0;
+}
+
+/*
+ * connect_server - Start a non-blocking connect to the server resolved
+ *   as e, and release e. Return the descriptor or -1.
+ */
+static int connect_server(dns_entry *e) {
+  struct addrinfo *p;
+  int fd = -1;
+
+  for (p = e -> addrs; p; p = p -> ai_next) {
+    if ((fd = socket(p -> ai_family, p -> ai_socktype, p -> ai_protocol)) < 0) {
+      continue;
+    }
+    if (set_nonblock(fd) == 0 &&
+        (connect(fd, p -> ai_addr, p -> ai_addrlen) == 0 ||
+         errno == EINPROGRESS)) {
+      break; // connected or on its way
+    }
+    close(fd);
+    fd = -1;
+  }
+  dns_release(e);
+  return fd;
+}
+
+/*
+ * start_connect - The server's name is resolved as e, with getaddrinfo
+ *   error rc; connect to it and have the request in c's pending bytes
+ *   sent once connected.
+ */
+static void start_connect(conn_t *c, dns_entry *e, int rc) {
+  if (rc != 0 || (c -> serverfd = connect_server(e)) < 0 ||
+      track(c, c -> serverfd, EPOLLOUT) < 0) {
+    if (rc != 0) {
+      dns_release(e);
+    }
+    drop_wbuf(c);
+    stats_add(STAT_ORIGIN_ERRORS, 1);
+    if (c -> serverfd >= 0) {
+      close(c -> serverfd);
+      c -> serverfd = -1;
+    }
+    if (rc != 0) {
+      reply_error(c, "GET", "400", "Bad Request", (char *)gai_strerror(rc));
+    } else {
+      log_warn("Establish to server error!");
+      reply_error(c, "GET", "500", "Internal error",
+                  "Establish to server error!\n");
+    }
+    return;
+  }
+  c -> state = CONN_CONNECT;
+}
+
+/*
+ * resolve - Resolve req's server for c from the DNS cache, or have a
+ *   resolver thread do it while c waits in CONN_RESOLVE
+ */
+static void resolve(conn_t *c, request_t *req) {
+  resolve_job *job;
+  dns_entry *e;
+  int rc;
+
+  watch(c, c -> clientfd, 0); // nothing to do for the client meanwhile
+  if ((e = dns_cached(req -> server_hostname, req -> server_port, &rc))
+      != NULL) {
+    start_connect(c, e, rc);
+    return;
+  }
+  job = (resolve_job *)Malloc(sizeof(resolve_job));
+  job -> loop = c -> loop;
+  job -> c = c;
+  strcpy(job -> host, req -> server_hostname);
+  strcpy(job -> port, req -> server_port);
+  if (sbuf_try_insert(&resolve_q, (intptr_t)job) < 0) {
+    Free(job);
+    drop_wbuf(c);
+    log_warn("Too many server names resolving!");
+    reply_error(c, "GET", "503", "Service Unavailable",
+                "Too many server names resolving");
+    return;
+  }
+  c -> resolving = job;
+  c -> state = CONN_RESOLVE;
+}
+
+/*
+ * resolver - Thread routine resolving server names for the loops, each
+ *   job handed back to its loop once done
+ */
+static void *resolver(void *vargp) {
+  resolve_job *job;
+  uint64_t one = 1;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    job = (resolve_job *)sbuf_remove(&resolve_q);
+    job -> e = dns_lookup(job -> host, job -> port, &job -> rc);
+    P(&job -> loop -> mutex);
+    job -> next = job -> loop -> resolved;
+    job -> loop -> resolved = job;
+    V(&job -> loop -> mutex);
+    if (write(job -> loop -> wakefd, &one, sizeof(one)) < 0) {
+      log_error("eventfd write error: %s", strerror(errno));
+    }
+  }
+  return NULL;
+}
+
+/* on_resolved - Carry on with the connections whose names are resolved */
+static void on_resolved(loop_t *loop) {
+  resolve_job *job, *next;
+  uint64_t n;
+
+  if (read(loop -> wakefd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+    log_error("eventfd read error: %s", strerror(errno));
+  }
+  P(&loop -> mutex);
+  job = loop -> resolved;
+  loop -> resolved = NULL;
+  V(&loop -> mutex);
+  for (; job != NULL; job = next) {
+    next = job -> next;
+    if (job -> c == NULL) { // its client is gone
+      dns_release(job -> e);
+    } else {
+      job -> c -> resolving = NULL;
+      start_connect(job -> c, job -> e, job -> rc);
+    }
+    Free(job);
+  }
+}
+
+/*
+ * start_request - The request is in; answer it from the cache or rewrite
+ *   it and start connecting to the server.
+ */
+static void start_request(conn_t *c) {
+  request_t *req = Malloc(sizeof(request_t));
+  char *errnum, *shortmsg, *longmsg;
+  char *line, *request2server;
+  int len;
+
+  c -> started = stats_now();
+  conn_deadline(c, DEADLINE_TRANSFER | DEADLINE_QUIET);
+  line = memchr(c -> request, '\n', c -> request_len);
+  log_info("%.*s", (int)(line - c -> request), c -> request); // display line
+  if (parse_request(&c -> head, req, &errnum, &shortmsg, &longmsg)) {
+    reply_error(c, req -> method, errnum, shortmsg, longmsg);
+    Free(req);
+    return;
+  }
+  if (req -> stats) {
+    line = Malloc(MAXBUF);
+    reply(c, line, build_stats(line, MAXBUF, 0), 1);
+    Free(req);
+    return;
+  }
+  strcpy(c -> uri, req -> uri);
+  c -> auth = req -> auth;
+
+  if ((c -> cached = cache_lookup(c -> uri)) != NULL &&
+      !cache_complete(c -> cached)) {
+    // still downloading, and the loop can't block waiting for it
+    cache_release(c -> cached);
+    c -> cached = NULL;
+  }
+  if (c -> cached != NULL) { // in cache
+    log_debug("Content in cache!");
+    stats_add(STAT_HITS, 1);
+    reply(c, c -> cached -> content, c -> cached -> content_len, 0);
+    Free(req);
+    return;
+  }
+  if ((c -> cached = shared_lookup(c -> uri)) != NULL) { // another worker's
+    log_debug("Content in shared cache!");
+    stats_add(STAT_SHARED_HITS, 1);
+    reply(c, c -> cached -> content, c -> cached -> content_len, 0);
+    Free(req);
+    return;
+  }
+
+  // request line, then the rewritten headers, sent once connected
+  stats_add(STAT_MISSES, 1);
+  request2server = build_request(&c -> head, req, 0, &len);
+  c -> wbuf = request2server;
+  c -> wbuf_len = len;
+  c -> wbuf_off = 0;
+  c -> wbuf_owned = 1;
+  resolve(c, req);
+  Free(req);
+}
+
+/* on_request - Client readable while the request is arriving */
+static void on_request(conn_t *c) {
+  ssize_t n;
+  int rc;
+
+  while (c -> request_len < EVENT_REQUEST_MAX) {
+    n = read(c -> clientfd, c -> request + c -> request_len,
+             EVENT_REQUEST_MAX - c -> request_len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (n <= 0) { // EOF or error before the request was complete
+      conn_close(c);
+      return;
+    }
+    c -> request_len += n;
+    c -> request[c -> request_len] = '\0';
+    c -> head.len = c -> request_len;
+    if ((rc = http_parse_head(&c -> head)) > 0) {
+      start_request(c);
+      return;
+    }
+    if (rc < 0) {
+      reply_error(c, "", "400", "Bad Request", "Malformed request header");
+      return;
+    }
+  }
+  if (c -> request_len >= EVENT_REQUEST_MAX) {
+    reply_error(c, "", "400", "Bad Request", "Request header too large");
+  }
+}
+
+/* on_connect - Server writable, the connect has finished one way or another */
+static void on_connect(conn_t *c) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  if (getsockopt(c -> serverfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+      err != 0) {
+    log_warn("Establish to server error!");
+    stats_add(STAT_ORIGIN_ERRORS, 1);
+    drop_wbuf(c);
+    close(c -> serverfd);
+    c -> serverfd = -1;
+    reply_error(c, "GET", "500", "Internal error",
+                "Establish to server error!\n");
+    return;
+  }
+  c -> state = CONN_SEND;
+}
+
+/* on_send - Server writable while the request goes out */
+static void on_send(conn_t *c) {
+  int rc = write_pending(c, c -> serverfd);
+  if (rc < 0) {
+    log_warn("rio_writen error!");
+    conn_close(c);
+  } else if (rc > 0) {
+    drop_wbuf(c);
+    c -> state = CONN_RELAY;
+    watch(c, c -> serverfd, EPOLLIN);
+  }
+}
+
+/* drop_fill - The response won't be cached, stop keeping it */
+static void drop_fill(conn_t *c) {
+  if (!c -> too_big && c -> head_len > 0 && c -> resp.status == 200) {
+    note_uncacheable(c -> uri, 1); // later Ranges on it go to the server
+  }
+  c -> too_big = 1;
+  if (c -> fill != NULL) {
+    Free(c -> fill);
+    c -> fill = NULL;
+  }
+}
+
+/*
+ * fill_head - Once the head of the response is in, decide whether it is
+ *   cached and until when. A Content-Length too big for an object stops
+ *   the copy at once rather than after max object bytes. A chunked body
+ *   is not cached, it would have to be decoded first.
+ */
+static void fill_head(conn_t *c) {
+  int rc = http_parse_response(c -> fill, c -> fill_len, &c -> resp);
+
+  if (rc == 0) {
+    return; // not all in yet
+  }
+  c -> head_len = rc;
+  if (rc < 0 || !http_storable(&c -> resp, c -> auth) ||
+      (c -> expires = http_expires(&c -> resp, time(NULL))) == 0) {
+    log_debug("Response not cacheable.");
+    drop_fill(c);
+  } else if (c -> resp.chunked) {
+    log_debug("Chunked response not cached.");
+    drop_fill(c);
+  } else if (c -> resp.content_length > cache_max_object() - rc) {
+    log_debug("Cannot add to cache. Target is so big!");
+    drop_fill(c);
+  }
+}
+
+/* fill_append - Keep a block of the response for the cache, if it fits */
+static void fill_append(conn_t *c, char *buf, int len) {
+  if (c -> too_big) {
+    return;
+  }
+  if (c -> fill_len + len > cache_max_object()) {
+    log_debug("Cannot add to cache. Target is so big!");
+    drop_fill(c);
+    return;
+  }
+  if (c -> fill_len + len > c -> fill_cap) {
+    c -> fill_cap = c -> fill_cap ? 2 * c -> fill_cap : MAXBUF;
+    if (c -> fill_cap > cache_max_object()) {
+      c -> fill_cap = cache_max_object();
+    }
+    c -> fill = Realloc(c -> fill, c -> fill_cap);
+  }
+  memcpy(c -> fill + c -> fill_len, buf, len);
+  c -> fill_len += len;
+  if (c -> head_len == 0) {
+    fill_head(c);
+  }
+}
+
+/*
+ * fill_done - The response is over, the server having closed at eof.
+ *   Cache it if it is kept and its body came in whole: as long as its
+ *   Content-Length says, or up to the close if it gave none.
+ */
+static void fill_done(conn_t *c, int eof) {
+  char hdr[MAXBUF + MAXLINE]; // server's header plus our framing
+  char *body = c -> fill + c -> head_len;
+  int hdr_len, body_len = c -> fill_len - c -> head_len;
+
+  if (c -> too_big || c -> head_len <= 0) {
+    return;
+  }
+  if (!http_has_body(&c -> resp)) {
+    body_len = 0;
+  } else if (c -> resp.content_length >= 0 ?
+             body_len != c -> resp.content_length : !eof) {
+    return; // cut short
+  }
+  // the cached header always carries the length and no Connection
+  if ((hdr_len = http_response_hdrs(c -> fill, c -> head_len, hdr,
+                                    MAXBUF)) < 0) {
+    return;
+  }
+  if (http_has_body(&c -> resp)) {
+    hdr_len += sprintf(hdr + hdr_len, "Content-Length: %d\r\n", body_len);
+  }
+  hdr_len += sprintf(hdr + hdr_len, "\r\n");
+  put_cached_response(c -> uri, hdr, hdr_len, body, body_len, c -> expires);
+  shm_put(c -> uri, hdr, hdr_len, body, body_len, c -> expires);
+  if (c -> resp.status == 200) {
+    note_uncacheable(c -> uri, 0);
+  }
+}
+
+/*
+ * response_done - Has the whole response been read? Only known before EOF
+ *   once the head gave its length. A server may keep the connection open
+ *   after the response even though it was asked to close it.
+ */
+static int response_done(conn_t *c) {
+  if (c -> head_len <= 0) {
+    return 0;
+  }
+  if (!http_has_body(&c -> resp)) {
+    return 1;
+  }
+  return c -> resp.content_length >= 0 &&
+         c -> relayed >= c -> head_len + c -> resp.content_length;
+}
+
+/* on_relay_read - Server readable with an empty relay block */
+static void on_relay_read(conn_t *c) {
+  ssize_t n = read(c -> serverfd, c -> buf, MAXBUF);
+
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return;
+  }
+  if (n <= 0) { // EOF, the whole response has been relayed
+    if (n == 0) {
+      fill_done(c, 1);
+    }
+    conn_close(c);
+    return;
+  }
+  first_byte(c);
+  deadline_touch(&c -> dl);
+  fill_append(c, c -> buf, n);
+  c -> relayed += n;
+  if (response_done(c)) {
+    fill_done(c, 0);
+    c -> relay_done = 1;
+  }
+  c -> buf_len = n;
+  c -> buf_off = 0;
+  pause_fd(c, c -> serverfd);
+  watch(c, c -> clientfd, EPOLLOUT);
+}
+
+/* on_relay_write - Client writable with a relay block to pass on */
+static void on_relay_write(conn_t *c) {
+  ssize_t n;
+  while (c -> buf_off < c -> buf_len) {
+    n = write(c -> clientfd, c -> buf + c -> buf_off, c -> buf_len - c -> buf_off);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        conn_close(c);
+      }
+      return;
+    }
+    c -> buf_off += n;
+    deadline_touch(&c -> dl);
+    stats_add(STAT_BYTES_SERVED, n);
+  }
+  if (c -> relay_done) {
+    conn_close(c);
+    return;
+  }
+  watch(c, c -> clientfd, 0);
+  resume_fd(c, c -> serverfd, EPOLLIN);
+}
+
+/* on_reply - Client writable while a cached object or error goes out */
+static void on_reply(conn_t *c) {
+  if (write_pending(c, c -> clientfd) != 0) {
+    conn_close(c); // done or failed, either way the connection is over
+  }
+}
+
+/*
+ * conn_event - Dispatch events on fd to c's current state. A hangup or
+ *   error on the client means nobody is left to answer, so c is closed.
+ */
+static void conn_event(conn_t *c, int fd, unsigned int events) {
+  if (fd == c -> clientfd && (events & (EPOLLERR | EPOLLHUP))) {
+    conn_close(c);
+    return;
+  }
+  switch (c -> state) {
+  case CONN_REQUEST:
+    on_request(c);
+    break;
+  case CONN_RESOLVE: // only a hangup of the client, handled above
+    break;
+  case CONN_CONNECT:
+    on_connect(c);
+    if (c -> state == CONN_SEND) {
+      on_send(c);
+    }
+    break;
+  case CONN_SEND:
+    on_send(c);
+    break;
+  case CONN_RELAY:
+    if (fd == c -> serverfd) {
+      on_relay_read(c);
+    } else {
+      on_relay_write(c);
+    }
+    break;
+  case CONN_REPLY:
+    on_reply(c);
+    break;
+  }
+}
+
+/* conn_open - Start tracking a freshly accepted client */
+static void conn_open(loop_t *loop, int connfd) {
+  conn_t *c;
+
+  if (set_nonblock(connfd) < 0) {
+    close(connfd);
+    return;
+  }
+  c = Calloc(1, sizeof(conn_t));
+  c -> state = CONN_REQUEST;
+  c -> loop = loop;
+  c -> client.c = c -> server.c = c;
+  c -> server.server = 1;
+  c -> clientfd = connfd;
+  c -> serverfd = -1;
+  http_request_init(&c -> head, c -> request, 0);
+  if (track(c, connfd, EPOLLIN) < 0) {
+    close(connfd);
+    Free(c);
+    return;
+  }
+  c -> dl.t.fn = conn_expired;
+  c -> dl.t.arg = c;
+  conn_deadline(c, DEADLINE_HEADER);
+}
+
+/*
+ * conn_close - Close both ends of c and release everything it holds. c
+ *   itself is freed after the round of events, which may still name it.
+ */
+static void conn_close(conn_t *c) {
+  if (c -> closed) {
+    return;
+  }
+  wheel_del(&c -> loop -> wheel, &c -> dl.t);
+  if (c -> started) {
+    stats_time(STAT_TOTAL, stats_now() - c -> started);
+  }
+  close(c -> clientfd);
+  if (c -> serverfd >= 0) {
+    close(c -> serverfd);
+  }
+  if (c -> resolving != NULL) { // the resolver's result is dropped
+    c -> resolving -> c = NULL;
+  }
+  drop_wbuf(c);
+  if (c -> cached != NULL) {
+    cache_release(c -> cached);
+  }
+  if (c -> fill != NULL) {
+    Free(c -> fill);
+  }
+  http_request_free(&c -> head);
+  c -> closed = 1;
+  c -> next_closed = c -> loop -> closed;
+  c -> loop -> closed = c;
+}
+
+/* accept_all - Accept every pending client on the shared listener */
+static void accept_all(loop_t *loop) {
+  struct sockaddr_storage clientaddr;
+  socklen_t clientlen;
+  int connfd;
+
+  while (1) {
+    clientlen = sizeof(struct sockaddr_storage);
+    if ((connfd = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        log_warn("Accept error: %s", strerror(errno));
+      }
+      return; // another loop may have taken it
+    }
+    conn_open(loop, connfd);
+  }
+}
+
+/* event_loop - Thread routine, one epoll instance per loop */
+static void *event_loop(void *vargp) {
+  struct epoll_event ev, events[EVENT_MAX_EVENTS];
+  loop_t *loop = Calloc(1, sizeof(loop_t));
+  conn_end *end;
+  conn_t *c;
+  int n, i;
+
+  if ((loop -> epfd = epoll_create1(0)) < 0) {
+    unix_error("epoll_create1 error");
+  }
+  if ((loop -> wakefd = eventfd(0, EFD_NONBLOCK)) < 0) {
+    unix_error("eventfd error");
+  }
+  Sem_init(&loop -> mutex, 0, 1);
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE; // wake one loop per new client
+  ev.data.ptr = NULL; // the listener
+  if (epoll_ctl(loop -> epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+    unix_error("epoll_ctl error");
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = loop; // the resolvers' wakeup
+  if (epoll_ctl(loop -> epfd, EPOLL_CTL_ADD, loop -> wakefd, &ev) < 0) {
+    unix_error("epoll_ctl error");
+  }
+  wheel_init(&loop -> wheel, timer_now());
+
+  while (1) {
+    // wake up each tick while a deadline is pending
+    if ((n = epoll_wait(loop -> epfd, events, EVENT_MAX_EVENTS,
+                        loop -> wheel.pending > 0 ? TIMER_TICK_MS : -1)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      unix_error("epoll_wait error");
+    }
+    for (i = 0; i < n; i++) {
+      if (events[i].data.ptr == NULL) {
+        accept_all(loop);
+      } else if (events[i].data.ptr == loop) {
+        on_resolved(loop);
+      } else if (!(end = (conn_end *)events[i].data.ptr) -> c -> closed) {
+        c = end -> c;
+        conn_event(c, end -> server ? c -> serverfd : c -> clientfd,
+                   events[i].events);
+      }
+    }
+    wheel_advance(&loop -> wheel, timer_now());
+    while ((c = loop -> closed) != NULL) { // nothing names them any more
+      loop -> closed = c -> next_closed;
+      Free(c);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * event_serve - Serve listenfd with nloops event loop threads, the calling
+ *   thread being one of them, and start the resolvers they share. Never
+ *   returns.
+ */
+void event_serve(int fd, int nloops) {
+  pthread_t tid;
+  int i;
+
+  listenfd = fd;
+  if (set_nonblock(listenfd) < 0) {
+    unix_error("fcntl error");
+  }
+  sbuf_init(&resolve_q, EVENT_RESOLVE_SLOTS);
+  for (i = 0; i < EVENT_RESOLVERS; i++) {
+    Pthread_create(&tid, NULL, resolver, NULL);
+  }
+  for (i = 1; i < nloops; i++) {
+    Pthread_create(&tid, NULL, event_loop, NULL);
+  }
+  event_loop(NULL);
+}
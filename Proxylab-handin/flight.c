@@ -0,0 +1,127 @@
+/*
+ * flight.c - coalescing of concurrent misses on the same uri
+ *
+ * Without it, every request that misses on a popular object before it is
+ * cached goes to the server on its own, and each response is put in the
+ * cache again. Now the first request to miss on a uri leads a flight and
+ * is the only one to fetch it; requests missing on the same uri meanwhile
+ * follow, sleeping until the leader lands, and are then served from the
+ * cache. A follower sleeps for a while at most, so a leader stuck on a
+ * slow server does not hold it past its own deadlines. One semaphore
+ * guards the table along with each flight's counts and ended flag; a
+ * follower never holds it while it sleeps.
+ */
+#include "flight.h"
+#include "hash.h"
+
+static flight_t **buckets;
+static sem_t mutex; /* Initially = 1 */
+
+/* flight_init - Initialize an empty table */
+void flight_init() {
+  buckets = (flight_t **)Calloc(FLIGHT_BUCKETS, sizeof(flight_t *));
+  Sem_init(&mutex, 0, 1);
+}
+
+/* put - Drop a reference, freeing the flight with the last one */
+static void put(flight_t *f) {
+  int last;
+  P(&mutex);
+  last = (--f -> refcnt == 0);
+  V(&mutex);
+  if (last) {
+    free(f -> uri);
+    Free(f);
+  }
+}
+
+/* wait_done - Wait on f for msecs at most, for ever if 0. Return 0 if woken. */
+static int wait_done(flight_t *f, long msecs) {
+  struct timespec ts;
+  int rc;
+
+  if (msecs <= 0) {
+    P(&f -> done);
+    return 0;
+  }
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += msecs / 1000;
+  ts.tv_nsec += (msecs % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  while ((rc = sem_timedwait(&f -> done, &ts)) < 0 && errno == EINTR) {
+  }
+  return rc;
+}
+
+/*
+ * flight_join - Join the flight fetching uri. If there is none, start one
+ *   and return it: the caller leads, fetches the object and must call
+ *   flight_end. Otherwise wait up to msecs, unless 0, for the leader to
+ *   finish and return NULL; the object is then in the cache, unless it
+ *   could not be cached or the leader is not done yet.
+ */
+flight_t *flight_join(char *uri, long msecs) {
+  unsigned int hash = uri_hash(uri);
+  flight_t **bucket = &buckets[hash & (FLIGHT_BUCKETS - 1)];
+  flight_t *f;
+
+  P(&mutex);
+  for (f = *bucket; f != NULL; f = f -> next) {
+    if (f -> hash == hash && !strcasecmp(f -> uri, uri)) {
+      break;
+    }
+  }
+  if (f == NULL) { // lead
+    f = (flight_t *)Malloc(sizeof(flight_t));
+    f -> uri = strdup(uri);
+    f -> hash = hash;
+    f -> waiters = 0;
+    f -> refcnt = 1;
+    f -> ended = 0;
+    Sem_init(&f -> done, 0, 0);
+    f -> next = *bucket;
+    *bucket = f;
+    V(&mutex);
+    return f;
+  }
+  f -> waiters++;
+  f -> refcnt++;
+  V(&mutex);
+
+  if (wait_done(f, msecs) < 0) { // gave up following
+    P(&mutex);
+    if (!f -> ended) {
+      f -> waiters--;
+    } // else it is posted for us, and nobody else waits on it any more
+    V(&mutex);
+  }
+  put(f);
+  return NULL;
+}
+
+/*
+ * flight_end - The leader is done with the fetch, whatever came of it.
+ *   Take the flight off the table, so later misses start a new one, and
+ *   wake its followers.
+ */
+void flight_end(flight_t *f) {
+  flight_t **pp;
+  int n;
+
+  P(&mutex);
+  for (pp = &buckets[f -> hash & (FLIGHT_BUCKETS - 1)]; *pp != f;
+       pp = &(*pp) -> next)
+    ;
+  *pp = f -> next;
+  f -> ended = 1;
+  n = f -> waiters;
+  V(&mutex);
+
+  while (n-- > 0) {
+    V(&f -> done);
+  }
+  put(f);
+}
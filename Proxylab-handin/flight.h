@@ -0,0 +1,26 @@
+/*
+ * flight.h - coalescing of concurrent misses on the same uri
+ */
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include "csapp.h"
+
+#define FLIGHT_BUCKETS 256 /* Must be a power of 2 */
+
+/* A fetch from the server in progress, and the requests waiting on it */
+typedef struct flight {
+  char *uri;
+  unsigned int hash;
+  int waiters; /* followers blocked on done */
+  int refcnt; /* the leader plus every follower */
+  int ended; /* flight_end took it off the table */
+  sem_t done; /* posted once per follower when the fetch is over */
+  struct flight *next; /* next flight in the same bucket */
+} flight_t;
+
+void flight_init();
+flight_t *flight_join(char *uri, long msecs);
+void flight_end(flight_t *f);
+
+#endif /* __FLIGHT_H__ */
@@ -0,0 +1,25 @@
+/*
+ * hash.c - the one string hash of the proxy's tables
+ *
+ * FNV-1a over lower-cased bytes, matching the strcasecmp comparisons of
+ * the lookups. The cache, the disk and shared tiers and the flight table
+ * are all keyed by uri_hash, so they agree on a uri whichever looks it up;
+ * the DNS cache and the upstream pool chain the host and port with
+ * hash_add.
+ */
+#include <ctype.h>
+#include "hash.h"
+
+/* hash_add - Carry hash h on over the lower-cased string s */
+unsigned int hash_add(unsigned int h, const char *s) {
+  while (*s) {
+    h ^= (unsigned char)tolower((unsigned char)*s++);
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/* uri_hash - Hash of a uri, the key of the cache and its tiers */
+unsigned int uri_hash(const char *uri) {
+  return hash_add(HASH_SEED, uri);
+}
@@ -0,0 +1,12 @@
+/*
+ * hash.h - the one string hash of the proxy's tables
+ */
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#define HASH_SEED 2166136261u /* FNV-1a offset basis, where a hash starts */
+
+unsigned int hash_add(unsigned int h, const char *s);
+unsigned int uri_hash(const char *uri);
+
+#endif /* __HASH_H__ */
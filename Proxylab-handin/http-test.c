@@ -0,0 +1,66 @@
+/*
+ * http-test.c - checks of what http.c makes of a response's caching headers
+ *
+ * Parses a response head for each case and checks whether the proxy may
+ * store it and whether it must revalidate it before use. Prints each
+ * failing case and exits 1 if there was any.
+ *
+ * usage: ./http-test
+ */
+#include <stdio.h>
+#include "csapp.h"
+#include "http.h"
+
+typedef struct {
+  char *hdrs; /* header lines after the status line */
+  int auth; /* the request carried Authorization */
+  int stored; /* expected: may be cached at all */
+  int no_cache; /* expected: revalidated before every use */
+} test_case;
+
+static test_case cases[] = {
+  {"Cache-Control: max-age=60\r\n", 0, 1, 0},
+  {"Cache-Control: private\r\n", 0, 0, 0},
+  {"Cache-Control: private=\"Set-Cookie\", max-age=60\r\n", 0, 0, 0},
+  {"Cache-Control: max-age=60, no-cache\r\n", 0, 1, 1},
+  {"Cache-Control: no-cache=\"Set-Cookie\", max-age=60\r\n", 0, 1, 1},
+  {"Cache-Control: no-cachex, max-age=60\r\n", 0, 1, 0},
+  {"Cache-Control: max-age=60\r\nVary: Accept-Encoding\r\n", 0, 1, 0},
+  {"Cache-Control: max-age=60\r\nVary: Cookie\r\n", 0, 0, 0},
+  {"Cache-Control: max-age=60\r\n", 1, 0, 0},
+  {"Cache-Control: public, max-age=60\r\n", 1, 1, 0},
+  {"Cache-Control: s-maxage=60\r\n", 1, 1, 0},
+};
+
+/* run - Check one case, return 1 if it failed */
+static int run(test_case *t) {
+  char buf[MAXLINE];
+  response_t resp;
+  int len, stored;
+
+  len = snprintf(buf, MAXLINE, "HTTP/1.1 200 OK\r\nETag: \"x\"\r\n%s\r\n",
+                 t -> hdrs);
+  if (http_parse_response(buf, len, &resp) != len) {
+    printf("FAIL unparsed: %s", t -> hdrs);
+    return 1;
+  }
+  stored = http_storable(&resp, t -> auth) &&
+           http_expires(&resp, time(NULL)) != 0;
+  if (stored != t -> stored || resp.no_cache != t -> no_cache) {
+    printf("FAIL auth %d, stored %d want %d, no_cache %d want %d: %s",
+           t -> auth, stored, t -> stored, resp.no_cache, t -> no_cache,
+           t -> hdrs);
+    return 1;
+  }
+  return 0;
+}
+
+int main() {
+  int i, n = sizeof(cases) / sizeof(cases[0]), failed = 0;
+
+  for (i = 0; i < n; i++) {
+    failed += run(&cases[i]);
+  }
+  printf("%d cases, %d failed\n", n, failed);
+  return failed > 0;
+}
@@ -0,0 +1,731 @@
+/*
+ * http.c - HTTP/1.x message parsing helpers for the proxy
+ *
+ * The proxy frames each response for its client independently of how the
+ * server framed it. read_response_hdrs records how the server frames the
+ * body and drops the headers about framing and connection handling, so
+ * the caller can add its own for the client and for the cached copy.
+ * It also notes what the headers say about caching, and http_expires turns
+ * that into how long the response may be served from the cache, if at all.
+ *
+ * Requests are parsed in place. http_parse_head goes over the bytes of a
+ * request head as they arrive, each line once, and records the method, uri,
+ * version and every header line as slices of the buffer. Nothing is copied
+ * out, so the caller can rebuild the request for the server in one pass.
+ */
+#include "http.h"
+
+#define HTTP_HEAD_INIT 1024 /* First size of a request buffer we own */
+
+/*
+ * http_request_init - Start parsing a request head. With a buf the caller
+ *   owns it and appends to it, updating len; with NULL http_read_request
+ *   fills a buffer of its own.
+ */
+void http_request_init(http_request *r, char *buf, int len) {
+  memset(r, 0, sizeof(*r));
+  if (buf == NULL) {
+    r -> cap = HTTP_HEAD_INIT;
+    buf = Malloc(r -> cap + 1);
+    buf[0] = '\0';
+  }
+  r -> buf = buf;
+  r -> len = len;
+}
+
+/* http_request_free - Free what parsing allocated */
+void http_request_free(http_request *r) {
+  if (r -> cap > 0) {
+    Free(r -> buf);
+  }
+  free(r -> hdrs);
+  r -> buf = NULL;
+  r -> hdrs = NULL;
+}
+
+/* next_word - Slice the run of non-blanks at *p up to end, and skip it */
+static http_slice next_word(char **p, char *end) {
+  http_slice w;
+  while (*p < end && (**p == ' ' || **p == '\t')) {
+    (*p)++;
+  }
+  w.p = *p;
+  while (*p < end && **p != ' ' && **p != '\t') {
+    (*p)++;
+  }
+  w.len = *p - w.p;
+  return w;
+}
+
+/*
+ * parse_line - Take in one complete line of the head, len bytes with its
+ *   line ending. Return 1 if it ends the head, 0 if more lines follow and
+ *   -1 if it is malformed.
+ */
+static int parse_line(http_request *r, char *line, int len) {
+  char *end = line + len, *p = line;
+
+  while (end > line && (end[-1] == '\n' || end[-1] == '\r')) {
+    end--;
+  }
+  if (r -> method.p == NULL) { // the request line
+    r -> method = next_word(&p, end);
+    r -> uri = next_word(&p, end);
+    r -> version = next_word(&p, end);
+    if (r -> method.len == 0 || r -> uri.len == 0 ||
+        next_word(&p, end).len != 0) {
+      return -1;
+    }
+    return r -> version.len == 0; // a Simple-Request has no headers
+  }
+  if (end == line) { // blank line
+    return 1;
+  }
+  if (r -> nhdrs == r -> hdrs_cap) {
+    r -> hdrs_cap = r -> hdrs_cap ? 2 * r -> hdrs_cap : 16;
+    r -> hdrs = Realloc(r -> hdrs, r -> hdrs_cap * sizeof(http_slice));
+  }
+  r -> hdrs[r -> nhdrs].p = line;
+  r -> hdrs[r -> nhdrs].len = len;
+  r -> nhdrs++;
+  return 0;
+}
+
+/*
+ * http_parse_head - Parse the lines of r's buffer that are complete and
+ *   not parsed yet. Return 1 once the head is complete, 0 if more bytes
+ *   are needed and -1 if it is malformed or longer than HTTP_MAX_HEAD.
+ */
+int http_parse_head(http_request *r) {
+  char *nl;
+  int start, rc;
+
+  while (r -> head_len == 0 &&
+         (nl = memchr(r -> buf + r -> done, '\n', r -> len - r -> done))
+           != NULL) {
+    start = r -> done;
+    r -> done = nl - r -> buf + 1;
+    if ((rc = parse_line(r, r -> buf + start, r -> done - start)) < 0) {
+      return -1;
+    }
+    if (rc > 0) {
+      r -> head_len = r -> done;
+    }
+  }
+  if (r -> head_len > 0) {
+    return 1;
+  }
+  return r -> len >= HTTP_MAX_HEAD ? -1 : 0;
+}
+
+/* grow - Double the buffer r owns, moving its slices along */
+static void grow(http_request *r) {
+  char *old = r -> buf;
+  int i;
+
+  r -> cap *= 2;
+  r -> buf = Realloc(r -> buf, r -> cap + 1);
+  if (r -> method.p != NULL) {
+    r -> method.p = r -> buf + (r -> method.p - old);
+    r -> uri.p = r -> buf + (r -> uri.p - old);
+    r -> version.p = r -> buf + (r -> version.p - old);
+  }
+  for (i = 0; i < r -> nhdrs; i++) {
+    r -> hdrs[i].p = r -> buf + (r -> hdrs[i].p - old);
+  }
+}
+
+/*
+ * http_read_request - Read a request head from rp into r, set up with a
+ *   NULL buffer, and parse it. Bytes are taken from rio's buffer up to one
+ *   line at a time, so a pipelined request behind the head stays there.
+ *   Return 1 once the head is in, 0 if the client closed or went idle
+ *   before sending anything and -1 on a malformed, oversized or cut off
+ *   head.
+ */
+int http_read_request(rio_t *rp, http_request *r) {
+  char *nl;
+  int n, rc;
+
+  while ((rc = http_parse_head(r)) == 0) {
+    while (rp -> rio_cnt <= 0) { // refill, as rio_read does
+      rp -> rio_cnt = read(rp -> rio_fd, rp -> rio_buf, sizeof(rp -> rio_buf));
+      if (rp -> rio_cnt < 0 && errno == EINTR) {
+        continue;
+      }
+      if (rp -> rio_cnt <= 0) {
+        rp -> rio_cnt = 0;
+        return r -> len == 0 ? 0 : -1;
+      }
+      rp -> rio_bufptr = rp -> rio_buf;
+    }
+    nl = memchr(rp -> rio_bufptr, '\n', rp -> rio_cnt);
+    n = nl != NULL ? nl - rp -> rio_bufptr + 1 : rp -> rio_cnt;
+    while (r -> len + n > r -> cap) {
+      if (r -> cap >= HTTP_MAX_HEAD) {
+        return -1;
+      }
+      grow(r);
+    }
+    memcpy(r -> buf + r -> len, rp -> rio_bufptr, n);
+    r -> len += n;
+    r -> buf[r -> len] = '\0';
+    rp -> rio_bufptr += n;
+    rp -> rio_cnt -= n;
+  }
+  return rc;
+}
+
+/*
+ * http_head_buffered - Is a whole request head, or a malformed one, in
+ *   rp's buffer already? If so http_read_request takes it without reading
+ *   the socket.
+ */
+int http_head_buffered(rio_t *rp) {
+  http_request r;
+  int rc;
+
+  if (rp -> rio_cnt <= 0) {
+    return 0;
+  }
+  http_request_init(&r, rp -> rio_bufptr, rp -> rio_cnt);
+  rc = http_parse_head(&r);
+  http_request_free(&r);
+  return rc != 0;
+}
+
+/*
+ * http_split_uri - Split an absolute http uri into its host, its port
+ *   (empty if not given) and its path (empty if not given), in one pass.
+ *   Return 0 on success, 1 if uri is not an http uri with a host.
+ */
+int http_split_uri(http_slice uri, http_slice *host, http_slice *port,
+                   http_slice *path) {
+  char *p = uri.p, *end = uri.p + uri.len;
+  int scheme = strlen("http://");
+
+  if (uri.len < scheme || strncasecmp(p, "http://", scheme)) {
+    return 1;
+  }
+  host -> p = p = p + scheme;
+  while (p < end && *p != ':' && *p != '/') {
+    p++;
+  }
+  host -> len = p - host -> p;
+  port -> p = p;
+  port -> len = 0;
+  if (p < end && *p == ':') {
+    port -> p = ++p;
+    while (p < end && *p != '/') {
+      p++;
+    }
+    port -> len = p - port -> p;
+  }
+  path -> p = p;
+  path -> len = end - p;
+  return host -> len == 0;
+}
+
+/*
+ * http_hdr_value - If line is header name, return a pointer to its value
+ *   with leading blanks skipped, otherwise NULL.
+ */
+char *http_hdr_value(char *line, char *name) {
+  int len = strlen(name);
+  if (strncasecmp(line, name, len) || line[len] != ':') {
+    return NULL;
+  }
+  line += len + 1;
+  while (*line == ' ' || *line == '\t') {
+    line++;
+  }
+  return line;
+}
+
+/*
+ * find_token - Return 1 if the comma separated value lists token, also
+ *   as token=argument if with_arg, ignoring case
+ */
+static int find_token(char *value, char *token, int with_arg) {
+  int len = strlen(token);
+  char *p;
+  for (p = value; *p != '\0' && *p != '\r' && *p != '\n'; p++) {
+    if ((p == value || p[-1] == ',' || p[-1] == ' ') &&
+        !strncasecmp(p, token, len) &&
+        (p[len] == ',' || p[len] == ' ' || p[len] == '\r' ||
+         p[len] == '\n' || p[len] == '\0' || (with_arg && p[len] == '='))) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * http_has_token - Return 1 if the comma separated header value lists
+ *   token, ignoring case. The value ends with its line.
+ */
+int http_has_token(char *value, char *token) {
+  return find_token(value, token, 0);
+}
+
+/*
+ * parse_date - An HTTP-date in the preferred form, like
+ *   "Sun, 06 Nov 1994 08:49:37 GMT", as a time. 0 if it is not one.
+ */
+static long parse_date(char *value) {
+  static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char month[4], *m;
+  struct tm tm;
+
+  memset(&tm, 0, sizeof(tm));
+  if (sscanf(value, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &tm.tm_mday, month,
+             &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6 ||
+      strlen(month) != 3 || (m = strstr(months, month)) == NULL ||
+      (m - months) % 3 != 0) {
+    return 0;
+  }
+  tm.tm_mon = (m - months) / 3;
+  tm.tm_year -= 1900;
+  return timegm(&tm);
+}
+
+/* cache_control - Note the Cache-Control directives a shared cache obeys */
+static void cache_control(response_t *resp, char *value) {
+  char *p;
+  for (p = value; *p != '\0' && *p != '\r' && *p != '\n'; p++) {
+    if (p != value && p[-1] != ',' && p[-1] != ' ') {
+      continue; // not the start of a directive
+    }
+    if (!strncasecmp(p, "s-maxage=", strlen("s-maxage="))) {
+      resp -> max_age = strtol(p + strlen("s-maxage="), NULL, 10);
+      resp -> s_maxage = resp -> shared = 1;
+    } else if (!strncasecmp(p, "max-age=", strlen("max-age="))) {
+      if (!resp -> s_maxage) {
+        resp -> max_age = strtol(p + strlen("max-age="), NULL, 10);
+      }
+    } else if (!strncasecmp(p, "stale-while-revalidate=",
+                            strlen("stale-while-revalidate="))) {
+      resp -> stale_while_revalidate =
+        strtol(p + strlen("stale-while-revalidate="), NULL, 10);
+    }
+  }
+  // private="field" and no-cache="field" only name fields, but the proxy
+  // doesn't strip them, so they count for the whole response
+  if (http_has_token(value, "no-store") || find_token(value, "private", 1)) {
+    resp -> no_store = 1;
+  }
+  if (find_token(value, "no-cache", 1)) {
+    resp -> no_cache = resp -> must_revalidate = 1;
+  }
+  if (http_has_token(value, "must-revalidate") ||
+      http_has_token(value, "proxy-revalidate")) {
+    resp -> must_revalidate = 1;
+  }
+  if (http_has_token(value, "public") ||
+      http_has_token(value, "must-revalidate")) {
+    resp -> shared = 1;
+  }
+}
+
+/* vary - Note which request headers a Vary header value names */
+static void vary(response_t *resp, char *value) {
+  char *p = value;
+  int len;
+
+  while (1) {
+    p += strspn(p, " \t,");
+    if (*p == '\0' || *p == '\r' || *p == '\n') {
+      return;
+    }
+    len = strcspn(p, " \t,\r\n");
+    if (len == strlen("Accept-Encoding") &&
+        !strncasecmp(p, "Accept-Encoding", len)) {
+      resp -> vary |= HTTP_VARY_ENCODING;
+    } else {
+      resp -> vary |= HTTP_VARY_OTHER;
+    }
+    p += len;
+  }
+}
+
+/* response_status - Start resp from the status line. Return -1 if bad. */
+static int response_status(response_t *resp, char *line) {
+  char *end;
+  int len = strlen("HTTP/1.");
+
+  if (strncasecmp(line, "HTTP/1.", len) || !isdigit((unsigned char)line[len]) ||
+      line[len + 1] != ' ') {
+    return -1;
+  }
+  resp -> status = strtol(line + len + 2, &end, 10);
+  if (end == line + len + 2) {
+    return -1;
+  }
+  resp -> keep_alive = line[len] != '0'; // the default of each version
+  resp -> chunked = 0;
+  resp -> content_length = -1;
+  resp -> no_store = 0;
+  resp -> no_cache = 0;
+  resp -> must_revalidate = 0;
+  resp -> stale_while_revalidate = -1;
+  resp -> max_age = -1;
+  resp -> s_maxage = 0;
+  resp -> shared = 0;
+  resp -> vary = 0;
+  resp -> expires = -1;
+  resp -> date = -1;
+  resp -> last_modified = -1;
+  resp -> etag = 0;
+  resp -> age = 0;
+  return 0;
+}
+
+/*
+ * response_hdr - Note what a header line of a response says. Return 1 if
+ *   it is about framing or connection handling and is left out, else 0.
+ */
+static int response_hdr(response_t *resp, char *line) {
+  char *value;
+
+  if ((value = http_hdr_value(line, "Connection")) != NULL) {
+    if (http_has_token(value, "close")) {
+      resp -> keep_alive = 0;
+    } else if (http_has_token(value, "keep-alive")) {
+      resp -> keep_alive = 1;
+    }
+    return 1;
+  }
+  if ((value = http_hdr_value(line, "Transfer-Encoding")) != NULL) {
+    resp -> chunked = http_has_token(value, "chunked");
+    return 1;
+  }
+  if (http_hdr_value(line, "Keep-Alive") != NULL ||
+      http_hdr_value(line, "Proxy-Connection") != NULL) {
+    return 1;
+  }
+  if ((value = http_hdr_value(line, "Content-Length")) != NULL) {
+    resp -> content_length = strtol(value, NULL, 10);
+    return 1;
+  }
+  if ((value = http_hdr_value(line, "Cache-Control")) != NULL) {
+    cache_control(resp, value);
+  } else if ((value = http_hdr_value(line, "Pragma")) != NULL) {
+    resp -> no_store |= http_has_token(value, "no-cache");
+  } else if ((value = http_hdr_value(line, "Expires")) != NULL) {
+    resp -> expires = parse_date(value);
+  } else if ((value = http_hdr_value(line, "Date")) != NULL) {
+    resp -> date = parse_date(value);
+  } else if ((value = http_hdr_value(line, "Last-Modified")) != NULL) {
+    resp -> last_modified = parse_date(value);
+  } else if ((value = http_hdr_value(line, "Vary")) != NULL) {
+    vary(resp, value);
+  } else if ((value = http_hdr_value(line, "Age")) != NULL) {
+    resp -> age = strtol(value, NULL, 10);
+  } else if (http_hdr_value(line, "ETag") != NULL) {
+    resp -> etag = 1;
+  }
+  return 0;
+}
+
+/*
+ * read_response_hdrs - Read the status line and headers of a response
+ *   from rp into resp, and write the rest of the header into hdr, which
+ *   holds maxlen bytes. Hop-by-hop headers, Content-Length and the blank
+ *   line ending the header are left out. Return the length of hdr, or -1
+ *   if the server closed or sent a malformed or oversized header.
+ */
+int read_response_hdrs(rio_t *rp, char *hdr, int maxlen, response_t *resp) {
+  char buf[MAXLINE];
+  int len, hdr_len = 0;
+
+  if ((len = rio_readlineb(rp, buf, MAXLINE)) <= 0) {
+    return -1;
+  }
+  if (response_status(resp, buf) < 0 || len >= maxlen) {
+    return -1;
+  }
+  memcpy(hdr, buf, len);
+  hdr_len = len;
+
+  while (1) {
+    if ((len = rio_readlineb(rp, buf, MAXLINE)) <= 0) {
+      return -1;
+    }
+    if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n")) {
+      break;
+    }
+    if (response_hdr(resp, buf)) {
+      continue;
+    }
+    if (hdr_len + len >= maxlen) {
+      return -1;
+    }
+    memcpy(hdr + hdr_len, buf, len);
+    hdr_len += len;
+  }
+  if (resp -> chunked) {
+    resp -> content_length = -1; // chunked wins over a stray length
+  }
+  hdr[hdr_len] = '\0';
+  return hdr_len;
+}
+
+/*
+ * http_parse_response - Parse the head of a response held in the first
+ *   len bytes of buf into resp, leaving buf as it is. Return the length of
+ *   the head with its blank line, 0 if it has not all arrived yet, or -1 if
+ *   it is malformed.
+ */
+int http_parse_response(char *buf, int len, response_t *resp) {
+  char *line = buf, *nl;
+
+  while ((nl = memchr(line, '\n', buf + len - line)) != NULL) {
+    if (line == buf) {
+      if (response_status(resp, line) < 0) {
+        return -1;
+      }
+    } else if (line[0] == '\r' || line[0] == '\n') {
+      if (resp -> chunked) {
+        resp -> content_length = -1;
+      }
+      return nl + 1 - buf;
+    } else {
+      response_hdr(resp, line);
+    }
+    line = nl + 1;
+  }
+  return 0;
+}
+
+/*
+ * http_response_hdrs - Write the head held in the first len bytes of buf,
+ *   one http_parse_response took in whole, into hdr, which holds maxlen
+ *   bytes, leaving out what read_response_hdrs leaves out. Return the
+ *   length of hdr, or -1 if it does not fit.
+ */
+int http_response_hdrs(char *buf, int len, char *hdr, int maxlen) {
+  char *line = buf, *nl;
+  response_t resp;
+  int hdr_len = 0;
+
+  memset(&resp, 0, sizeof(resp)); // only to note into, not looked at
+  while ((nl = memchr(line, '\n', buf + len - line)) != NULL) {
+    if (line != buf && (line[0] == '\r' || line[0] == '\n')) {
+      break;
+    }
+    if (line == buf || !response_hdr(&resp, line)) {
+      if (hdr_len + (nl + 1 - line) >= maxlen) {
+        return -1;
+      }
+      memcpy(hdr + hdr_len, line, nl + 1 - line);
+      hdr_len += nl + 1 - line;
+    }
+    line = nl + 1;
+  }
+  hdr[hdr_len] = '\0';
+  return hdr_len;
+}
+
+/* http_cacheable_status - May a response with this status be cached
+ *   without the server saying for how long? */
+static int http_cacheable_status(int status) {
+  return status == 200 || status == 203 || status == 204 || status == 300 ||
+         status == 301 || status == 404 || status == 405 || status == 410 ||
+         status == 414 || status == 501;
+}
+
+/*
+ * http_expires - When a response read at now goes stale. Explicit
+ *   freshness comes first: no-cache, s-maxage or max-age, then Expires
+ *   against the server's Date. Without it a fraction of the time since
+ *   Last-Modified is used, or HTTP_DEFAULT_TTL. A response already stale
+ *   is only worth keeping to revalidate, and expires at now if it has a
+ *   validator. Return 0 if the response must not be cached, because the
+ *   server forbids it, its status is not cacheable or it is stale with
+ *   nothing to revalidate it by.
+ */
+long http_expires(response_t *resp, long now) {
+  long ttl, date = resp -> date > 0 ? resp -> date : now;
+
+  if (resp -> no_store || resp -> status < 200 || resp -> status == 206 ||
+      resp -> status == 304) {
+    return 0;
+  }
+  if (resp -> no_cache) {
+    ttl = 0;
+  } else if (resp -> max_age >= 0) {
+    ttl = resp -> max_age;
+  } else if (resp -> expires >= 0) {
+    ttl = resp -> expires - date;
+  } else if (!http_cacheable_status(resp -> status)) {
+    return 0;
+  } else if (resp -> last_modified > 0 && resp -> last_modified <= date) {
+    ttl = (date - resp -> last_modified) / 10;
+    if (ttl > HTTP_MAX_HEURISTIC_TTL) {
+      ttl = HTTP_MAX_HEURISTIC_TTL;
+    }
+  } else {
+    ttl = HTTP_DEFAULT_TTL;
+  }
+  ttl -= resp -> age;
+  if (ttl > 0) {
+    return now + ttl;
+  }
+  return resp -> etag || resp -> last_modified > 0 ? now : 0;
+}
+
+/*
+ * http_storable - May the proxy keep resp at all, keyed by the uri and the
+ *   request's Accept-Encoding? Not if it varies on any other header, nor,
+ *   if the request carried Authorization (auth), unless the server said
+ *   public, s-maxage or must-revalidate (RFC 9111, section 3.5).
+ */
+int http_storable(response_t *resp, int auth) {
+  return !(resp -> vary & HTTP_VARY_OTHER) && (!auth || resp -> shared);
+}
+
+/*
+ * http_conditional - Write into out, which holds size bytes, the headers
+ *   revalidating a cached response whose header is the first len bytes of
+ *   hdr: If-None-Match with its ETag, If-Modified-Since with its
+ *   Last-Modified. Return their length, 0 if it has neither.
+ */
+int http_conditional(char *hdr, int len, char *out, int size) {
+  char *line, *eol, *value, *end = hdr + len;
+  int n = 0;
+
+  for (line = hdr; line < end; line = eol) {
+    eol = memchr(line, '\n', end - line);
+    eol = eol != NULL ? eol + 1 : end;
+    if ((value = http_hdr_value(line, "ETag")) != NULL) {
+      n += snprintf(out + n, n < size ? size - n : 0, "If-None-Match: %.*s",
+                    (int)(eol - value), value);
+    } else if ((value = http_hdr_value(line, "Last-Modified")) != NULL) {
+      n += snprintf(out + n, n < size ? size - n : 0,
+                    "If-Modified-Since: %.*s", (int)(eol - value), value);
+    }
+  }
+  return n < size ? n : 0;
+}
+
+/*
+ * http_refresh - Bring a cached response up to date with the 304 that
+ *   revalidated it. What the 304 says about freshness replaces what was
+ *   stored, the rest is kept, so http_expires of stored is the new expiry.
+ */
+void http_refresh(response_t *stored, response_t *fresh) {
+  if (fresh -> max_age >= 0) {
+    stored -> max_age = fresh -> max_age;
+    stored -> s_maxage = fresh -> s_maxage;
+  }
+  if (fresh -> expires >= 0) {
+    stored -> expires = fresh -> expires;
+  }
+  if (fresh -> date >= 0) {
+    stored -> date = fresh -> date;
+  }
+  if (fresh -> stale_while_revalidate >= 0) {
+    stored -> stale_while_revalidate = fresh -> stale_while_revalidate;
+  }
+  stored -> no_store |= fresh -> no_store;
+  stored -> no_cache |= fresh -> no_cache;
+  stored -> must_revalidate |= fresh -> must_revalidate;
+  stored -> age = fresh -> age;
+}
+
+/*
+ * http_parse_range - Parse a Range value asking for one range of bytes:
+ *   "bytes=first-last", "bytes=first-" (*last is -1) or "bytes=-n", the
+ *   last n bytes (*first is -1, *last is n). Return 1 if it is one, 0 if it
+ *   is malformed or asks for several ranges, which the proxy ignores.
+ */
+int http_parse_range(char *value, long *first, long *last) {
+  char *p = value + strlen("bytes="), *end;
+
+  if (strncasecmp(value, "bytes=", strlen("bytes="))) {
+    return 0;
+  }
+  *first = *last = -1;
+  if (isdigit((unsigned char)*p)) {
+    *first = strtol(p, &end, 10);
+    p = end;
+  }
+  if (*p++ != '-') {
+    return 0;
+  }
+  if (isdigit((unsigned char)*p)) {
+    *last = strtol(p, &end, 10);
+    p = end;
+  }
+  while (*p == ' ' || *p == '\t') {
+    p++;
+  }
+  if (*p != '\r' && *p != '\n' && *p != '\0') {
+    return 0; // a list of ranges, or junk
+  }
+  return (*first >= 0 && (*last < 0 || *last >= *first)) ||
+         (*first < 0 && *last >= 0);
+}
+
+/*
+ * http_range_resolve - Clip a range parsed by http_parse_range to an
+ *   object of total bytes. Return 0 with *first and *last the bytes to
+ *   send, or -1 if none of the range is in the object.
+ */
+int http_range_resolve(long *first, long *last, long total) {
+  if (*first < 0) { // suffix
+    if (*last == 0 || total == 0) {
+      return -1;
+    }
+    *first = *last >= total ? 0 : total - *last;
+    *last = total - 1;
+    return 0;
+  }
+  if (*first >= total) {
+    return -1;
+  }
+  if (*last < 0 || *last >= total) {
+    *last = total - 1;
+  }
+  return 0;
+}
+
+/*
+ * read_chunk_size - Read a chunk-size line, ignoring chunk extensions.
+ *   Return the size, or -1 on error.
+ */
+long read_chunk_size(rio_t *rp) {
+  char buf[MAXLINE], *end;
+  long size;
+
+  if (rio_readlineb(rp, buf, MAXLINE) <= 0) {
+    return -1;
+  }
+  size = strtol(buf, &end, 16);
+  if (end == buf || size < 0) {
+    return -1;
+  }
+  return size;
+}
+
+/*
+ * skip_chunk_trailer - Consume the trailer after the last chunk, up to the
+ *   blank line. Return 0 on success, -1 on error.
+ */
+int skip_chunk_trailer(rio_t *rp) {
+  char buf[MAXLINE];
+  while (1) {
+    if (rio_readlineb(rp, buf, MAXLINE) <= 0) {
+      return -1;
+    }
+    if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n")) {
+      return 0;
+    }
+  }
+}
+
+/* http_has_body - Return 0 for statuses that never carry a body */
+int http_has_body(response_t *resp) {
+  return !((resp -> status >= 100 && resp -> status < 200) ||
+           resp -> status == 204 || resp -> status == 304);
+}
@@ -0,0 +1,84 @@
+/*
+ * http.h - HTTP/1.x message parsing helpers for the proxy
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+
+#define HTTP_MAX_HEAD (64 * 1024) /* Longest request line plus headers */
+#define HTTP_DEFAULT_TTL 300 /* Seconds fresh when the server gives no hint */
+#define HTTP_MAX_HEURISTIC_TTL 86400 /* Cap on a Last-Modified based TTL */
+
+/* What a response's Vary says it depends on, besides the uri */
+#define HTTP_VARY_ENCODING 1 /* Accept-Encoding */
+#define HTTP_VARY_OTHER 2 /* any other request header, or * */
+
+/* A run of bytes inside a buffer, not NUL terminated */
+typedef struct {
+  char *p;
+  int len;
+} http_slice;
+
+/*
+ * A request line and its headers, parsed in place as they arrive. The
+ * slices point into buf, which is kept NUL terminated.
+ */
+typedef struct {
+  char *buf;
+  int len; /* bytes in buf */
+  int cap; /* size of buf, 0 if the caller owns it */
+  int done; /* lines before this offset are parsed */
+  int head_len; /* length of the whole head once complete, else 0 */
+  http_slice method, uri, version; /* version is empty for a Simple-Request */
+  http_slice *hdrs; /* each header line, with its line ending */
+  int nhdrs;
+  int hdrs_cap;
+} http_request;
+
+/* What the proxy needs to know about a response from the server */
+typedef struct {
+  int status;
+  int keep_alive; /* the server lets us reuse the connection */
+  int chunked; /* body uses chunked transfer coding */
+  long content_length; /* -1 if the server did not say */
+  int no_store; /* Cache-Control says a shared cache must not keep it */
+  int no_cache; /* Cache-Control says revalidate it before every use */
+  int must_revalidate; /* never to be served stale */
+  long stale_while_revalidate; /* seconds it may be served stale while
+                                  revalidated, -1 if not given */
+  long max_age; /* s-maxage, else max-age, in seconds, -1 if not given */
+  int s_maxage; /* max_age came from s-maxage */
+  int shared; /* public, s-maxage or must-revalidate given, so it may be
+                 kept even for a request with Authorization */
+  int vary; /* HTTP_VARY_ flags */
+  long expires; /* Expires, -1 if not given, 0 if not a valid date */
+  long date; /* Date, -1 if not given */
+  long last_modified; /* Last-Modified, -1 if not given */
+  int etag; /* ETag given */
+  long age; /* Age, seconds the response already spent in caches */
+} response_t;
+
+void http_request_init(http_request *r, char *buf, int len);
+int http_parse_head(http_request *r);
+int http_read_request(rio_t *rp, http_request *r);
+int http_head_buffered(rio_t *rp);
+void http_request_free(http_request *r);
+int http_split_uri(http_slice uri, http_slice *host, http_slice *port,
+                   http_slice *path);
+char *http_hdr_value(char *line, char *name);
+int http_has_token(char *value, char *token);
+int read_response_hdrs(rio_t *rp, char *hdr, int maxlen, response_t *resp);
+int http_parse_response(char *buf, int len, response_t *resp);
+int http_response_hdrs(char *buf, int len, char *hdr, int maxlen);
+long http_expires(response_t *resp, long now);
+int http_storable(response_t *resp, int auth);
+int http_conditional(char *hdr, int len, char *out, int size);
+void http_refresh(response_t *stored, response_t *fresh);
+int http_parse_range(char *value, long *first, long *last);
+int http_range_resolve(long *first, long *last, long total);
+long read_chunk_size(rio_t *rp);
+int skip_chunk_trailer(rio_t *rp);
+int http_has_body(response_t *resp);
+
+#endif /* __HTTP_H__ */
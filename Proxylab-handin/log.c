@@ -0,0 +1,236 @@
+/*
+ * log.c - asynchronous logger of the proxy
+ *
+ * log_write formats a line on the calling thread and copies it into that
+ * thread's ring buffer; it takes no lock and makes no system call. A
+ * drainer thread goes over every ring each LOG_DRAIN_USECS and writes
+ * what it finds with one writev per pass, so a request never waits on the
+ * terminal or the log file. Each thread's lines come out in order; lines
+ * of different threads are only ordered by their timestamps.
+ *
+ * A ring has one producer, its thread, and one consumer, the drainer.
+ * head and tail count bytes ever written and ever drained: the producer
+ * publishes a line by storing head with release order, and the drainer
+ * hands the space back by storing tail the same way. A line that does not
+ * fit in what is left of the ring is dropped and counted, rather than
+ * making the request wait for the drainer.
+ *
+ * Rings are listed when a thread first logs. A thread that exits marks
+ * its ring dead, and the drainer frees it once it is empty, so thread per
+ * connection loses no lines.
+ *
+ * Until log_init starts the drainer, lines go straight to stdout. That is
+ * what the benchmarks linking the cache get.
+ */
+#include "log.h"
+#include <sys/uio.h>
+
+#define LOG_BATCH 64 /* Rings written per writev, two pieces each */
+
+typedef struct log_ring {
+  char buf[LOG_RING_SIZE];
+  unsigned long head; /* bytes ever written, stored by the owner */
+  unsigned long tail; /* bytes ever drained, stored by the drainer */
+  long dropped; /* lines that did not fit, stored by the owner */
+  int dead; /* the owner exited, free once drained */
+  struct log_ring *next;
+} log_ring;
+
+static log_ring *rings;
+static long retired_dropped; /* dropped by rings since freed */
+static int log_fd = -1; /* -1 until the drainer runs */
+static sem_t mutex; /* Initially = 1, protects rings and retired_dropped */
+static sem_t drain_mutex; /* Initially = 1, one drain at a time */
+static pthread_key_t ring_key;
+
+static __thread log_ring *mine;
+
+static const char *level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+/* retire - An exiting thread leaves its ring for the drainer to free */
+static void retire(void *vargp) {
+  __atomic_store_n(&((log_ring *)vargp) -> dead, 1, __ATOMIC_RELEASE);
+}
+
+/* ring - This thread's ring, listed on first use */
+static log_ring *ring() {
+  if (mine == NULL) {
+    mine = (log_ring *)Calloc(1, sizeof(log_ring));
+    P(&mutex);
+    mine -> next = rings;
+    rings = mine;
+    V(&mutex);
+    pthread_setspecific(ring_key, mine);
+  }
+  return mine;
+}
+
+/*
+ * log_write - Log a line at level, formatted as by printf. The caller
+ *   leaves out the newline. Use the log_ macros, which compile away the
+ *   levels below LOG_LEVEL.
+ */
+void log_write(int level, const char *fmt, ...) {
+  char line[LOG_LINE_MAX];
+  struct timespec ts;
+  unsigned long head;
+  log_ring *r;
+  va_list ap;
+  int len, n, off;
+
+  clock_gettime(CLOCK_REALTIME, &ts); // no system call, vdso
+  len = snprintf(line, LOG_LINE_MAX, "%ld.%06ld %s ", (long)ts.tv_sec,
+                 ts.tv_nsec / 1000, level_names[level]);
+  va_start(ap, fmt);
+  n = vsnprintf(line + len, LOG_LINE_MAX - len, fmt, ap);
+  va_end(ap);
+  len = n < 0 ? len : len + n;
+  if (len > LOG_LINE_MAX - 2) {
+    len = LOG_LINE_MAX - 2; // cut, keeping room for the newline
+  }
+  line[len++] = '\n';
+
+  if (__atomic_load_n(&log_fd, __ATOMIC_ACQUIRE) < 0) {
+    fwrite(line, 1, len, stdout);
+    return;
+  }
+  r = ring();
+  head = r -> head;
+  if (head + len - __atomic_load_n(&r -> tail, __ATOMIC_ACQUIRE)
+        > LOG_RING_SIZE) {
+    __atomic_store_n(&r -> dropped, r -> dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+  off = head & (LOG_RING_SIZE - 1);
+  n = LOG_RING_SIZE - off < len ? LOG_RING_SIZE - off : len;
+  memcpy(r -> buf + off, line, n);
+  memcpy(r -> buf, line + n, len - n); // wrapped around
+  __atomic_store_n(&r -> head, head + len, __ATOMIC_RELEASE);
+}
+
+/*
+ * write_batch - Write the pieces gathered from nr rings, then give their
+ *   space back up to the heads they were gathered at.
+ */
+static void write_batch(struct iovec *iov, int n, log_ring **batch,
+                        unsigned long *heads, int nr) {
+  ssize_t w;
+  int i;
+
+  while (n > 0) {
+    if ((w = writev(log_fd, iov, n)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break; // nowhere to log to, drop it all
+    }
+    for (; n > 0 && w >= iov -> iov_len; iov++, n--) {
+      w -= iov -> iov_len;
+    }
+    if (n > 0) { // short write, carry on from the middle of a piece
+      iov -> iov_base = (char *)iov -> iov_base + w;
+      iov -> iov_len -= w;
+    }
+  }
+  for (i = 0; i < nr; i++) {
+    __atomic_store_n(&batch[i] -> tail, heads[i], __ATOMIC_RELEASE);
+  }
+}
+
+/* drain - Write out everything logged so far and free emptied dead rings */
+static void drain() {
+  struct iovec iov[2 * LOG_BATCH];
+  log_ring *batch[LOG_BATCH];
+  unsigned long heads[LOG_BATCH];
+  unsigned long head, tail;
+  log_ring **pp, *r;
+  int n = 0, nr = 0, off;
+
+  P(&drain_mutex);
+  P(&mutex);
+  for (pp = &rings; (r = *pp) != NULL; ) {
+    // dead is read first, so a head read after it is the owner's last
+    if (__atomic_load_n(&r -> dead, __ATOMIC_ACQUIRE) &&
+        __atomic_load_n(&r -> head, __ATOMIC_ACQUIRE) == r -> tail) {
+      *pp = r -> next;
+      retired_dropped += r -> dropped;
+      Free(r);
+      continue;
+    }
+    pp = &r -> next;
+    head = __atomic_load_n(&r -> head, __ATOMIC_ACQUIRE);
+    if ((tail = r -> tail) == head) {
+      continue;
+    }
+    off = tail & (LOG_RING_SIZE - 1);
+    iov[n].iov_base = r -> buf + off;
+    iov[n].iov_len = LOG_RING_SIZE - off < head - tail ?
+                     LOG_RING_SIZE - off : head - tail;
+    if (iov[n].iov_len < head - tail) { // wraps around
+      iov[n + 1].iov_base = r -> buf;
+      iov[n + 1].iov_len = head - tail - iov[n].iov_len;
+      n++;
+    }
+    n++;
+    batch[nr] = r;
+    heads[nr++] = head;
+    if (nr == LOG_BATCH) {
+      write_batch(iov, n, batch, heads, nr);
+      n = nr = 0;
+    }
+  }
+  V(&mutex);
+  write_batch(iov, n, batch, heads, nr);
+  V(&drain_mutex);
+}
+
+/* drainer - Thread routine draining the rings until the process exits */
+static void *drainer(void *vargp) {
+  Pthread_detach(pthread_self());
+  while (1) {
+    usleep(LOG_DRAIN_USECS);
+    drain();
+  }
+  return NULL;
+}
+
+/*
+ * log_init - Start logging to fd through the rings, with a drainer
+ *   thread. Lines logged before go to stdout unbuffered by the rings.
+ */
+void log_init(int fd) {
+  pthread_t tid;
+
+  Sem_init(&mutex, 0, 1);
+  Sem_init(&drain_mutex, 0, 1);
+  pthread_key_create(&ring_key, retire);
+  fflush(stdout); // what came before goes first
+  __atomic_store_n(&log_fd, fd, __ATOMIC_RELEASE);
+  Pthread_create(&tid, NULL, drainer, NULL);
+}
+
+/* log_flush - Write out everything logged so far, before exiting */
+void log_flush() {
+  if (__atomic_load_n(&log_fd, __ATOMIC_ACQUIRE) < 0) {
+    fflush(stdout);
+    return;
+  }
+  drain();
+}
+
+/* log_dropped - Lines dropped so far because a ring was full */
+long log_dropped() {
+  long n;
+  log_ring *r;
+
+  if (__atomic_load_n(&log_fd, __ATOMIC_ACQUIRE) < 0) {
+    return 0;
+  }
+  P(&mutex);
+  n = retired_dropped;
+  for (r = rings; r != NULL; r = r -> next) {
+    n += __atomic_load_n(&r -> dropped, __ATOMIC_RELAXED);
+  }
+  V(&mutex);
+  return n;
+}
@@ -0,0 +1,42 @@
+/*
+ * log.h - asynchronous logger of the proxy
+ */
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include "csapp.h"
+
+/* Levels */
+#define LOG_DEBUG 0 /* every request's cache and connection details */
+#define LOG_INFO 1 /* one line per request, startup */
+#define LOG_WARN 2 /* the server or a client misbehaved */
+#define LOG_ERROR 3 /* the proxy itself failed */
+
+/* Lines below this level are compiled out, arguments and all */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_INFO
+#endif
+
+#define LOG_RING_SIZE (16 * 1024) /* Bytes per thread, must be a power of 2 */
+#define LOG_LINE_MAX 512 /* Longer lines are cut */
+#define LOG_DRAIN_USECS 20000 /* Drainer sleep between two passes */
+
+#define log_enabled(level) ((level) >= LOG_LEVEL)
+#define log_msg(level, ...) \
+  do { \
+    if (log_enabled(level)) { \
+      log_write(level, __VA_ARGS__); \
+    } \
+  } while (0)
+#define log_debug(...) log_msg(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...) log_msg(LOG_INFO, __VA_ARGS__)
+#define log_warn(...) log_msg(LOG_WARN, __VA_ARGS__)
+#define log_error(...) log_msg(LOG_ERROR, __VA_ARGS__)
+
+void log_init(int fd);
+void log_write(int level, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+void log_flush();
+long log_dropped();
+
+#endif /* __LOG_H__ */
@@ -0,0 +1,357 @@
+/*
+ * proxy-bench.c - load generator for the proxy, with its own origin
+ *
+ * Starts a local origin server on an ephemeral port, then runs a number of
+ * client threads fetching objects from the origin through the proxy as
+ * fast as they can for a fixed time. After a warm-up period, reports
+ * requests and bytes per second, the hit ratio and latency percentiles.
+ *
+ * Object i of the origin has a fixed size, drawn log-uniformly between the
+ * -b and -B bytes, so every run sees the same objects. Clients pick objects
+ * uniformly, or by Zipf popularity with -z. Each request opens a fresh
+ * connection to the proxy, unless -k keeps one connection per client.
+ *
+ * The origin counts the requests that reach it, so the hit ratio is the
+ * share of measured requests the proxy answered without it. Latencies are
+ * kept whole and sorted, so the percentiles are exact.
+ *
+ * usage: ./proxy-bench -p <proxy port> [-c clients] [-d seconds]
+ *                      [-w warmup seconds] [-n uris] [-b bytes]
+ *                      [-B max bytes] [-z alpha] [-k]
+ */
+#include <stdio.h>
+#include <getopt.h>
+#include <sys/uio.h>
+#include "csapp.h"
+
+static char *proxy_port;
+static char origin_port[16];
+static int nuris = 100;
+static int minsize = 1024;
+static int maxsize; /* minsize unless -B */
+static double alpha; /* 0 for uniform popularity */
+static int keep_alive;
+static double *cdf; /* Zipf popularity, cumulative over uris */
+static char *body; /* maxsize bytes every response body is cut from */
+static long origin_requests;
+static volatile int measuring;
+static volatile int stop;
+
+/* Per client state, padded so counters don't share a cache block */
+typedef struct {
+  pthread_t tid;
+  unsigned int seed;
+  int fd; /* kept connection to the proxy, -1 if none */
+  rio_t rio;
+  long done;
+  long errors;
+  long bytes;
+  long *lat; /* usecs of each measured request */
+  long lat_max;
+  char pad[64];
+} client_t;
+
+/* obj_size - The size of object i, the same in the origin and clients */
+static int obj_size(int i) {
+  unsigned int h = (i + 1) * 2654435761u;
+  double u = (h >> 8) / (double)(1 << 24);
+  return minsize * pow((double)maxsize / minsize, u);
+}
+
+/* now_usecs - Microseconds on a clock that never steps back */
+static long now_usecs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/*
+ * origin_conn - Answer requests for /obj/<i> with obj_size(i) bytes until
+ *   the proxy closes the connection
+ */
+static void *origin_conn(void *vargp) {
+  int connfd = *((int *)vargp);
+  char buf[MAXLINE], hdr[MAXLINE];
+  struct iovec iov[2];
+  rio_t rio;
+  int len, obj, size;
+
+  Pthread_detach(pthread_self());
+  Free(vargp);
+  rio_readinitb(&rio, connfd);
+  while (rio_readlineb(&rio, buf, MAXLINE) > 0) {
+    if (sscanf(buf, "GET /obj/%d", &obj) != 1 || obj < 0) {
+      obj = 0;
+    }
+    while ((len = rio_readlineb(&rio, buf, MAXLINE)) > 0) {
+      if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n")) {
+        break;
+      }
+    }
+    if (len <= 0) {
+      break;
+    }
+    __atomic_add_fetch(&origin_requests, 1, __ATOMIC_RELAXED);
+    size = obj_size(obj);
+    len = sprintf(hdr, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                  "Content-Length: %d\r\n\r\n", size);
+    // one write, so Nagle never holds the body back behind the header
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = len;
+    iov[1].iov_base = body;
+    iov[1].iov_len = size;
+    if (writev(connfd, iov, 2) != len + size) {
+      break;
+    }
+  }
+  close(connfd);
+  return NULL;
+}
+
+/* origin - Thread per connection origin server on listenfd */
+static void *origin(void *vargp) {
+  int listenfd = *((int *)vargp);
+  int *connfdp;
+  pthread_t tid;
+
+  while (1) {
+    connfdp = Malloc(sizeof(int));
+    *connfdp = Accept(listenfd, NULL, NULL);
+    Pthread_create(&tid, NULL, origin_conn, connfdp);
+  }
+  return NULL;
+}
+
+/* start_origin - Listen on an ephemeral port and serve it in the background */
+static void start_origin(void) {
+  static int listenfd;
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  pthread_t tid;
+
+  listenfd = Open_listenfd("0");
+  if (getsockname(listenfd, (SA *)&addr, &len) < 0) {
+    unix_error("getsockname error");
+  }
+  Getnameinfo((SA *)&addr, len, NULL, 0, origin_port, sizeof(origin_port),
+              NI_NUMERICSERV);
+  Pthread_create(&tid, NULL, origin, &listenfd);
+}
+
+/* pick - Draw the next object a client asks for */
+static int pick(client_t *me) {
+  double u;
+  int lo, hi, mid;
+
+  if (cdf == NULL) {
+    return rand_r(&me -> seed) % nuris;
+  }
+  u = rand_r(&me -> seed) / (double)RAND_MAX * cdf[nuris - 1];
+  for (lo = 0, hi = nuris - 1; lo < hi; ) {
+    mid = (lo + hi) / 2;
+    if (cdf[mid] < u) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* drop_conn - Close a client's kept connection, if any */
+static void drop_conn(client_t *me) {
+  if (me -> fd >= 0) {
+    close(me -> fd);
+    me -> fd = -1;
+  }
+}
+
+/*
+ * fetch - Fetch one object through the proxy, on the client's kept
+ *   connection with -k. Return the bytes of body read, or -1 on error.
+ */
+static long fetch(client_t *me, int obj) {
+  char buf[MAXBUF];
+  long total = 0, length = -1;
+  int len, want;
+
+  if (me -> fd < 0) {
+    if ((me -> fd = open_clientfd("localhost", proxy_port)) < 0) {
+      return -1;
+    }
+    rio_readinitb(&me -> rio, me -> fd);
+  }
+  len = sprintf(buf, "GET http://localhost:%s/obj/%d HTTP/1.%d\r\n"
+                "Host: localhost:%s\r\n\r\n", origin_port, obj, keep_alive,
+                origin_port);
+  if (rio_writen(me -> fd, buf, len) != len) {
+    drop_conn(me);
+    return -1;
+  }
+  while ((len = rio_readlineb(&me -> rio, buf, MAXLINE)) > 0) {
+    if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n")) {
+      break;
+    }
+    if (!strncasecmp(buf, "Content-Length:", 15)) {
+      length = atol(buf + 15);
+    }
+  }
+  if (len <= 0) {
+    drop_conn(me);
+    return -1;
+  }
+  // read the body by its length, or to EOF when there is none
+  while (length < 0 || total < length) {
+    want = (length < 0 || length - total > MAXBUF) ? MAXBUF : length - total;
+    if ((len = rio_readnb(&me -> rio, buf, want)) <= 0) {
+      break;
+    }
+    total += len;
+  }
+  if (!keep_alive || length < 0 || total < length) {
+    drop_conn(me);
+  }
+  return (len < 0 || total < obj_size(obj)) ? -1 : total;
+}
+
+/* client - Fetch objects until told to stop, counting once measuring */
+static void *client(void *vargp) {
+  client_t *me = (client_t *)vargp;
+  long start, n;
+  int counted, obj;
+
+  while (!stop) {
+    counted = measuring;
+    obj = pick(me);
+    start = now_usecs();
+    n = fetch(me, obj);
+    if (!counted) {
+      continue;
+    }
+    if (n < 0) {
+      me -> errors++;
+      continue;
+    }
+    if (me -> done == me -> lat_max) {
+      me -> lat_max = me -> lat_max ? 2 * me -> lat_max : 4096;
+      me -> lat = Realloc(me -> lat, me -> lat_max * sizeof(long));
+    }
+    me -> lat[me -> done++] = now_usecs() - start;
+    me -> bytes += n;
+  }
+  drop_conn(me);
+  return NULL;
+}
+
+static int cmp_long(const void *a, const void *b) {
+  long x = *(const long *)a, y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+/* percentile - The q quantile of n sorted latencies */
+static long percentile(long *lat, long n, double q) {
+  long i = (long)(q * n);
+  return lat[i < n ? i : n - 1];
+}
+
+static void usage(char *prog) {
+  fprintf(stderr, "usage: %s -p <proxy port> [-c clients] [-d seconds] "
+          "[-w warmup seconds] [-n uris] [-b bytes] [-B max bytes] "
+          "[-z alpha] [-k]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int nclients = 16;
+  int secs = 5;
+  int warmup = 0;
+  int c, i;
+  client_t *clients;
+  struct timeval start, end;
+  long done = 0, errors = 0, bytes = 0, origin_start, origin_done, *lat;
+  double elapsed, sum;
+
+  while ((c = getopt(argc, argv, "p:c:d:w:n:b:B:z:k")) != -1) {
+    switch (c) {
+    case 'p': proxy_port = optarg; break;
+    case 'c': nclients = atoi(optarg); break;
+    case 'd': secs = atoi(optarg); break;
+    case 'w': warmup = atoi(optarg); break;
+    case 'n': nuris = atoi(optarg); break;
+    case 'b': minsize = atoi(optarg); break;
+    case 'B': maxsize = atoi(optarg); break;
+    case 'z': alpha = atof(optarg); break;
+    case 'k': keep_alive = 1; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (maxsize == 0) {
+    maxsize = minsize;
+  }
+  if (proxy_port == NULL || nclients < 1 || secs < 1 || warmup < 0 ||
+      nuris < 1 || minsize < 1 || maxsize < minsize || alpha < 0) {
+    usage(argv[0]);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  body = Malloc(maxsize);
+  memset(body, 'x', maxsize);
+  if (alpha > 0) {
+    cdf = Malloc(nuris * sizeof(double));
+    for (i = 0, sum = 0; i < nuris; i++) {
+      sum += 1.0 / pow(i + 1, alpha);
+      cdf[i] = sum;
+    }
+  }
+  start_origin();
+
+  clients = Calloc(nclients, sizeof(client_t));
+  for (i = 0; i < nclients; i++) {
+    clients[i].seed = i + 1;
+    clients[i].fd = -1;
+    Pthread_create(&clients[i].tid, NULL, client, &clients[i]);
+  }
+  if (warmup > 0) {
+    Sleep(warmup);
+  }
+  origin_start = __atomic_load_n(&origin_requests, __ATOMIC_RELAXED);
+  gettimeofday(&start, NULL);
+  measuring = 1;
+  Sleep(secs);
+  stop = 1;
+  gettimeofday(&end, NULL);
+  origin_done = __atomic_load_n(&origin_requests, __ATOMIC_RELAXED) -
+                origin_start;
+  for (i = 0; i < nclients; i++) {
+    Pthread_join(clients[i].tid, NULL);
+    done += clients[i].done;
+    errors += clients[i].errors;
+    bytes += clients[i].bytes;
+  }
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+
+  lat = Malloc((done ? done : 1) * sizeof(long));
+  for (i = 0, done = 0; i < nclients; i++) {
+    memcpy(lat + done, clients[i].lat, clients[i].done * sizeof(long));
+    done += clients[i].done;
+    free(clients[i].lat);
+  }
+  qsort(lat, done, sizeof(long), cmp_long);
+
+  printf("%d clients%s, %d uris of %d-%d bytes, %s popularity, %.1f s\n",
+         nclients, keep_alive ? " keep-alive" : "", nuris, minsize, maxsize,
+         alpha > 0 ? "zipf" : "uniform", elapsed);
+  printf("requests/sec %.0f, MB/sec %.2f, errors %ld\n", done / elapsed,
+         bytes / elapsed / (1024 * 1024), errors);
+  printf("hit ratio %.4f\n",
+         done > 0 && origin_done <= done ? 1.0 - (double)origin_done / done : 0.0);
+  if (done > 0) {
+    printf("latency usecs p50 %ld, p99 %ld, p999 %ld, max %ld\n",
+           percentile(lat, done, 0.5), percentile(lat, done, 0.99),
+           percentile(lat, done, 0.999), lat[done - 1]);
+  }
+  Free(lat);
+  Free(clients);
+  Free(body);
+  free(cdf);
+  return 0;
+}
@@ -21,30 +21,121 @@
  *  7. Able to survive when malformed uri coming into through telnet
  */
 #include <stdio.h>
+#include <limits.h>
 #include "csapp.h"
 #include <pthread.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
 #include "cache.h"
+#include "proxy.h"
+#include "sbuf.h"
+#include "http.h"
+#include "upstream.h"
+#include "splice.h"
+#include "dns.h"
+#include "flight.h"
+#include "disk.h"
+#include "stats.h"
+#include "log.h"
+#include "shm.h"
+#include "workers.h"
+#include "timer.h"
+#include "hash.h"
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+/* Default worker pool size and accept queue slots */
+#define NTHREADS 16
+#define SBUFSIZE 64
+
+/* Client connection reuse */
+#define PIPELINE_DEPTH 8 /* requests read ahead on one connection */
+#define PREFETCH_THREADS 4 /* fetching read ahead objects into the cache */
+#define PREFETCH_SLOTS 64 /* read ahead objects waiting for them */
+
+#define MAX_RELAY_SIZE (16 * 1024 * 1024) /* Largest -b relay block */
+#define MAX_STALE_SECS 86400 /* Longest -w stale-while-revalidate */
+#define UNCACHEABLE_SLOTS 4096 /* uris seen not to be cacheable, power of 2 */
+
+static sbuf_t sbuf; /* Shared buffer of connected descriptors */
+static sbuf_t prefetch_q; /* prefetch_t jobs for the prefetch pool */
+static char *snapshot; /* cache snapshot file, NULL if not kept */
+static int relay_size = MAXBUF; /* bytes relayed from the server at once */
+static long stale_secs; /* stale-while-revalidate for responses silent on it */
+static unsigned int uncacheable[UNCACHEABLE_SLOTS]; /* uri_hash, 0 if none */
 
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *conn_hdr = "Connection: close\r\n";
 static const char *proxy_conn_hdr = "Proxy-Connection: close\r\n";
+static const char *keep_alive_hdr = "Connection: keep-alive\r\n";
+
+/*
+ * Where do_server sends a response body: the client, if any, plus a copy
+ * for the cache while it fits. The copy goes straight into a published
+ * cache line when its size is known up front, and into content otherwise.
+ */
+typedef struct {
+  int fd; /* -1 when only filling the cache */
+  int chunked; /* client gets the body in chunked coding */
+  cache_line *fill; /* published line taking the body, if the length is known */
+  char *buf; /* relay block of relay_size bytes */
+  char *content; /* NULL unless the body is buffered for the cache */
+  int content_len;
+  int content_max;
+  int too_big; /* not cached, too big or not cacheable */
+  long skip; /* body bytes before the client's range, not sent to it */
+  long left; /* body bytes the client still gets, -1 for all of them */
+  int cut; /* stopped reading once the client had its range */
+  deadline_t *dl; /* told of each block that goes through */
+} relay_t;
+
+/* One request read off a client connection */
+typedef struct {
+  request_t req;
+  char *request2server; // request line and headers for the server
+  char *errnum, *shortmsg, *longmsg; // set if the request is bad
+  int bad;
+} pending_t;
+
+/* A read ahead request's object to fetch into the cache, see prefetch */
+typedef struct {
+  request_t req;
+  char *request2server;
+} prefetch_t;
+
+/* A stale line being revalidated in the background, see serve_stale */
+typedef struct {
+  request_t req;
+  char *request2server;
+  cache_line *stale; // pinned, claimed with cache_claim_refresh
+} refresh_t;
 
 void doit(int fd);
+int await_request(int fd, rio_t *rp, deadline_t *dl);
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
 										char *longmsg);
-void process_requesthdrs(rio_t *rp, char *hdr2server, char *server_hostname);
-int parse_uri(char *uri, char *abs_path, char *server_hostname,
-								char *server_port);
 void *thread(void *vargp);
-void do_server(int fd, int connfd2server, char *request2server, char *uri);
-void sigint_handler(int sig);
-int host_verify(const char *host, char *port);
+void *worker(void *vargp);
+pending_t *read_request(rio_t *rp);
+void free_pending(pending_t *p);
+int serve_request(int fd, pending_t *p);
+int send_cached(int fd, cache_line *cached, request_t *req);
+int send_disk(int fd, disk_ref *ref, request_t *req);
+void demote_line(cache_line *c_line);
+int writev_all(int fd, struct iovec *iov, int iovcnt);
+void queue_prefetch(pending_t *p);
+void *prefetcher(void *vargp);
+void prefetch(prefetch_t *job);
+static int uri_uncacheable(char *uri);
+int serve_stale(cache_line *stale, pending_t *p);
+void *refresh(void *vargp);
+int fetch(int fd, request_t *req, char *request2server, cache_line *stale);
+char *conditional_request(char *request2server, cache_line *stale);
+int do_server(int fd, request_t *req, char *request2server,
+              cache_line *stale, flight_t **flight);
+void *sigint_thread(void *vargp);
+long parse_size(char *s, long max);
+long parse_count(char *s, long max);
 
 /* main - The main routine of web proxy */
 int main(int argc, char **argv) {
@@ -56,24 +147,166 @@ int main(int argc, char **argv) {
   /* Enough space for any address */ //line:netp:echoserveri:sockaddrstorage
   struct sockaddr_storage clientaddr;
   char client_hostname[MAXLINE], client_port[MAXLINE];
+  int nloops = 0; /* event loop threads, 0 for thread per connection */
+  int nthreads = NTHREADS; /* pool workers, 0 for thread per connection */
+  int nslots = SBUFSIZE;
+  char *disk_dir = NULL; /* second cache tier, off unless given */
+  char worker_dir[MAXLINE];
+  long cache_size = MAX_CACHE_SIZE;
+  long max_object = MAX_OBJECT_SIZE;
+  int nprocs = 0; /* worker processes sharing the port, 0 for just this one */
+  long shm_size = SHM_SIZE; /* cache shared by the worker processes */
+  long idle_secs = IDLE_SECS, header_secs = HEADER_SECS;
+  long transfer_secs = TRANSFER_SECS;
+  int c, i, connfd, proc = 0; /* this worker process, with -p */
+  sigset_t sigint_mask;
   signal(SIGPIPE, SIG_IGN); // don't want to terminate the process due to sig
-	signal(SIGINT, sigint_handler);
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
+  while ((c = getopt(argc, argv, "e:t:q:d:s:c:o:b:w:p:m:i:H:T:")) != -1) {
+    switch (c) {
+    case 'e':
+      nloops = atoi(optarg);
+      break;
+    case 't':
+      nthreads = atoi(optarg);
+      break;
+    case 'q':
+      nslots = atoi(optarg);
+      break;
+    case 'd':
+      disk_dir = optarg;
+      break;
+    case 's':
+      snapshot = optarg;
+      break;
+    case 'c':
+      cache_size = parse_size(optarg, LONG_MAX);
+      break;
+    case 'o':
+      max_object = parse_size(optarg, INT_MAX);
+      break;
+    case 'b':
+      relay_size = parse_size(optarg, MAX_RELAY_SIZE);
+      break;
+    case 'w':
+      stale_secs = parse_count(optarg, MAX_STALE_SECS);
+      break;
+    case 'p':
+      nprocs = parse_count(optarg, WORKERS_MAX);
+      break;
+    case 'm':
+      shm_size = parse_size(optarg, INT_MAX);
+      break;
+    case 'i':
+      idle_secs = parse_count(optarg, DEADLINE_MAX_SECS);
+      break;
+    case 'H':
+      header_secs = parse_count(optarg, DEADLINE_MAX_SECS);
+      break;
+    case 'T':
+      transfer_secs = parse_count(optarg, DEADLINE_MAX_SECS);
+      break;
+    default:
+      nloops = -1;
+    }
+  }
+  if (argc - optind != 1 || nloops < 0 || nthreads < 0 || nslots < 1 ||
+      max_object < MAXLINE ||
+      cache_size < max_object + MAXLINE ||
+      relay_size < 1 || stale_secs < 0 ||
+      nprocs < 0 ||
+      (nprocs > 0 && shm_size / SHM_SEGMENTS < max_object + MAXLINE) ||
+      idle_secs < 0 || header_secs < 0 || transfer_secs < 0) {
+    fprintf(stderr, "usage: %s [-e nloops] [-t nthreads] [-q slots] [-d dir] "
+            "[-s snapshot] [-c cache_bytes] [-o object_bytes] "
+            "[-b relay_bytes] [-w stale_secs] [-p nprocs] [-m shared_bytes] "
+            "[-i idle_secs] [-H header_secs] [-T transfer_secs] <port>\n",
+            argv[0]);
     exit(0);
   }
-  cache_init();
-  listenfd = Open_listenfd(argv[1]);
+  if (nprocs > 0) {
+    // mapped before the fork so the workers share it, no threads yet
+    if (shm_init(shm_size)) {
+      log_flush();
+      exit(1);
+    }
+    stats_share(nprocs);
+    proc = workers_spawn(nprocs);
+    if (disk_dir != NULL) { // a log of its own for each worker
+      mkdir(disk_dir, 0755);
+      snprintf(worker_dir, MAXLINE, "%s/worker-%d", disk_dir, proc);
+      disk_dir = worker_dir;
+    }
+  }
+  // blocked before any thread starts, so only sigint_thread ever takes it
+  Sigemptyset(&sigint_mask);
+  Sigaddset(&sigint_mask, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &sigint_mask, NULL);
+  log_init(STDOUT_FILENO);
+  cache_set_limits(cache_size, max_object);
+  cache_init_mode(CACHE_MODE_CLOCK, CACHE_SHARDS);
+  upstream_init();
+  dns_init();
+  flight_init();
+  stats_init();
+  if (nprocs > 0) {
+    stats_publish(proc);
+  }
+  deadline_set_limits(idle_secs, header_secs, transfer_secs);
+  timer_init();
+  if (disk_dir != NULL &&
+      !disk_init(disk_dir, DISK_SEGMENTS, DISK_SEGMENT_SIZE)) {
+    cache_set_demote(demote_line);
+  }
+  if (snapshot != NULL && (i = cache_load(snapshot)) >= 0) {
+    log_info("Loaded %d cache lines from %s", i, snapshot);
+  }
+  if (proc > 0) {
+    snapshot = NULL; // saved by the first worker alone
+  }
+  Pthread_create(&tid, NULL, sigint_thread, &sigint_mask);
+  if (nprocs == 0) {
+    listenfd = Open_listenfd(argv[optind]);
+  } else if ((listenfd = reuseport_listenfd(argv[optind])) < 0) {
+    log_error("Worker %d cannot listen on port %s", proc, argv[optind]);
+    log_flush();
+    exit(1);
+  }
+  if (nloops > 0) {
+    event_serve(listenfd, nloops); // never returns
+  }
+  sbuf_init(&prefetch_q, PREFETCH_SLOTS);
+  for (i = 0; i < PREFETCH_THREADS; i++) {
+    Pthread_create(&tid, NULL, prefetcher, NULL);
+  }
+  if (nthreads > 0) {
+    // prespawned pool, accept blocks once all slots are taken
+    sbuf_init(&sbuf, nslots);
+    for (i = 0; i < nthreads; i++) {
+      Pthread_create(&tid, NULL, worker, NULL);
+    }
+    while (1) {
+      clientlen = sizeof(struct sockaddr_storage);
+      connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+      if (log_enabled(LOG_DEBUG)) { // the name lookup isn't free either
+        Getnameinfo((SA *) &clientaddr, clientlen, client_hostname, MAXLINE,
+                    client_port, MAXLINE, 0);
+        log_debug("Connected to (%s, %s)", client_hostname, client_port);
+      }
+      sbuf_insert(&sbuf, connfd);
+    }
+  }
   while (1) {
     clientlen = sizeof(struct sockaddr_storage);
     if ((connfdp = malloc(sizeof(int))) == NULL) {
-      printf("Malloc error!\n");
+      log_error("Malloc error!");
       return 0;
     }
     *connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-    Getnameinfo((SA *) &clientaddr, clientlen, client_hostname, MAXLINE,
-										client_port, MAXLINE, 0);
-    printf("Connected to (%s, %s)\n", client_hostname, client_port);
+    if (log_enabled(LOG_DEBUG)) {
+      Getnameinfo((SA *) &clientaddr, clientlen, client_hostname, MAXLINE,
+                  client_port, MAXLINE, 0);
+      log_debug("Connected to (%s, %s)", client_hostname, client_port);
+    }
     Pthread_create(&tid, NULL, thread, connfdp);
   }
   exit(0);
@@ -86,129 +319,1061 @@ void *thread(void *vargp) {
   free(vargp);
   doit(connfd);
   if (close(connfd) < 0) {
-    printf("Close error!");
+    log_warn("Close error: %s", strerror(errno));
   }
   return NULL;
 }
 
-/* doit - Similar to the function in Tiny. Parse URIs and connect to server*/
+/* Worker routine of the prespawned pool */
+void *worker(void *vargp) {
+  int connfd;
+  Pthread_detach(pthread_self());
+  while (1) {
+    connfd = sbuf_remove(&sbuf);
+    doit(connfd);
+    if (close(connfd) < 0) {
+      log_warn("Close error: %s", strerror(errno));
+    }
+  }
+  return NULL;
+}
+
+/*
+ * doit - Serve the requests of one client connection. A persistent
+ *   connection is served until the client closes it, asks to close it or
+ *   misses a deadline: the header limit for each request's header, the
+ *   idle limit between requests and the transfer limit for each
+ *   response. Requests the client has pipelined whole behind the current
+ *   one are read ahead, never waiting on the socket, and their objects
+ *   prefetched into the cache by the prefetch pool, while the responses
+ *   still go back in request order. A response goes out in several
+ *   writes, so Nagle is turned off: on a kept connection it would hold
+ *   the body behind the header until the client's delayed ACK.
+ */
 void doit(int fd) {
-  char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
   rio_t rio;
+  pending_t *queue[PIPELINE_DEPTH];
+  int head = 0, count = 0;
+  pending_t *p;
+  int keep = 1;
+  deadline_t dl;
+  int one = 1;
 
-  char request2server[MAXLINE];
-  char abs_path[MAXLINE];
-  char server_hostname[MAXLINE];
-  char server_port[MAXLINE];
-  char hdr2server[MAXLINE];
-  int connfd2server;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  Rio_readinitb(&rio, fd);
+  deadline_init(&dl);
+  deadline_arm(&dl, DEADLINE_HEADER, fd, -1); // counting from the accept
+  while (keep) {
+    if (count == 0) {
+      if ((p = read_request(&rio)) == NULL) {
+        break;
+      }
+      queue[head] = p;
+      count = 1;
+    }
+    // read ahead what the client has already pipelined behind it
+    while (count < PIPELINE_DEPTH && http_head_buffered(&rio) &&
+           queue[(head + count - 1) % PIPELINE_DEPTH] -> req.keep_alive) {
+      if ((p = read_request(&rio)) == NULL) {
+        break;
+      }
+      queue[(head + count) % PIPELINE_DEPTH] = p;
+      count++;
+      queue_prefetch(p);
+    }
+
+    p = queue[head];
+    head = (head + 1) % PIPELINE_DEPTH;
+    count--;
+    deadline_arm(&dl, DEADLINE_TRANSFER, fd, -1);
+    stats_begin();
+    keep = serve_request(fd, p) && p -> req.keep_alive;
+    stats_end();
+    free_pending(p);
+    if (keep && count == 0) {
+      keep = await_request(fd, &rio, &dl);
+    } else if (keep) { // the next one was read ahead
+      deadline_arm(&dl, DEADLINE_HEADER, fd, -1);
+    }
+  }
+  deadline_disarm(&dl); // before the caller closes fd
+  while (count > 0) { // connection is over, drop what was read ahead
+    p = queue[head];
+    head = (head + 1) % PIPELINE_DEPTH;
+    count--;
+    free_pending(p);
+  }
+}
 
-  char cached_content[MAX_OBJECT_SIZE];
-  int cached_content_len;
+/*
+ * await_request - Wait for the client's next request to start, within the
+ *   idle limit, then give it the header limit to come in whole.
+ *   Return 0 if the client closed or stayed idle instead.
+ */
+int await_request(int fd, rio_t *rp, deadline_t *dl) {
+  char c;
+  ssize_t n;
+
+  if (rp -> rio_cnt == 0) { // nothing buffered, wait on the socket
+    deadline_arm(dl, DEADLINE_IDLE, fd, -1);
+    while ((n = recv(fd, &c, 1, MSG_PEEK)) < 0 && errno == EINTR) {
+    }
+    if (n <= 0) {
+      return 0;
+    }
+  }
+  deadline_arm(dl, DEADLINE_HEADER, fd, -1);
+  return 1;
+}
+
+/*
+ * read_request - Read one request line and its headers from the client,
+ *   and build the request for the server from them.
+ *   Return NULL once the client has closed or gone idle; a request that
+ *   can't be served comes back marked bad.
+ */
+pending_t *read_request(rio_t *rp) {
+  http_request head;
+  pending_t *p;
+  char *eol;
+  int rc, len;
+
+  http_request_init(&head, NULL, 0);
+  if ((rc = http_read_request(rp, &head)) == 0) {
+    http_request_free(&head);
+    return NULL;
+  }
+  eol = memchr(head.buf, '\n', head.len);
+  log_info("%.*s", (int)(eol != NULL ? eol - head.buf : head.len),
+           head.buf); // display line
+
+  p = (pending_t *)Malloc(sizeof(pending_t));
+  p -> bad = 0;
+  p -> request2server = NULL;
+  if (rc < 0) {
+    p -> req.method[0] = '\0';
+    p -> errnum = "400";
+    p -> shortmsg = "Bad Request";
+    p -> longmsg = "Malformed or oversized request header";
+    p -> bad = 1;
+  } else if (parse_request(&head, &p -> req, &p -> errnum, &p -> shortmsg,
+                           &p -> longmsg)) {
+    p -> bad = 1;
+  }
+  if (p -> bad) {
+    p -> req.keep_alive = 0;
+    http_request_free(&head);
+    return p;
+  }
+
+  // HTTP/1.1 so the server connection can be reused
+  p -> request2server = build_request(&head, &p -> req, 1, &len);
+  http_request_free(&head);
+  return p;
+}
+
+/* free_pending - Free a request and what was built for it */
+void free_pending(pending_t *p) {
+  free(p -> request2server);
+  Free(p);
+}
+
+/*
+ * serve_request - Answer one request from the cache or the server.
+ *   Return 1 if the response was framed so the connection can carry on.
+ */
+int serve_request(int fd, pending_t *p) {
+  cache_line *cached;
+  disk_ref ref;
 	int hostveri_rc;
 	char hostveri_err_msg[MAXLINE];
+  char page[MAXBUF];
+  int keep, len;
 
-  /* Read request line*/
-  Rio_readinitb(&rio, fd);
-  if (!Rio_readlineb(&rio, buf, MAXLINE)) { //line:netp:doit:readrequest
-    return;
+  if (p -> bad) {
+    clienterror(fd, p -> req.method, p -> errnum, p -> shortmsg, p -> longmsg);
+    return 0;
   }
+  if (p -> req.stats) {
+    len = build_stats(page, MAXBUF, p -> req.keep_alive);
+    stats_first_byte();
+    return rio_writen(fd, page, len) == len && p -> req.keep_alive;
+  }
+	if ((hostveri_rc = host_verify(p -> req.server_hostname,
+                                 p -> req.server_port)) != 0) {
+		strcpy(hostveri_err_msg, gai_strerror(hostveri_rc));
+		clienterror(fd, p -> req.method, "400", "Bad Request", hostveri_err_msg);
+    return 0;
+	}
 
-  printf("%s", buf); // display line and headers
+  if ((cached = cache_lookup_stale(p -> req.uri)) != NULL) { // in cache
+    if (cache_expired(cached) && !serve_stale(cached, p)) {
+      log_debug("Content in cache is stale!");
+      stats_add(STAT_MISSES, 1);
+      keep = fetch(fd, &p -> req, p -> request2server, cached);
+      cache_release(cached);
+      return keep;
+    }
+    log_debug("Content in cache!");
+    stats_add(STAT_HITS, 1);
+    keep = send_cached(fd, cached, &p -> req);
+    cache_release(cached);
+    return keep; // end
+  }
+  if ((cached = shared_lookup(p -> req.uri)) != NULL) { // another worker's
+    log_debug("Content in shared cache!");
+    stats_add(STAT_SHARED_HITS, 1);
+    keep = send_cached(fd, cached, &p -> req);
+    cache_release(cached);
+    return keep;
+  }
+  if (!disk_lookup(p -> req.uri, &ref)) { // demoted to disk
+    log_debug("Content on disk!");
+    stats_add(STAT_DISK_HITS, 1);
+    keep = send_disk(fd, &ref, &p -> req);
+    disk_release(&ref);
+    return keep;
+  }
+  stats_add(STAT_MISSES, 1);
+  return fetch(fd, &p -> req, p -> request2server, NULL);
+}
 
-  // TODO: deal with malformed GET request
+/*
+ * queue_prefetch - Have the prefetch pool fetch a read ahead request's
+ *   object into the cache while the requests ahead of it are answered.
+ *   Only a plain GET, without Authorization, of an object not known to be
+ *   uncacheable is worth it; when the pool is behind the request is just
+ *   served in its turn.
+ */
+void queue_prefetch(pending_t *p) {
+  prefetch_t *job;
 
-  sscanf(buf, "%s %s %s", method, uri, version); //line:netp:doit:parserequest
-  if (strcasecmp(method, "GET")) {
-    clienterror(fd, method, "501", "Not Implemented",
-      "Proxy does not implement this method");
+  if (p -> bad || p -> req.stats || p -> req.range || p -> req.auth ||
+      strcasecmp(p -> req.method, "GET") || uri_uncacheable(p -> req.uri)) {
     return;
   }
+  job = (prefetch_t *)Malloc(sizeof(prefetch_t));
+  job -> req = p -> req;
+  job -> request2server = Malloc(strlen(p -> request2server) + 1);
+  strcpy(job -> request2server, p -> request2server);
+  if (sbuf_try_insert(&prefetch_q, (intptr_t)job) < 0) {
+    free(job -> request2server);
+    Free(job);
+  }
+}
+
+/* prefetcher - Thread routine of the prefetch pool */
+void *prefetcher(void *vargp) {
+  prefetch_t *job;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    job = (prefetch_t *)sbuf_remove(&prefetch_q);
+    prefetch(job);
+    free(job -> request2server);
+    Free(job);
+  }
+  return NULL;
+}
+
+/*
+ * prefetch - Fetch a request's object into the cache unless some tier
+ *   has it already. Its client finds it there in its turn, or joins the
+ *   fetch still in flight.
+ */
+void prefetch(prefetch_t *job) {
+  cache_line *cached;
+  disk_ref ref;
+
+  if ((cached = cache_lookup_stale(job -> req.uri)) != NULL) {
+    if (cache_expired(cached) &&
+        !host_verify(job -> req.server_hostname, job -> req.server_port)) {
+      fetch(-1, &job -> req, job -> request2server, cached);
+    }
+    cache_release(cached);
+  } else if ((cached = shared_lookup(job -> req.uri)) != NULL) {
+    cache_release(cached);
+  } else if (!disk_lookup(job -> req.uri, &ref)) {
+    disk_release(&ref);
+  } else if (!host_verify(job -> req.server_hostname,
+                          job -> req.server_port)) {
+    fetch(-1, &job -> req, job -> request2server, NULL);
+  }
+}
+
+/*
+ * stale_grace - Seconds past its expiry a line may still be served while
+ *   it is revalidated: the server's stale-while-revalidate, else
+ *   stale_secs, none if the server wants it revalidated before any use.
+ */
+static long stale_grace(cache_line *c_line) {
+  response_t resp;
+
+  if (c_line -> hdr_len <= 0 ||
+      http_parse_response(c_line -> content, c_line -> hdr_len, &resp) <= 0 ||
+      resp.must_revalidate) {
+    return 0;
+  }
+  return resp.stale_while_revalidate >= 0 ? resp.stale_while_revalidate
+                                          : stale_secs;
+}
+
+/*
+ * serve_stale - Can a stale line still be served as a hit? Within its
+ *   grace it can, and a thread revalidates it in the background unless
+ *   one already does. Return 1 if so, 0 if the client must wait for the
+ *   server.
+ */
+int serve_stale(cache_line *stale, pending_t *p) {
+  refresh_t *r;
+  pthread_t tid;
+
+  if (time(NULL) >= stale -> expires + stale_grace(stale)) {
+    return 0;
+  }
+  if (cache_claim_refresh(stale)) {
+    log_debug("Content in cache is stale, refreshing it.");
+    r = (refresh_t *)Malloc(sizeof(refresh_t));
+    r -> req = p -> req;
+    r -> request2server = Malloc(strlen(p -> request2server) + 1);
+    strcpy(r -> request2server, p -> request2server);
+    cache_pin(stale);
+    r -> stale = stale;
+    Pthread_create(&tid, NULL, refresh, r);
+  }
+  return 1;
+}
+
+/* refresh - Thread routine revalidating a stale line served meanwhile */
+void *refresh(void *vargp) {
+  refresh_t *r = (refresh_t *)vargp;
+
+  Pthread_detach(pthread_self());
+  if (!host_verify(r -> req.server_hostname, r -> req.server_port)) {
+    fetch(-1, &r -> req, r -> request2server, r -> stale);
+  }
+  cache_end_refresh(r -> stale);
+  cache_release(r -> stale);
+  free(r -> request2server);
+  Free(r);
+  return NULL;
+}
+
+/*
+ * fetch - Get a missed object from the server, coalescing with a fetch of
+ *   the same uri already in flight. A follower is answered from the cache
+ *   once the leader has published the object, possibly while it is still
+ *   downloading, and only goes to the server itself if the object could
+ *   not be cached or the leader took longer than the header limit to
+ *   publish it. With fd -1 the object only goes into the cache. A pinned
+ *   stale line is revalidated with a conditional request if it has a
+ *   validator, else fetched anew.
+ *   Return 1 if the client connection can carry on.
+ */
+int fetch(int fd, request_t *req, char *request2server, cache_line *stale) {
+  flight_t *f;
+  cache_line *cached;
+  char *cond = NULL;
+  int keep;
+
+  if (stale != NULL &&
+      (cond = conditional_request(request2server, stale)) == NULL) {
+    stale = NULL; // nothing to revalidate it by
+  }
+  if ((f = flight_join(req -> uri, deadline_limit(DEADLINE_HEADER)))
+      != NULL) { // lead
+    keep = do_server(fd, req, stale != NULL ? cond : request2server, stale,
+                     &f);
+    if (f != NULL) {
+      flight_end(f);
+    }
+    free(cond);
+    return keep;
+  }
+  free(cond);
+  if (fd < 0) { // prefetch, the leader did what it could
+    return 0;
+  }
+  if ((cached = cache_lookup(req -> uri)) != NULL) {
+    log_debug("Content in cache!");
+    keep = send_cached(fd, cached, req);
+    cache_release(cached);
+    return keep;
+  }
+  return do_server(fd, req, request2server, NULL, NULL);
+}
+
+/*
+ * rangeable - Can a Range be answered from this response header, a 200
+ *   whose status line we know how to rewrite?
+ */
+static int rangeable(char *hdr, int hdr_len) {
+  return hdr_len > 12 && !strncmp(hdr, "HTTP/1.", 7) &&
+         !strncmp(hdr + 8, " 200", 4) && (hdr[12] == ' ' || hdr[12] == '\r');
+}
+
+/*
+ * range_hdr - Write into out, which holds hdr_len + MAXLINE bytes, the
+ *   header answering req's Range from the 200 header hdr for a body of
+ *   total bytes: 206 with a Content-Range, or 416 if none of the range is
+ *   in the body. A Content-Length and the blank line are left out for the
+ *   caller to frame. Set *first and *len to the part of the body to send.
+ *   Return the length written.
+ */
+static int range_hdr(char *out, char *hdr, int hdr_len, request_t *req,
+                     long total, long *first, long *len) {
+  char *line, *eol, *end = hdr + hdr_len;
+  long last = req -> range_last;
+  int n;
+
+  *first = req -> range_first;
+  if (http_range_resolve(first, &last, total) < 0) {
+    *first = *len = 0;
+    return sprintf(out, "%.8s 416 Range Not Satisfiable\r\n"
+                   "Content-Range: bytes */%ld\r\n", hdr, total);
+  }
+  *len = last - *first + 1;
+  n = sprintf(out, "%.8s 206 Partial Content\r\n", hdr);
+  for (line = memchr(hdr, '\n', hdr_len) + 1; line < end; line = eol) {
+    eol = memchr(line, '\n', end - line);
+    eol = eol != NULL ? eol + 1 : end;
+    if (*line == '\r' || http_hdr_value(line, "Content-Length") != NULL) {
+      continue; // reframed by the caller
+    }
+    memcpy(out + n, line, eol - line);
+    n += eol - line;
+  }
+  return n + sprintf(out + n, "Content-Range: bytes %ld-%ld/%ld\r\n",
+                     *first, last, total);
+}
+
+/*
+ * send_range - Answer req's Range from a cached 200 response of
+ *   content_len bytes, hdr_len of them header. The part of the body asked
+ *   for comes from the pinned line c_line, as it lands if the line is still
+ *   filling, or else from ref in the disk tier.
+ *   Return 1 if the connection can carry on.
+ */
+static int send_range(int fd, char *content, int hdr_len, int content_len,
+                      cache_line *c_line, disk_ref *ref, request_t *req) {
+  char *out = Malloc(hdr_len + MAXLINE);
+  long first, len, sent, filled, end;
+  int n;
+
+  n = range_hdr(out, content, hdr_len, req, content_len - hdr_len, &first,
+                &len);
+  n += sprintf(out + n, "Content-Length: %ld\r\n%s\r\n", len,
+               req -> keep_alive ? keep_alive_hdr : conn_hdr);
+  stats_first_byte();
+  stats_add(STAT_BYTES_SERVED, n + len);
+  if (rio_writen(fd, out, n) < 0) {
+    Free(out);
+    return 0;
+  }
+  Free(out);
+  first += hdr_len;
+  end = first + len;
+  if (ref != NULL) {
+    return disk_send(fd, ref, first, len) == 0 && req -> keep_alive;
+  }
+  for (sent = first; sent < end; sent = filled) {
+    if ((filled = cache_wait(c_line, sent)) < 0) {
+      return 0; // the server failed the filler, cut the client off too
+    }
+    filled = filled < end ? filled : end;
+    if (rio_writen(fd, content + sent, filled - sent) < 0) {
+      return 0;
+    }
+  }
+  return req -> keep_alive;
+}
+
+/*
+ * send_cached - Write a cached response to the client straight from the
+ *   pinned line, adding the Connection header for this client in front of
+ *   the blank line ending the cached header. A line still filling is sent
+ *   as its bytes land. A Range is answered with the part asked for.
+ *   Return 1 if the connection can carry on.
+ */
+int send_cached(int fd, cache_line *cached, request_t *req) {
+  struct iovec iov[3];
+  int keep_alive = req -> keep_alive;
+  char *conn = keep_alive ? (char *)keep_alive_hdr : (char *)conn_hdr;
+  int split = cached -> hdr_len - 2;
+  int sent, filled;
+
+  if (req -> range && rangeable(cached -> content, cached -> hdr_len)) {
+    return send_range(fd, cached -> content, cached -> hdr_len,
+                      cached -> content_len, cached, NULL, req);
+  }
+  stats_first_byte();
+  stats_add(STAT_BYTES_SERVED, cached -> content_len);
+  if (split < 0 || memcmp(cached -> content + split, "\r\n", 2)) {
+    // no header we know of, the connection has to end the response
+    rio_writen(fd, cached -> content, cached -> content_len);
+    return 0;
+  }
+  iov[0].iov_base = cached -> content;
+  iov[0].iov_len = split;
+  iov[1].iov_base = conn;
+  iov[1].iov_len = strlen(conn);
+  iov[2].iov_base = cached -> content + split;
+  if (cache_complete(cached)) {
+    iov[2].iov_len = cached -> content_len - split;
+    return writev_all(fd, iov, 3) == 0 && keep_alive;
+  }
+
+  // the header is in place from the start, the body follows the filler
+  iov[2].iov_len = 2;
+  if (writev_all(fd, iov, 3) < 0) {
+    return 0;
+  }
+  for (sent = cached -> hdr_len; sent < cached -> content_len; sent = filled) {
+    if ((filled = cache_wait(cached, sent)) < 0) {
+      return 0; // the server failed the filler, cut the client off too
+    }
+    if (rio_writen(fd, cached -> content + sent, filled - sent) < 0) {
+      return 0;
+    }
+  }
+  return keep_alive;
+}
+
+/*
+ * send_disk - Write a response found in the disk tier to the client. The
+ *   header is written from the segment's mapping with this client's
+ *   Connection header, the body goes out with sendfile. A Range is
+ *   answered with the part asked for.
+ *   Return 1 if the connection can carry on.
+ */
+int send_disk(int fd, disk_ref *ref, request_t *req) {
+  struct iovec iov[3];
+  int keep_alive = req -> keep_alive;
+  char *conn = keep_alive ? (char *)keep_alive_hdr : (char *)conn_hdr;
+  int split = ref -> hdr_len - 2;
+
+  if (req -> range && rangeable(ref -> content, ref -> hdr_len)) {
+    return send_range(fd, ref -> content, ref -> hdr_len, ref -> content_len,
+                      NULL, ref, req);
+  }
+  stats_first_byte();
+  stats_add(STAT_BYTES_SERVED, ref -> content_len);
+  if (split < 0 || memcmp(ref -> content + split, "\r\n", 2)) {
+    disk_send(fd, ref, 0, ref -> content_len);
+    return 0;
+  }
+  iov[0].iov_base = ref -> content;
+  iov[0].iov_len = split;
+  iov[1].iov_base = conn;
+  iov[1].iov_len = strlen(conn);
+  iov[2].iov_base = ref -> content + split;
+  iov[2].iov_len = 2;
+  if (writev_all(fd, iov, 3) < 0 ||
+      disk_send(fd, ref, ref -> hdr_len,
+                ref -> content_len - ref -> hdr_len) < 0) {
+    return 0;
+  }
+  return keep_alive;
+}
+
+/*
+ * shared_lookup - Find uri in the cache shared by the worker processes.
+ *   The object is copied out for this hit alone and not into this
+ *   worker's cache, so a hot object is kept once in the shared tier and
+ *   once by the worker that fetched it, not once more by every worker.
+ *   Return a line to serve like a hit and release, or NULL.
+ */
+cache_line *shared_lookup(char *uri) {
+  return shm_get(uri);
+}
+
+/* demote_line - Copy a line evicted from memory into the disk tier */
+void demote_line(cache_line *c_line) {
+  disk_put(c_line -> uri, c_line -> content, c_line -> content_len,
+           c_line -> hdr_len, c_line -> expires);
+}
+
+/*
+ * writev_all - Write every byte of an iovec array, like rio_writen.
+ *   Return 0 on success, -1 on error.
+ */
+int writev_all(int fd, struct iovec *iov, int iovcnt) {
+  ssize_t n;
+  while (iovcnt > 0) {
+    if ((n = writev(fd, iov, iovcnt)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    while (iovcnt > 0 && (size_t)n >= iov -> iov_len) {
+      n -= iov -> iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov -> iov_base = (char *)iov -> iov_base + n;
+      iov -> iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+/* copy_slice - Copy a slice into a MAXLINE buffer. Return 1 if too long. */
+static int copy_slice(char *dst, http_slice s) {
+  if (s.len >= MAXLINE) {
+    return 1;
+  }
+  memcpy(dst, s.p, s.len);
+  dst[s.len] = '\0';
+  return 0;
+}
+
+/*
+ * parse_request - Check the request line parsed into head, convert the
+ *   version for the server and split the uri into req. The request's
+ *   Accept-Encoding goes after the uri, so a response that varies by it
+ *   is cached once per encoding asked for.
+ *   Return 0 on success. On error return 1 and point errnum, shortmsg and
+ *   longmsg at the reply for the client.
+ */
+int parse_request(http_request *head, request_t *req, char **errnum,
+                  char **shortmsg, char **longmsg) {
+  char *line, *value;
+  int i, len, n;
+
+  req -> method[0] = req -> uri[0] = req -> version[0] = '\0';
+  req -> keep_alive = 0;
+  req -> range = 0;
+  req -> auth = 0;
+  if (copy_slice(req -> method, head -> method) ||
+      copy_slice(req -> uri, head -> uri) ||
+      copy_slice(req -> version, head -> version)) {
+    *errnum = "414";
+    *shortmsg = "Request-URI Too Long";
+    *longmsg = "The request line is too long";
+    return 1;
+  }
+  // HTTP/1.1 connections persist unless a header says otherwise
+  req -> http11 = !strcasecmp(req -> version, "HTTP/1.1");
+  req -> keep_alive = req -> http11;
+  if (strcasecmp(req -> method, "GET")) {
+    *errnum = "501";
+    *shortmsg = "Not Implemented";
+    *longmsg = "Proxy does not implement this method";
+    return 1;
+  }
 
   // convert http version to 1.0
-  if ((!strcasecmp(version, "HTTP/1.1")) || (strlen(version) == 0)) {
-    strcpy(version, "HTTP/1.0");
-  } else if (strcasecmp(version, "HTTP/1.0")) {
+  if ((!strcasecmp(req -> version, "HTTP/1.1")) ||
+      (strlen(req -> version) == 0)) {
+    strcpy(req -> version, "HTTP/1.0");
+  } else if (strcasecmp(req -> version, "HTTP/1.0")) {
     // neither consistent with HTTP/1.0 nor the Simple-Request (no version)
-    clienterror(fd, method, "400", "Bad Request",
-      "The HTTP version is neither HTTP/1.1 nor HTTP/1.0");
-    return;
+    *errnum = "400";
+    *shortmsg = "Bad Request";
+    *longmsg = "The HTTP version is neither HTTP/1.1 nor HTTP/1.0";
+    return 1;
   }
 
-  // TODO: Parse URI and resend the request
-  if (parse_uri(uri, abs_path, server_hostname, server_port)) {
+  // the proxy's own page, asked for with a path rather than a full uri
+  if ((req -> stats = !strcmp(req -> uri, STATS_URI))) {
+    strcpy(req -> abs_path, STATS_URI);
+    req -> server_hostname[0] = req -> server_port[0] = '\0';
+    return 0;
+  }
+  if (parse_uri(head -> uri, req -> abs_path, req -> server_hostname,
+                req -> server_port)) {
     // parse failed
-    clienterror(fd, method, "400", "Bad Request", "URI format error");
+    *errnum = "400";
+    *shortmsg = "Bad Request";
+    *longmsg = "URI format error";
+    return 1;
+  }
+  for (i = 0; i < head -> nhdrs; i++) {
+    line = head -> hdrs[i].p;
+    if (http_hdr_value(line, "Authorization") != NULL) {
+      req -> auth = 1;
+    } else if ((value = http_hdr_value(line, "Accept-Encoding")) != NULL) {
+      len = strlen(req -> uri);
+      n = strcspn(value, "\r\n");
+      if (len + 1 + n >= MAXLINE) {
+        *errnum = "414";
+        *shortmsg = "Request-URI Too Long";
+        *longmsg = "The request line is too long";
+        return 1;
+      }
+      req -> uri[len] = ' '; // can't be in the uri itself
+      memcpy(req -> uri + len + 1, value, n);
+      req -> uri[len + 1 + n] = '\0';
+    }
+  }
+  return 0;
+}
+
+/*
+ * relay - Pass a block of the response body on to the client, as much of
+ *   it as falls in the client's range, and keep a copy for the cache while
+ *   it still fits in an object.
+ */
+static void relay(relay_t *r, char *buf, int len) {
+  char chunk[32];
+  char *out = buf;
+  int n = len, k;
+
+  if (r -> skip > 0) {
+    k = r -> skip < n ? r -> skip : n;
+    out += k;
+    n -= k;
+    r -> skip -= k;
+  }
+  if (r -> left >= 0) {
+    n = r -> left < n ? r -> left : n;
+    r -> left -= n;
+  }
+  if (r -> fd >= 0 && n > 0 && r -> chunked) {
+    sprintf(chunk, "%x\r\n", n);
+    rio_writen(r -> fd, chunk, strlen(chunk));
+    rio_writen(r -> fd, out, n);
+    rio_writen(r -> fd, "\r\n", 2);
+  } else if (r -> fd >= 0 && n > 0) {
+    rio_writen(r -> fd, out, n); // just write with stuff
+  }
+  if (r -> fd >= 0) {
+    stats_add(STAT_BYTES_SERVED, n);
+  }
+  if (r -> fill != NULL) { // readers of the line get it from here
+    cache_fill(r -> fill, buf, len);
     return;
   }
-	if ((hostveri_rc = host_verify(server_hostname, server_port)) != 0) {
-		strcpy(hostveri_err_msg, gai_strerror(hostveri_rc));
-		clienterror(fd, method, "400", "Bad Request", hostveri_err_msg);
+  if (r -> too_big) {
     return;
-	}
+  }
+  if ((r -> content_len + len) <= r -> content_max) { // not so big
+    memcpy(r -> content + r -> content_len, buf, len);
+    r -> content_len = r -> content_len + len;
+  } else {
+    log_debug("Cannot add to cache. Target is so big!");
+    r -> too_big = 1;
+  }
+}
+
+/* touched - splice_relay progress routine, arg is the relay's deadline */
+static void touched(void *arg) {
+  deadline_touch((deadline_t *)arg);
+}
 
-  if (!get_cached_obj(uri, cached_content, &cached_content_len)) { // in cache
-    printf("Content in cache!\n");
-    rio_writen(fd, cached_content, cached_content_len);
-    return; // end
+/*
+ * relay_span - Relay len bytes of the body, or everything up to EOF if len
+ *   is -1. Once the object is too big to cache the bytes have nowhere to go
+ *   but the client, so after what rio has buffered the rest moves with
+ *   splice_relay and never enters user space. If the client only wants a
+ *   range, reading stops once it has it. Each block that goes through is
+ *   progress for the deadline.
+ *   Return 1 if it all arrived, 0 otherwise.
+ */
+static int relay_span(rio_t *rp, relay_t *r, long len) {
+  char *buf = r -> buf;
+  long left = len, want;
+  ssize_t n;
+
+  while (left != 0) {
+    if (r -> too_big && r -> left == 0) {
+      r -> cut = 1;
+      return 0;
+    }
+    if (r -> too_big && r -> fd >= 0 && r -> left < 0 &&
+        rp -> rio_cnt == 0) {
+      n = splice_relay(rp -> rio_fd, r -> fd, left, r -> chunked, touched,
+                       r -> dl);
+      if (n > 0) {
+        stats_add(STAT_BYTES_SERVED, n);
+      }
+      return left < 0 ? n >= 0 : n == left;
+    }
+    want = (left < 0 || left > relay_size) ? relay_size : left;
+    if (r -> too_big && r -> fd >= 0 && r -> left < 0 &&
+        want > rp -> rio_cnt) {
+      want = rp -> rio_cnt; // only drain the buffer, don't refill it
+    }
+    if ((n = rio_readnb(rp, buf, want)) <= 0) {
+      return left < 0 && n == 0;
+    }
+    relay(r, buf, n);
+    deadline_touch(r -> dl);
+    if (left > 0) {
+      left -= n;
+    }
+  }
+  return 1;
+}
+
+/*
+ * relay_body - Relay the response body, framed by chunked coding, by
+ *   Content-Length or by the server closing. Chunked bodies are decoded,
+ *   and re-encoded for the client by relay if it gets chunks too.
+ *   Return 1 if the whole body arrived, 0 otherwise.
+ */
+static int relay_body(rio_t *rp, response_t *resp, relay_t *r) {
+  char buf[MAXLINE];
+  long size;
+
+  if (!http_has_body(resp)) {
+    return 1;
+  }
+  if (resp -> chunked) {
+    while ((size = read_chunk_size(rp)) > 0) {
+      if (!relay_span(rp, r, size)) {
+        return 0;
+      }
+      if (rio_readlineb(rp, buf, MAXLINE) <= 0) { // CRLF ending the chunk
+        return 0;
+      }
+    }
+    return size == 0 && skip_chunk_trailer(rp) == 0;
+  }
+  if (resp -> content_length >= 0) {
+    return relay_span(rp, r, resp -> content_length);
+  }
+  return relay_span(rp, r, -1); // read until EOF
+}
+
+/*
+ * frame_response - Append to hdr the headers framing the body for this
+ *   client and end the header. A known length is passed on; otherwise an
+ *   HTTP/1.1 client that keeps its connection gets chunked coding, and
+ *   anyone else gets a body that ends when the connection closes.
+ *   Return 1 if the connection can carry on after the body.
+ */
+static int frame_response(char *hdr, response_t *resp, request_t *req,
+                          relay_t *r) {
+  int keep = req -> keep_alive;
+  r -> chunked = 0;
+  if (!http_has_body(resp)) {
+    ; // nothing to frame
+  } else if (resp -> content_length >= 0) {
+    sprintf(hdr + strlen(hdr), "Content-Length: %ld\r\n",
+            resp -> content_length);
+  } else if (keep && req -> http11) {
+    strcat(hdr, "Transfer-Encoding: chunked\r\n");
+    r -> chunked = 1;
+  } else {
+    keep = 0;
   }
+  strcat(hdr, keep ? keep_alive_hdr : conn_hdr);
+  strcat(hdr, "\r\n");
+  return keep;
+}
 
-  // Init request line
-  sprintf(request2server, "%s %s %s\r\n", method, abs_path, version);
-  // TODO: process hdr
-  process_requesthdrs(&rio, hdr2server, server_hostname);
-  // Concat the line and header
-  strcat(request2server, hdr2server);
+/*
+ * revalidated - The server answered 304 for a stale line: it stays fresh
+ *   for as long as its stored header and the 304 say together.
+ */
+static void revalidated(cache_line *stale, response_t *resp) {
+  response_t stored;
+  long now = time(NULL), expires;
 
-  // TODO: connect to server
-  if ((connfd2server = open_clientfd(server_hostname, server_port)) < 0) {
-    printf("Establish to server error!\n");
-		clienterror(fd, method, "500", "Internal error"
-			, "Establish to server error!\n");
+  if (http_parse_response(stale -> content, stale -> hdr_len, &stored) <= 0) {
     return;
   }
-  do_server(fd, connfd2server, request2server, uri);
+  http_refresh(&stored, resp);
+  expires = http_expires(&stored, now);
+  cache_refresh(stale, expires > 0 ? expires : now);
+  stats_add(STAT_REVALIDATED, 1);
+  log_debug("Revalidated, fresh for %ld seconds.",
+            expires > now ? expires - now : 0);
 }
 
-/* do_server - doit's replica targeting the real server */
-void do_server(int fd, int connfd2server, char *request2server, char *uri) {
+/*
+ * do_server - doit's replica targeting the real server. The request goes
+ *   out on a pooled connection when there is one; a pooled connection the
+ *   server has meanwhile closed is retried on another. The connection goes
+ *   back to the pool if the response was framed and read completely.
+ *   The server gets the header limit to accept a new connection and again
+ *   to send its header, then the transfer limit for the body, which is
+ *   also cut when it or the client stays idle too long. With fd -1 the
+ *   response only goes into the cache. If request2server revalidates the
+ *   pinned line stale, a 304 refreshes it and the client is answered from
+ *   it; any other response replaces it as usual.
+ *
+ *   A response whose length is known is published to the cache as soon as
+ *   its header is in, and the flight it leads, if any, lands right then so
+ *   its followers read the body from the cache as it downloads. Otherwise
+ *   the response is cached once complete and the caller ends the flight.
+ *   Return 1 if the client connection can carry on.
+ */
+int do_server(int fd, request_t *req, char *request2server,
+              cache_line *stale, flight_t **flight) {
   rio_t rio_server;
-  int request2serverlen;
-  char response_from_server[MAXLINE];
-  int response_len;
-  char cached_content[MAX_OBJECT_SIZE];
-  int cached_content_len = 0; /* empty at beginning */
-  int flag_so_big = 0;
-
-  rio_readinitb(&rio_server, connfd2server);
-  request2serverlen = strlen(request2server);
-
-  if (rio_writen(connfd2server, request2server, request2serverlen)
-        != request2serverlen) {
-    printf("rio_writen error!");
-    return;
+  int request2serverlen = strlen(request2server);
+  char hdr[MAXBUF + MAXLINE]; // server's header plus our framing
+  char client_hdr[MAXBUF + MAXLINE];
+  int hdr_len = -1;
+  response_t resp, ranged;
+  relay_t r;
+  deadline_t dl;
+  int connfd2server, reused, complete, keep, timed_out;
+  int body_len;
+  long expires;
+
+  deadline_init(&dl);
+  do {
+    if ((connfd2server = upstream_get(req -> server_hostname,
+                                      req -> server_port, &reused,
+                                      deadline_limit(DEADLINE_HEADER))) < 0) {
+      log_warn("Establish to server error!");
+      stats_add(STAT_ORIGIN_ERRORS, 1);
+      if (fd >= 0) {
+        clienterror(fd, req -> method, "500", "Internal error",
+                    "Establish to server error!\n");
+      }
+      return 0;
+    }
+    deadline_arm(&dl, DEADLINE_HEADER, connfd2server, -1);
+    rio_readinitb(&rio_server, connfd2server);
+    if (rio_writen(connfd2server, request2server, request2serverlen)
+          == request2serverlen) {
+      hdr_len = read_response_hdrs(&rio_server, hdr, MAXBUF, &resp);
+    }
+    if (hdr_len < 0) {
+      deadline_disarm(&dl);
+      close(connfd2server);
+    }
+  } while (hdr_len < 0 && reused);
+
+  if (hdr_len < 0) {
+    log_warn("Bad response from server!");
+    stats_add(STAT_ORIGIN_ERRORS, 1);
+    if (fd >= 0) {
+      clienterror(fd, req -> method, "502", "Bad Gateway",
+                  "Bad response from server");
+    }
+    return 0;
   }
 
-  while ((response_len = rio_readnb(&rio_server, response_from_server, MAXLINE))
-            > 0) { // read until EOF
-    rio_writen(fd, response_from_server, response_len); // just write with stuff
-    if ((cached_content_len + response_len) <= MAX_OBJECT_SIZE) { // not so big
-      memcpy(cached_content + cached_content_len, response_from_server,
-        response_len);
-      cached_content_len = cached_content_len + response_len;
-    } else {
-      printf("Cannot add to cache. Target is so big!\n");
-      flag_so_big = 1;
+  if (stale != NULL && resp.status == 304) { // the body we have is good
+    revalidated(stale, &resp);
+    if (flight != NULL && *flight != NULL) {
+      flight_end(*flight);
+      *flight = NULL;
     }
+    if (!deadline_disarm(&dl) && resp.keep_alive && rio_server.rio_cnt == 0) {
+      upstream_put(req -> server_hostname, req -> server_port, connfd2server);
+    } else if (close(connfd2server) < 0) {
+      log_warn("Close error: %s", strerror(errno));
+    }
+    return fd >= 0 ? send_cached(fd, stale, req) : 0;
   }
-  if (!flag_so_big) {
-    put_cached_content(uri, cached_content, cached_content_len);
+
+  r.fd = fd;
+  r.dl = &dl;
+  r.content = NULL;
+  r.content_len = 0; /* empty at beginning */
+  // leave room for the header and a Content-Length line in the object
+  r.content_max = cache_max_object() - hdr_len - MAXLINE / 32;
+  r.too_big = r.content_max < 0 || resp.content_length > r.content_max;
+  if (!http_storable(&resp, req -> auth) ||
+      (expires = http_expires(&resp, time(NULL))) == 0) {
+    log_debug("Response not cacheable.");
+    r.too_big = 1;
+    if (flight != NULL && *flight != NULL) { // followers fetch their own
+      flight_end(*flight);
+      *flight = NULL;
+    }
+  }
+  r.skip = 0;
+  r.left = -1;
+  r.cut = 0;
+  if (req -> range && resp.status == 200 && resp.content_length >= 0 &&
+      rangeable(hdr, hdr_len)) {
+    // the whole object goes to the cache, the client only gets its range
+    client_hdr[range_hdr(client_hdr, hdr, hdr_len, req,
+                         resp.content_length, &r.skip, &r.left)] = '\0';
+    ranged = resp;
+    ranged.content_length = r.left;
+    keep = frame_response(client_hdr, &ranged, req, &r);
+  } else {
+    strcpy(client_hdr, hdr);
+    keep = frame_response(client_hdr, &resp, req, &r);
   }
 
-  if (close(connfd2server) < 0) {
-    printf("Close error\n");
-    return;
+  r.fill = NULL;
+  if (!r.too_big && (resp.content_length >= 0 || !http_has_body(&resp))) {
+    // the cached header always carries the length and no Connection
+    body_len = http_has_body(&resp) ? resp.content_length : 0;
+    if (http_has_body(&resp)) {
+      hdr_len += sprintf(hdr + hdr_len, "Content-Length: %d\r\n", body_len);
+    }
+    hdr_len += sprintf(hdr + hdr_len, "\r\n");
+    if ((r.fill = cache_fill_begin(req -> uri, hdr, hdr_len, body_len,
+                                   expires)) == NULL) {
+      r.too_big = 1; // won't be cached after all
+    }
+    if (flight != NULL && *flight != NULL) {
+      flight_end(*flight);
+      *flight = NULL;
+    }
+  }
+  if (fd < 0 && r.too_big) { // nothing to keep, don't download it
+    if (resp.status == 200) {
+      note_uncacheable(req -> uri, 1);
+    }
+    deadline_disarm(&dl);
+    if (close(connfd2server) < 0) {
+      log_warn("Close error: %s", strerror(errno));
+    }
+    return 0;
+  }
+  if (r.fill == NULL && !r.too_big) { // buffered, cached once complete
+    r.content = Malloc(r.content_max);
+  }
+  deadline_arm(&dl, DEADLINE_TRANSFER | DEADLINE_QUIET, connfd2server, fd);
+  if (fd >= 0) {
+    stats_first_byte();
+    stats_add(STAT_BYTES_SERVED, strlen(client_hdr));
+    rio_writen(fd, client_hdr, strlen(client_hdr));
+  }
+  r.buf = Malloc(relay_size);
+  complete = relay_body(&rio_server, &resp, &r);
+  timed_out = deadline_disarm(&dl);
+  Free(r.buf);
+  if (!complete && !r.cut) {
+    stats_add(STAT_ORIGIN_ERRORS, 1);
+  }
+  if (fd >= 0 && r.chunked && complete) {
+    rio_writen(fd, "0\r\n\r\n", 5); // last chunk
   }
+
+  if (complete && !timed_out && resp.keep_alive && rio_server.rio_cnt == 0 &&
+      (resp.chunked || resp.content_length >= 0 || !http_has_body(&resp))) {
+    upstream_put(req -> server_hostname, req -> server_port, connfd2server);
+  } else if (close(connfd2server) < 0) {
+    log_warn("Close error: %s", strerror(errno));
+  }
+  if (r.fill != NULL) {
+    if (complete) { // for the other workers too
+      shm_put(req -> uri, r.fill -> content, hdr_len,
+              r.fill -> content + hdr_len, r.fill -> content_len - hdr_len,
+              expires);
+    }
+    cache_fill_end(r.fill, complete);
+  } else if (complete && !r.too_big) {
+    // the cached header always carries the length and no Connection
+    if (http_has_body(&resp)) {
+      hdr_len += sprintf(hdr + hdr_len, "Content-Length: %d\r\n",
+                         r.content_len);
+    }
+    hdr_len += sprintf(hdr + hdr_len, "\r\n");
+    put_cached_response(req -> uri, hdr, hdr_len, r.content, r.content_len,
+                        expires);
+    shm_put(req -> uri, hdr, hdr_len, r.content, r.content_len, expires);
+  }
+  if (resp.status == 200 && (r.too_big || complete)) {
+    // whether later Ranges on it go to the server
+    note_uncacheable(req -> uri, r.too_big);
+  }
+  free(r.content);
+  return (complete || r.cut) && keep;
 }
 
 /*
@@ -218,138 +1383,319 @@ void do_server(int fd, int connfd2server, char *request2server, char *uri) {
 void clienterror(int fd, char *cause, char *errnum,
      char *shortmsg, char *longmsg)
 {
-    char buf[MAXLINE], body[MAXBUF];
+    char buf[MAXLINE + MAXBUF];
+    int len = build_clienterror(buf, cause, errnum, shortmsg, longmsg);
 
-    /* Build the HTTP response body */
-    sprintf(body, "<html><title>Proxy Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Proxy server</em>\r\n", body);
-
-    /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    stats_first_byte();
+    rio_writen(fd, buf, len); // the client may be gone, cut at a deadline
 }
 /* $end clienterror */
 
 /*
- * process_requesthdrs - read HTTP request headers and make a new one
+ * build_clienterror - Format the whole error response for the client into
+ *   buf, which holds at least MAXLINE + MAXBUF bytes. Return its length.
  */
-/* $begin process_requesthdrs */
-void process_requesthdrs(rio_t *rp, char *hdr2server, char *server_hostname)
+int build_clienterror(char *buf, char *cause, char *errnum,
+     char *shortmsg, char *longmsg)
 {
-    char buf[MAXLINE];
-    // TODO: init header
-    sprintf(hdr2server, "Host: %s\r\n", server_hostname);
-    strcat(hdr2server, user_agent_hdr);
-    strcat(hdr2server, conn_hdr);
-    strcat(hdr2server, proxy_conn_hdr);
-
-    Rio_readlineb(rp, buf, MAXLINE);
-    while (strcmp(buf, "\r\n")) {          //line:netp:readhdrs:checkterm
-      Rio_readlineb(rp, buf, MAXLINE);
-      if ((!strncasecmp(buf, "Host:", strlen("Host:")))
-	&& (!strncasecmp(buf, "User-Agent:", strlen("User-Agent:")))
-	&& (!strncasecmp(buf, "Connection:", strlen("Connection:")))
-	&& (!strncasecmp(buf, "Proxy-Connection:", strlen("Proxy-Connection")))) {
-	// Not the default header info
-        strcat(hdr2server, buf);
+    char body[MAXBUF];
+
+    /* Build the HTTP response body */
+    snprintf(body, MAXBUF, "<html><title>Proxy Error</title>"
+             "<body bgcolor=""ffffff"">\r\n"
+             "%s: %s\r\n"
+             "<p>%s: %.1024s\r\n"
+             "<hr><em>The Proxy server</em>\r\n",
+             errnum, shortmsg, longmsg, cause);
+
+    /* Build the HTTP response */
+    return sprintf(buf, "HTTP/1.0 %s %s\r\n"
+                   "Content-type: text/html\r\n"
+                   "Content-length: %d\r\n\r\n%s",
+                   errnum, shortmsg, (int)strlen(body), body);
+}
+
+/*
+ * build_stats - Format the stats page as a whole response into buf of
+ *   size bytes, closing the connection after it unless keep_alive.
+ *   Return its length.
+ */
+int build_stats(char *buf, int size, int keep_alive) {
+  char body[MAXBUF];
+  int len = stats_report(body, MAXBUF);
+
+  len = snprintf(buf, size, "HTTP/1.0 200 OK\r\n"
+                 "Content-type: text/plain\r\n"
+                 "Content-length: %d\r\n%s\r\n%s", len,
+                 keep_alive ? keep_alive_hdr : conn_hdr, body);
+  return len < size ? len : size - 1;
+}
+
+/* append - Add n bytes of src at *len in out */
+static void append(char *out, int *len, const char *src, int n) {
+  memcpy(out + *len, src, n);
+  *len += n;
+}
+
+/*
+ * note_uncacheable - Remember whether the object at uri could be cached,
+ *   as its latest response from the server said. Remembered uris share
+ *   a fixed table by hash, so one may be forgotten, or taken for another.
+ */
+void note_uncacheable(char *uri, int yes) {
+  unsigned int h = uri_hash(uri);
+  unsigned int *slot = &uncacheable[h & (UNCACHEABLE_SLOTS - 1)];
+
+  if (yes) {
+    __atomic_store_n(slot, h, __ATOMIC_RELAXED);
+  } else {
+    __atomic_compare_exchange_n(slot, &h, 0, 0, __ATOMIC_RELAXED,
+                                __ATOMIC_RELAXED);
+  }
+}
+
+/* uri_uncacheable - Was uri's object last seen not to be cacheable? */
+static int uri_uncacheable(char *uri) {
+  unsigned int h = uri_hash(uri);
+  return __atomic_load_n(&uncacheable[h & (UNCACHEABLE_SLOTS - 1)],
+                         __ATOMIC_RELAXED) == h;
+}
+
+/*
+ * build_request - Assemble the request for the server in one pass: the
+ *   request line, the headers the proxy always sends, then every other
+ *   client header as it came. keep_alive asks the server for a persistent
+ *   HTTP/1.1 connection; otherwise the request is HTTP/1.0 and asks it to
+ *   close. A client Connection or Proxy-Connection header sets req's
+ *   keep_alive on the way. A single Range is recorded in req and not
+ *   passed on, so the whole object comes back for the cache; with If-Range,
+ *   which the proxy can't check, the whole object goes to the client too.
+ *   A Range on an object that can't be cached anyway, one starting past
+ *   the biggest object or on a uri lately seen uncacheable, goes to the
+ *   server as is, If-Range and all, so it sends just that range.
+ *   Return the request malloc'd and NUL terminated, with its length in
+ *   *lenp.
+ */
+char *build_request(http_request *head, request_t *req, int keep_alive,
+                    int *lenp) {
+  const char *version = keep_alive ? " HTTP/1.1\r\n" : " HTTP/1.0\r\n";
+  int method_len = strlen(req -> method);
+  int path_len = strlen(req -> abs_path);
+  int host_len = strlen(req -> server_hostname);
+  int size, len = 0, i, if_range = 0, pass = 0;
+  char *out, *line, *value;
+
+  size = method_len + 1 + path_len + strlen(version) +
+         strlen("Host: \r\n") + host_len + strlen(user_agent_hdr) +
+         strlen(keep_alive_hdr) + strlen(conn_hdr) + strlen(proxy_conn_hdr) +
+         strlen("\r\n") + 1;
+  for (i = 0; i < head -> nhdrs; i++) {
+    size += head -> hdrs[i].len;
+  }
+  out = Malloc(size);
+  for (i = 0; i < head -> nhdrs; i++) {
+    if ((value = http_hdr_value(head -> hdrs[i].p, "Range")) != NULL &&
+        http_parse_range(value, &req -> range_first, &req -> range_last)) {
+      req -> range = 1;
+      pass = req -> range_first >= cache_max_object() ||
+             uri_uncacheable(req -> uri);
+    }
+  }
+
+  append(out, &len, req -> method, method_len);
+  append(out, &len, " ", 1);
+  append(out, &len, req -> abs_path, path_len);
+  append(out, &len, version, strlen(version));
+  append(out, &len, "Host: ", strlen("Host: "));
+  append(out, &len, req -> server_hostname, host_len);
+  append(out, &len, "\r\n", 2);
+  append(out, &len, user_agent_hdr, strlen(user_agent_hdr));
+  if (keep_alive) {
+    append(out, &len, keep_alive_hdr, strlen(keep_alive_hdr));
+  } else {
+    append(out, &len, conn_hdr, strlen(conn_hdr));
+    append(out, &len, proxy_conn_hdr, strlen(proxy_conn_hdr));
+  }
+  for (i = 0; i < head -> nhdrs; i++) {
+    line = head -> hdrs[i].p;
+    if ((value = http_hdr_value(line, "Connection")) != NULL ||
+        (value = http_hdr_value(line, "Proxy-Connection")) != NULL) {
+      if (http_has_token(value, "close")) {
+        req -> keep_alive = 0;
+      } else if (http_has_token(value, "keep-alive")) {
+        req -> keep_alive = 1;
       }
+      continue; // replaced by ours
     }
-    strcat(hdr2server, "\r\n"); // don't forget the add the termination
-    return;
+    if (http_hdr_value(line, "Range") != NULL && !pass) {
+      continue; // recorded above
+    }
+    if (http_hdr_value(line, "If-Range") != NULL) {
+      if_range = 1;
+      if (!pass) {
+        continue;
+      }
+    }
+    if (http_hdr_value(line, "Host") != NULL ||
+        http_hdr_value(line, "User-Agent") != NULL) {
+      continue; // default header info, already there
+    }
+    append(out, &len, line, head -> hdrs[i].len);
+  }
+  if (if_range) {
+    req -> range = 0;
+  }
+  append(out, &len, "\r\n", 2);
+  out[len] = '\0';
+  *lenp = len;
+  return out;
+}
+
+/*
+ * conditional_request - Turn request2server into a request revalidating
+ *   the stale line: the client's own validators give way to the line's.
+ *   Return it malloc'd, or NULL if the line has no validator.
+ */
+char *conditional_request(char *request2server, cache_line *stale) {
+  char validators[MAXLINE];
+  char *out, *line, *eol;
+  int n, len = 0;
+
+  if ((n = http_conditional(stale -> content, stale -> hdr_len, validators,
+                            MAXLINE)) == 0) {
+    return NULL;
+  }
+  out = Malloc(strlen(request2server) + n + 1);
+  for (line = request2server; *line != '\r' && *line != '\0'; line = eol) {
+    eol = strchr(line, '\n');
+    eol = eol != NULL ? eol + 1 : line + strlen(line);
+    if (http_hdr_value(line, "If-None-Match") == NULL &&
+        http_hdr_value(line, "If-Modified-Since") == NULL) {
+      append(out, &len, line, eol - line);
+    }
+  }
+  append(out, &len, validators, n);
+  append(out, &len, "\r\n", 2);
+  out[len] = '\0';
+  return out;
 }
-/* $end process_requesthdrs */
 
 /*
  * parse_uri - parse URI into abs_path, server_hostname and server_port
  *             return 0 if successfully parsed, 1 if failed(malformed req)
  */
 /* $begin parse_uri */
-int parse_uri(char *uri, char *abs_path, char *server_hostname,
-	char *server_port) {
+int parse_uri(http_slice uri, char *abs_path, char *server_hostname,
+              char *server_port) {
   // http_URL = "http:" "//" host [ ":" port ] [ abs_path ]
-  char uri_cpy[MAXLINE];
-  char *port_ptr;
-  char *abs_ptr;
-  int port = 80;
-  // init
-  strcpy(uri_cpy, uri);
-  strcpy(abs_path, "/");
-  if (!strncasecmp(uri_cpy, "http://", strlen("http://"))) {
-    sscanf(uri_cpy, "http://%s", uri_cpy); // remove the prefix
-  } else {
+  http_slice host, port, path;
+  int i, port_num = 80;
+
+  if (http_split_uri(uri, &host, &port, &path)) {
     return 1; // not contain the http:// prefix malformed uri
   }
-
-  if ((port_ptr = strchr(uri_cpy, ':')) != NULL) {
-    *port_ptr = '\0'; // termination uri_cpy
-    strcpy(server_hostname, uri_cpy);
-
-    port_ptr++; // point to real number
-    port = atoi(port_ptr);
-
-    if ((abs_ptr = strchr(port_ptr, '/')) != NULL) {
-      abs_ptr++;
-      strcat(abs_path, abs_ptr);
+  if (port.len > 0) {
+    for (i = 0, port_num = 0; i < port.len; i++) {
+      if (!isdigit((unsigned char)port.p[i])) {
+        return 1;
+      }
+      port_num = port_num * 10 + port.p[i] - '0';
+      if (port_num > 65535) {
+        return 1; // checked as it grows, so it can't overflow
+      }
     }
-  } else { // no port num, only abs path
-    if ((abs_ptr = strchr(uri_cpy, '/')) != NULL) {
-      *abs_ptr = '\0';
-      strcpy(server_hostname, uri_cpy);
-      abs_ptr++;
-      strcat(abs_path, abs_ptr);
-    } else { // just like http://www.cmu.edu
-      strcpy(server_hostname, uri_cpy);
+    if (port_num == 0) {
+      return 1;
     }
   }
-  sprintf(server_port, "%d", port); // convert it back to string
+  copy_slice(server_hostname, host);
+  if (path.len > 0) {
+    copy_slice(abs_path, path);
+  } else { // just like http://www.cmu.edu
+    strcpy(abs_path, "/");
+  }
+  sprintf(server_port, "%d", port_num); // convert it back to string
   return 0;
 }
 /* $end parse_uri */
 
 /*
- * sigint_handler - The kernel sends a SIGINT to proxy whenver the user type
- *   ctrl-c at keyboard. Free the cache if necessary.
+ * sigint_thread - Thread routine taking the SIGINT the kernel sends to
+ *   proxy whenever the user types ctrl-c at the keyboard. Every other
+ *   thread keeps it blocked, so saving the cache and flushing the log run
+ *   here as ordinary code rather than in a signal handler. The memory goes
+ *   with the process; the other threads may still be using it.
  */
-void sigint_handler(int sig) {
-  sigset_t mask, prev_mask;
+void *sigint_thread(void *vargp) {
+  sigset_t *mask = (sigset_t *)vargp;
+  int sig;
+
+  Pthread_detach(pthread_self());
+  while (sigwait(mask, &sig) != 0) {
+  }
+  log_info("Caught SIGINT!");
+  if (snapshot != NULL && cache_save(snapshot)) {
+    log_error("Cache snapshot failed!");
+  }
+  log_flush();
+  _exit(0);
+}
 
-  Sio_puts("Caught SIGINT!\n");
-  // G3
-  Sigemptyset(&mask);
-  Sigfillset(&mask);
+/*
+ * parse_size - Read a byte count with an optional k, m or g suffix.
+ *   Return -1 if it isn't one, or if it is negative or over max.
+ */
+long parse_size(char *s, long max) {
+  char *end;
+  long n, unit = 1;
 
-  Sigprocmask(SIG_BLOCK, &mask, &prev_mask);
-  free_cache();
+  errno = 0;
+  n = strtol(s, &end, 10);
+  switch (tolower((unsigned char)*end)) {
+  case 'g':
+    unit *= 1024;
+    /* fall through */
+  case 'm':
+    unit *= 1024;
+    /* fall through */
+  case 'k':
+    unit *= 1024;
+    end++;
+    break;
+  }
+  if (end == s || *end != '\0' || errno == ERANGE || n < 0 ||
+      n > max / unit) { // the suffix can't overflow it either
+    return -1;
+  }
+  return n * unit;
+}
 
-  Sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+/*
+ * parse_count - Read a plain count, like a number of seconds.
+ *   Return -1 if it isn't one, or if it is negative or over max.
+ */
+long parse_count(char *s, long max) {
+  char *end;
+  long n;
 
-  _exit(0);
+  errno = 0;
+  n = strtol(s, &end, 10);
+  if (end == s || *end != '\0' || errno == ERANGE || n < 0 || n > max) {
+    return -1;
+  }
+  return n;
 }
 
 /*
  * host_verify - Incase of name or service not known error, deal with it.
- *       Simply use the getaddrinfo to skip the invalid hostname or port
+ *       Simply use the getaddrinfo to skip the invalid hostname or port,
+ *       through the shared dns cache so the connect can reuse the answer
  */
 int host_verify(const char *host, char *port) {
-	struct addrinfo hints, *listp;
+	dns_entry *e;
 	int rc;
 
-	memset(&hints, 0, sizeof(struct addrinfo));
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_NUMERICSERV;
-	hints.ai_flags |= AI_ADDRCONFIG;
-	if ((rc = getaddrinfo(host, port, &hints, &listp)) != 0) {
-		printf("getaddrinfo error: %s\n", gai_strerror(rc));
-		return rc;
-	}
-	freeaddrinfo(listp);
-	return 0;
+	e = dns_lookup((char *)host, port, &rc);
+	dns_release(e);
+	return rc;
 }
@@ -0,0 +1,43 @@
+/*
+ * proxy.h - request handling routines shared by the threaded proxy in
+ *   proxy-cached.c and the event-driven front end in event.c
+ */
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+#include "http.h"
+
+/* A parsed request line, with the uri split for the server */
+typedef struct {
+  char method[MAXLINE];
+  char uri[MAXLINE]; /* then any Accept-Encoding, making the cache key */
+  char version[MAXLINE]; /* client's version, 1.1 read as 1.0 */
+  char abs_path[MAXLINE];
+  char server_hostname[MAXLINE];
+  char server_port[MAXLINE];
+  int http11; /* client sent HTTP/1.1 */
+  int keep_alive; /* client wants the connection kept open */
+  int stats; /* asks the proxy itself for its stats page */
+  int auth; /* carries Authorization */
+  int range; /* asks for one range of bytes, see http_parse_range */
+  long range_first, range_last;
+} request_t;
+
+int parse_request(http_request *head, request_t *req, char **errnum,
+                  char **shortmsg, char **longmsg);
+int parse_uri(http_slice uri, char *abs_path, char *server_hostname,
+              char *server_port);
+char *build_request(http_request *head, request_t *req, int keep_alive,
+                    int *lenp);
+int build_clienterror(char *buf, char *cause, char *errnum, char *shortmsg,
+                      char *longmsg);
+int build_stats(char *buf, int size, int keep_alive);
+int host_verify(const char *host, char *port);
+struct cache *shared_lookup(char *uri);
+void note_uncacheable(char *uri, int yes);
+
+/* Event-driven front end, see event.c */
+void event_serve(int listenfd, int nloops);
+
+#endif /* __PROXY_H__ */
@@ -0,0 +1,29 @@
+/*
+ * sbuf.h - bounded producer/consumer queue of descriptors, from CS:APP,
+ *   or of pointers cast to intptr_t
+ */
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include "csapp.h"
+#include <stdint.h>
+
+/* $begin sbuft */
+typedef struct {
+    intptr_t *buf;     /* Buffer array */
+    int n;             /* Maximum number of slots */
+    int front;         /* buf[(front+1)%n] is first item */
+    int rear;          /* buf[rear%n] is last item */
+    sem_t mutex;       /* Protects accesses to buf */
+    sem_t slots;       /* Counts available slots */
+    sem_t items;       /* Counts available items */
+} sbuf_t;
+/* $end sbuft */
+
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, intptr_t item);
+int sbuf_try_insert(sbuf_t *sp, intptr_t item);
+intptr_t sbuf_remove(sbuf_t *sp);
+
+#endif /* __SBUF_H__ */
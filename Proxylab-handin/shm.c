@@ -0,0 +1,262 @@
+/*
+ * shm.c - cache tier shared by the worker processes, in shared memory
+ *
+ * With -p the proxy runs as several worker processes, each with its own
+ * in-memory cache. This tier sits behind those caches so an object one
+ * worker fetched is a hit for all of them. It lives in one anonymous
+ * shared mapping made before the workers are forked: a header with the
+ * index, then an arena cut into SHM_SEGMENTS segments that is used as a
+ * circular log, like the disk tier. An object is appended to the active
+ * segment as a record (an shm_record header, the uri, then the content),
+ * and the index chains it into its uri's bucket.
+ *
+ * Nothing in the mapping is a pointer: buckets and chains hold offsets
+ * into the arena, so it means the same in every process whatever address
+ * the mapping lands at.
+ *
+ * When the active segment is full the log moves on to the oldest one, and
+ * the cleaner compacts the records hit since they were written to its
+ * front and drops the rest. Stale objects are dropped by the lookup that
+ * finds them, and by the cleaner.
+ *
+ * A process-shared mutex protects the whole tier. A hit copies the object
+ * out before letting go of it, so no process ever holds on to the arena
+ * unlocked. The mutex is robust: if a worker dies holding it the next one
+ * to lock it finds out, and empties the tier rather than trusting an index
+ * that may be half updated.
+ */
+#include "shm.h"
+#include "cache.h"
+#include "hash.h"
+#include "log.h"
+
+#define SHM_ALIGN(n) (((n) + 7) & ~7)
+#define REC(off) ((shm_record *)(arena + (off)))
+
+/* Record header, at an 8 byte aligned offset in the arena */
+typedef struct {
+  unsigned int hash;
+  int next; /* offset of the next record in the bucket, -1 at the end */
+  int linked; /* in the index, the latest copy of its uri */
+  int referenced; /* hit since written, the cleaner keeps it */
+  int uri_len; /* including the NUL */
+  int content_len;
+  int hdr_len; /* content starts with a header this long, 0 if unknown */
+  long expires; /* time the object goes stale, 0 if it never does */
+} shm_record;
+
+/* Start of the mapping, followed by the arena */
+typedef struct {
+  pthread_mutex_t mutex; /* process-shared and robust */
+  int seg_size;
+  int active; /* segment being appended to */
+  int used[SHM_SEGMENTS]; /* bytes of records, each segment's append offset */
+  int buckets[SHM_BUCKETS]; /* offset of the first record, -1 if none */
+} shm_header;
+
+static shm_header *shm; /* NULL while the tier is off */
+static char *arena;
+
+/* reset - Empty the tier. Caller holds the mutex. */
+static void reset() {
+  int i;
+  for (i = 0; i < SHM_BUCKETS; i++) {
+    shm -> buckets[i] = -1;
+  }
+  for (i = 0; i < SHM_SEGMENTS; i++) {
+    shm -> used[i] = 0;
+  }
+  shm -> active = 0;
+}
+
+/*
+ * shm_init - Map an arena of about size bytes, empty, to be shared with
+ *   the processes forked from now on. Return 0 on success, 1 if it can't
+ *   be set up, in which case the tier stays off.
+ */
+int shm_init(long size) {
+  pthread_mutexattr_t attr;
+  int seg_size = (size / SHM_SEGMENTS) & ~7;
+  void *map;
+
+  if ((map = mmap(NULL, SHM_ALIGN(sizeof(shm_header)) +
+                  (long)SHM_SEGMENTS * seg_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+    log_error("Shared cache: cannot map %ld bytes: %s", size,
+              strerror(errno));
+    return 1;
+  }
+  shm = (shm_header *)map;
+  arena = (char *)map + SHM_ALIGN(sizeof(shm_header));
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&shm -> mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+  shm -> seg_size = seg_size;
+  reset();
+  return 0;
+}
+
+/* lock - Take the mutex, emptying the tier if its last owner died */
+static void lock() {
+  if (pthread_mutex_lock(&shm -> mutex) == EOWNERDEAD) {
+    log_warn("Shared cache: a worker died holding it, emptying it");
+    reset();
+    pthread_mutex_consistent(&shm -> mutex);
+  }
+}
+
+static void unlock() {
+  pthread_mutex_unlock(&shm -> mutex);
+}
+
+/*
+ * find - Return the link, a bucket or a record's next, holding the offset
+ *   of uri's record, or NULL. Caller holds the mutex.
+ */
+static int *find(char *uri, unsigned int hash) {
+  int *link;
+  for (link = &shm -> buckets[hash & (SHM_BUCKETS - 1)]; *link >= 0;
+       link = &REC(*link) -> next) {
+    if (REC(*link) -> hash == hash &&
+        !strcasecmp((char *)(REC(*link) + 1), uri)) {
+      return link;
+    }
+  }
+  return NULL;
+}
+
+/* unlink_rec - Take the record at off out of the index. Caller holds it. */
+static void unlink_rec(int off) {
+  shm_record *rec = REC(off);
+  int *link = find((char *)(rec + 1), rec -> hash);
+
+  if (link != NULL && *link == off) {
+    *link = rec -> next;
+  }
+  rec -> linked = 0;
+}
+
+/* link_rec - Put the record at off in the index. Caller holds the mutex. */
+static void link_rec(int off) {
+  shm_record *rec = REC(off);
+  int *bucket = &shm -> buckets[rec -> hash & (SHM_BUCKETS - 1)];
+
+  rec -> next = *bucket;
+  rec -> linked = 1;
+  *bucket = off;
+}
+
+/* stale - Has the record's object gone stale? */
+static int stale(shm_record *rec) {
+  return rec -> expires != 0 && time(NULL) >= rec -> expires;
+}
+
+/*
+ * clean - Make segment seg reusable. Records still indexed and hit since
+ *   they were written and still fresh are compacted to its front, every
+ *   other record is dropped. Caller holds the mutex.
+ */
+static void clean(int seg) {
+  int start = seg * shm -> seg_size, end = start + shm -> used[seg];
+  int off, len, kept = start;
+  shm_record *rec;
+
+  for (off = start; off < end; off += len) {
+    rec = REC(off);
+    len = SHM_ALIGN(sizeof(shm_record) + rec -> uri_len + rec -> content_len);
+    if (!rec -> linked) {
+      continue; // a newer copy was written since
+    }
+    unlink_rec(off);
+    if (!rec -> referenced || stale(rec)) {
+      continue;
+    }
+    memmove(arena + kept, rec, len); // kept <= off, never overlaps ahead
+    REC(kept) -> referenced = 0;
+    link_rec(kept);
+    kept += len;
+  }
+  shm -> used[seg] = kept - start;
+}
+
+/*
+ * shm_put - Append an object given as its header and body to the log and
+ *   index it, replacing any copy of uri. It goes stale at time expires,
+ *   never if 0. An object bigger than a segment is not kept.
+ */
+void shm_put(char *uri, char *hdr, int hdr_len, char *body, int body_len,
+             long expires) {
+  unsigned int hash = uri_hash(uri);
+  int uri_len = strlen(uri) + 1;
+  int len = SHM_ALIGN(sizeof(shm_record) + uri_len + hdr_len + body_len);
+  shm_record *rec;
+  int *link, off;
+
+  if (shm == NULL || len > shm -> seg_size) {
+    return;
+  }
+  lock();
+  if (shm -> used[shm -> active] + len > shm -> seg_size) {
+    // move on to the oldest segment, cleaning it first
+    shm -> active = (shm -> active + 1) % SHM_SEGMENTS;
+    clean(shm -> active);
+    if (shm -> used[shm -> active] + len > shm -> seg_size) {
+      clean(shm -> active); // all of it kept, drop it
+    }
+  }
+  if ((link = find(uri, hash)) != NULL) {
+    unlink_rec(*link);
+  }
+  off = shm -> active * shm -> seg_size + shm -> used[shm -> active];
+  rec = REC(off);
+  rec -> hash = hash;
+  rec -> referenced = 0;
+  rec -> uri_len = uri_len;
+  rec -> content_len = hdr_len + body_len;
+  rec -> hdr_len = hdr_len;
+  rec -> expires = expires;
+  memcpy(rec + 1, uri, uri_len);
+  if (hdr_len > 0) {
+    memcpy((char *)(rec + 1) + uri_len, hdr, hdr_len);
+  }
+  memcpy((char *)(rec + 1) + uri_len + hdr_len, body, body_len);
+  link_rec(off);
+  shm -> used[shm -> active] += len;
+  unlock();
+}
+
+/*
+ * shm_get - Find the object cached under uri and copy it out into a cache
+ *   line of its own, outside the cache, for the caller to cache_release.
+ *   Return NULL if not found. A stale object is dropped and not found.
+ */
+cache_line *shm_get(char *uri) {
+  cache_line *c_line;
+  shm_record *rec;
+  char *content;
+  int *link;
+
+  if (shm == NULL) {
+    return NULL;
+  }
+  lock();
+  if ((link = find(uri, uri_hash(uri))) == NULL) {
+    unlock();
+    return NULL;
+  }
+  rec = REC(*link);
+  if (stale(rec)) {
+    unlink_rec(*link);
+    unlock();
+    return NULL;
+  }
+  rec -> referenced = 1;
+  content = (char *)(rec + 1) + rec -> uri_len;
+  c_line = cache_line_new(uri, content, rec -> hdr_len,
+                          content + rec -> hdr_len,
+                          rec -> content_len - rec -> hdr_len, rec -> expires);
+  unlock();
+  return c_line;
+}
@@ -0,0 +1,20 @@
+/*
+ * shm.h - cache tier shared by the worker processes, in shared memory
+ */
+#ifndef __SHM_H__
+#define __SHM_H__
+
+#include "csapp.h"
+
+struct cache; /* cache_line of cache.h */
+
+#define SHM_SIZE (64 * 1024 * 1024) /* Default bytes of the arena */
+#define SHM_SEGMENTS 16 /* Segments the arena is cleaned by */
+#define SHM_BUCKETS 16384 /* Index buckets, must be a power of 2 */
+
+int shm_init(long size);
+void shm_put(char *uri, char *hdr, int hdr_len, char *body, int body_len,
+             long expires);
+struct cache *shm_get(char *uri);
+
+#endif /* __SHM_H__ */
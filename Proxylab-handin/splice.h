@@ -0,0 +1,12 @@
+/*
+ * splice.h - kernel-side relay of a body from one socket to another
+ */
+#ifndef __SPLICE_H__
+#define __SPLICE_H__
+
+#define SPLICE_CHUNK (64 * 1024) /* Most bytes moved through the pipe at once */
+
+long splice_relay(int infd, int outfd, long len, int chunked,
+                  void (*progress)(void *arg), void *arg);
+
+#endif /* __SPLICE_H__ */
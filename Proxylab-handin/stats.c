@@ -0,0 +1,316 @@
+/*
+ * stats.c - request counters and latency histograms of the proxy
+ *
+ * Every thread counts into its own block, so the request path never shares
+ * a cache block or takes a lock to count. A block has a single writer; its
+ * fields are stored with relaxed atomics so stats_report can read them
+ * from another thread untorn. Blocks are listed when a thread first counts
+ * something, and a thread's totals are folded into the retired block when
+ * it exits, so thread per connection loses nothing.
+ *
+ * Latencies go into log2 buckets of microseconds. A percentile is reported
+ * as the upper bound of the bucket it falls in, which is within a factor
+ * of two of the real value.
+ *
+ * A thread serving one request at a time times it with stats_begin,
+ * stats_first_byte and stats_end. The event loops interleave requests and
+ * time each with stats_now and stats_time instead.
+ *
+ * With worker processes each one also publishes its totals every
+ * STATS_PUBLISH_SECS into a slot of a mapping they share, so whichever
+ * worker a stats request lands on reports the sum over all of them.
+ */
+#include "stats.h"
+#include "cache.h"
+#include "log.h"
+
+typedef struct stats_block {
+  long counters[STAT_COUNTERS];
+  long buckets[STAT_HISTOGRAMS][STAT_BUCKETS];
+  struct stats_block *next;
+  char pad[64]; /* keep the next thread's block off this one's last line */
+} stats_block;
+
+/* Everything one process has counted, as a worker publishes it */
+typedef struct {
+  long counters[STAT_COUNTERS];
+  long buckets[STAT_HISTOGRAMS][STAT_BUCKETS];
+  long evictions;
+  long log_dropped;
+} stats_totals;
+
+static stats_totals *shared; /* a slot per worker, NULL without workers */
+static int nworkers;
+static int me; /* this worker's slot */
+static stats_block *blocks; /* live threads' blocks */
+static stats_block retired; /* totals of threads that exited */
+static sem_t mutex; /* Initially = 1, protects blocks and retired */
+static pthread_key_t block_key;
+
+/* This thread's block, and its request being timed by stats_begin */
+static __thread stats_block *mine;
+static __thread long started;
+static __thread int first_byte_seen;
+
+static const char *counter_names[STAT_COUNTERS] = {
+  "hits", "disk_hits", "misses", "bytes_served", "origin_errors",
+  "revalidated", "shared_hits", "timeouts"
+};
+static const char *histogram_names[STAT_HISTOGRAMS] = {
+  "ttfb_us", "total_us"
+};
+
+/* retire - Fold an exiting thread's block into retired and unlist it */
+static void retire(void *vargp) {
+  stats_block *b = (stats_block *)vargp;
+  stats_block **pp;
+  int i, j;
+
+  P(&mutex);
+  for (pp = &blocks; *pp != NULL; pp = &(*pp) -> next) {
+    if (*pp == b) {
+      *pp = b -> next;
+      break;
+    }
+  }
+  for (i = 0; i < STAT_COUNTERS; i++) {
+    retired.counters[i] += b -> counters[i];
+  }
+  for (i = 0; i < STAT_HISTOGRAMS; i++) {
+    for (j = 0; j < STAT_BUCKETS; j++) {
+      retired.buckets[i][j] += b -> buckets[i][j];
+    }
+  }
+  V(&mutex);
+  Free(b);
+}
+
+/*
+ * stats_share - Map a slot for each of nprocs worker processes, before
+ *   they are forked so they all see the same ones
+ */
+void stats_share(int nprocs) {
+  shared = mmap(NULL, nprocs * sizeof(stats_totals), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) {
+    log_warn("Stats of the other workers won't be reported: %s",
+             strerror(errno));
+    shared = NULL;
+    return;
+  }
+  nworkers = nprocs;
+}
+
+/* stats_init - Start with every count at zero */
+void stats_init() {
+  Sem_init(&mutex, 0, 1);
+  pthread_key_create(&block_key, retire);
+}
+
+/* block - This thread's block, listed on first use */
+static stats_block *block() {
+  if (mine == NULL) {
+    mine = (stats_block *)Calloc(1, sizeof(stats_block));
+    P(&mutex);
+    mine -> next = blocks;
+    blocks = mine;
+    V(&mutex);
+    pthread_setspecific(block_key, mine);
+  }
+  return mine;
+}
+
+/* bump - Add n to a field only this thread writes */
+static void bump(long *field, long n) {
+  __atomic_store_n(field, *field + n, __ATOMIC_RELAXED);
+}
+
+/* stats_add - Add n to one of the STAT_ counters */
+void stats_add(int counter, long n) {
+  bump(&block() -> counters[counter], n);
+}
+
+/* stats_time - Count a latency of usecs in one of the histograms */
+void stats_time(int histogram, long usecs) {
+  int b = 0;
+  while (b < STAT_BUCKETS - 1 && usecs >= (1L << b)) {
+    b++;
+  }
+  bump(&block() -> buckets[histogram][b], 1);
+}
+
+/* stats_now - Microseconds on a clock that never steps back */
+long stats_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* stats_begin - This thread starts answering a request */
+void stats_begin() {
+  started = stats_now();
+  first_byte_seen = 0;
+}
+
+/* stats_first_byte - The response is about to go out, only the first
+ *   call per request counts */
+void stats_first_byte() {
+  if (!first_byte_seen) {
+    first_byte_seen = 1;
+    stats_time(STAT_TTFB, stats_now() - started);
+  }
+}
+
+/* stats_end - This thread is done answering the request */
+void stats_end() {
+  stats_time(STAT_TOTAL, stats_now() - started);
+}
+
+/*
+ * percentile - Upper bound of the bucket holding the q quantile of a
+ *   histogram of n latencies
+ */
+static long percentile(long *buckets, long n, double q) {
+  long seen = 0;
+  int b;
+  for (b = 0; b < STAT_BUCKETS; b++) {
+    seen += buckets[b];
+    if (seen > 0 && seen >= q * n) {
+      break;
+    }
+  }
+  return 1L << (b < STAT_BUCKETS ? b : STAT_BUCKETS - 1);
+}
+
+/* add_totals - Add the totals at src, read untorn, into t */
+static void add_totals(stats_totals *t, stats_totals *src) {
+  int i, j;
+
+  for (i = 0; i < STAT_COUNTERS; i++) {
+    t -> counters[i] += __atomic_load_n(&src -> counters[i], __ATOMIC_RELAXED);
+  }
+  for (i = 0; i < STAT_HISTOGRAMS; i++) {
+    for (j = 0; j < STAT_BUCKETS; j++) {
+      t -> buckets[i][j] += __atomic_load_n(&src -> buckets[i][j],
+                                            __ATOMIC_RELAXED);
+    }
+  }
+  t -> evictions += __atomic_load_n(&src -> evictions, __ATOMIC_RELAXED);
+  t -> log_dropped += __atomic_load_n(&src -> log_dropped, __ATOMIC_RELAXED);
+}
+
+/* local_totals - Sum up what this process has counted into t */
+static void local_totals(stats_totals *t) {
+  stats_block *b;
+  int i, j;
+
+  memset(t, 0, sizeof(*t));
+  P(&mutex);
+  for (b = blocks; ; b = b -> next) {
+    if (b == NULL) {
+      b = &retired; // last, then stop
+    }
+    for (i = 0; i < STAT_COUNTERS; i++) {
+      t -> counters[i] += __atomic_load_n(&b -> counters[i], __ATOMIC_RELAXED);
+    }
+    for (i = 0; i < STAT_HISTOGRAMS; i++) {
+      for (j = 0; j < STAT_BUCKETS; j++) {
+        t -> buckets[i][j] += __atomic_load_n(&b -> buckets[i][j],
+                                              __ATOMIC_RELAXED);
+      }
+    }
+    if (b == &retired) {
+      break;
+    }
+  }
+  V(&mutex);
+  t -> evictions = cache_evictions();
+  t -> log_dropped = log_dropped();
+}
+
+/* publisher - Thread routine copying this worker's totals to its slot */
+static void *publisher(void *vargp) {
+  stats_totals t;
+  long *src = (long *)&t, *dst = (long *)&shared[me];
+  int i;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    local_totals(&t);
+    for (i = 0; i < (int)(sizeof(t) / sizeof(long)); i++) {
+      __atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+    }
+    sleep(STATS_PUBLISH_SECS);
+  }
+  return NULL;
+}
+
+/*
+ * stats_publish - Start publishing the totals of worker proc for the
+ *   others, if stats_share mapped the slots
+ */
+void stats_publish(int proc) {
+  pthread_t tid;
+
+  if (shared == NULL || proc >= nworkers) {
+    return;
+  }
+  me = proc;
+  memset(&shared[me], 0, sizeof(stats_totals)); // a restarted worker's
+  Pthread_create(&tid, NULL, publisher, NULL);
+}
+
+/*
+ * stats_report - Write the counters, the hit ratio and each histogram with
+ *   its percentiles into buf as plain text lines of "name value", summed
+ *   over the workers if there are several. Return the length written,
+ *   truncated to size - 1 bytes.
+ */
+int stats_report(char *buf, int size) {
+  stats_totals t;
+  long *counters = t.counters;
+  long (*buckets)[STAT_BUCKETS] = t.buckets;
+  long served, n;
+  int i, j, len = 0;
+
+  local_totals(&t);
+  for (i = 0; shared != NULL && i < nworkers; i++) {
+    if (i != me) { // this worker's own are the latest
+      add_totals(&t, &shared[i]);
+    }
+  }
+
+#define EMIT(...) \
+  (len += snprintf(buf + len, len < size ? size - len : 0, __VA_ARGS__))
+  for (i = 0; i < STAT_COUNTERS; i++) {
+    EMIT("%s %ld\n", counter_names[i], counters[i]);
+  }
+  EMIT("evictions %ld\n", t.evictions);
+  EMIT("log_dropped %ld\n", t.log_dropped);
+  served = counters[STAT_HITS] + counters[STAT_SHARED_HITS] +
+           counters[STAT_DISK_HITS];
+  n = served + counters[STAT_MISSES];
+  EMIT("hit_ratio %.4f\n", n > 0 ? (double)served / n : 0.0);
+  for (i = 0; i < STAT_HISTOGRAMS; i++) {
+    for (j = 0, n = 0; j < STAT_BUCKETS; j++) {
+      n += buckets[i][j];
+    }
+    EMIT("%s_count %ld\n", histogram_names[i], n);
+    if (n > 0) {
+      EMIT("%s_p50 %ld\n", histogram_names[i], percentile(buckets[i], n, 0.5));
+      EMIT("%s_p90 %ld\n", histogram_names[i], percentile(buckets[i], n, 0.9));
+      EMIT("%s_p99 %ld\n", histogram_names[i],
+           percentile(buckets[i], n, 0.99));
+      EMIT("%s_p999 %ld\n", histogram_names[i],
+           percentile(buckets[i], n, 0.999));
+    }
+    for (j = 0; j < STAT_BUCKETS; j++) {
+      if (buckets[i][j] > 0) {
+        EMIT("%s_below_%ld %ld\n", histogram_names[i], 1L << j,
+             buckets[i][j]);
+      }
+    }
+  }
+#undef EMIT
+  return len < size ? len : size - 1;
+}
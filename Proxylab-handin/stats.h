@@ -0,0 +1,40 @@
+/*
+ * stats.h - request counters and latency histograms of the proxy
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "csapp.h"
+
+#define STATS_URI "/proxy-stats" /* Request this from the proxy itself */
+
+/* Counters */
+#define STAT_HITS 0 /* answered from memory */
+#define STAT_DISK_HITS 1 /* answered from the disk tier */
+#define STAT_MISSES 2 /* went to the server */
+#define STAT_BYTES_SERVED 3 /* response bytes written to clients */
+#define STAT_ORIGIN_ERRORS 4 /* server unreachable or its response broken */
+#define STAT_REVALIDATED 5 /* stale lines the server answered 304 for */
+#define STAT_SHARED_HITS 6 /* answered from the cache shared by the workers */
+#define STAT_TIMEOUTS 7 /* connections cut at a deadline */
+#define STAT_COUNTERS 8
+
+/* Latency histograms */
+#define STAT_TTFB 0 /* request in to first response byte out */
+#define STAT_TOTAL 1 /* request in to last response byte out */
+#define STAT_HISTOGRAMS 2
+#define STAT_BUCKETS 32 /* bucket b holds latencies below 2^b usecs */
+#define STATS_PUBLISH_SECS 1 /* how stale another worker's totals may be */
+
+void stats_share(int nprocs);
+void stats_init();
+void stats_publish(int proc);
+void stats_add(int counter, long n);
+void stats_time(int histogram, long usecs);
+long stats_now();
+void stats_begin();
+void stats_first_byte();
+void stats_end();
+int stats_report(char *buf, int size);
+
+#endif /* __STATS_H__ */
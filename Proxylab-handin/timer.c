@@ -0,0 +1,313 @@
+/*
+ * timer.c - hierarchical timer wheel and connection deadlines
+ *
+ * Every client and server socket the proxy waits on has a deadline: the
+ * idle limit for a kept-alive client to start its next request, the header
+ * limit for a request or response header to come in whole, and the
+ * transfer limit for a response to go through. While a response body
+ * moves, it is also cut after the idle limit without progress. A limit of
+ * 0 is no limit.
+ *
+ * Deadlines are kept in a timer wheel of WHEEL_LEVELS levels of
+ * WHEEL_SLOTS slots. Level 0 holds the timers due within WHEEL_SLOTS
+ * ticks, one slot per tick; each level up holds the ones further out,
+ * WHEEL_SLOTS times coarser. Whenever the level below wraps around, the
+ * next slot of a level is cascaded down, its timers placed again by how
+ * far off they are now. Adding, removing and firing a timer are all O(1),
+ * however many connections are waiting, which matters since most
+ * deadlines are removed long before they are due.
+ *
+ * A deadline that sees progress is not moved on the wheel each time: its
+ * timer fires at the earliest it could be due, and goes back on the wheel
+ * if the connection made progress meanwhile.
+ *
+ * The event loops keep each connection's deadline on a wheel of their own
+ * and close it once it passes. A thread blocked in a read or write can't
+ * be woken that way, so the threads arm their deadlines on shared wheels
+ * instead, one of DEADLINE_SHARDS per group of threads, each behind its
+ * own lock. A reaper thread advances them every tick and shuts a passed
+ * deadline's sockets down, which fails the blocked call; the thread then
+ * drops the connection as if the peer had closed it. The socket is only
+ * ever shut down under the lock and while armed, so once deadline_disarm
+ * returns the descriptor is safe to close and reuse.
+ */
+#include "timer.h"
+#include "stats.h"
+#include "log.h"
+#include <limits.h>
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_REACH ((1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+/* A shared wheel of the threads' deadlines */
+typedef struct {
+  sem_t mutex; /* Initially = 1, protects the wheel */
+  timer_wheel wheel;
+} deadline_shard;
+
+static long limits[DEADLINE_KINDS] = {
+  IDLE_SECS * 1000L, HEADER_SECS * 1000L, TRANSFER_SECS * 1000L
+};
+static deadline_shard shards[DEADLINE_SHARDS];
+static unsigned int shards_used; /* threads given a shard so far */
+static __thread int my_shard = -1;
+
+/* timer_now - Milliseconds on a clock that never steps back */
+long timer_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts); // no system call, vdso
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* wheel_init - Start an empty wheel at time now */
+void wheel_init(timer_wheel *w, long now) {
+  int i, j;
+  for (i = 0; i < WHEEL_LEVELS; i++) {
+    for (j = 0; j < WHEEL_SLOTS; j++) {
+      w -> slots[i][j].next = w -> slots[i][j].prev = &w -> slots[i][j];
+    }
+  }
+  w -> now = 0;
+  w -> start = now;
+  w -> pending = 0;
+}
+
+/* place - Put t in the slot for how far off it is */
+static void place(timer_wheel *w, wheel_timer *t) {
+  unsigned long delta = t -> expires - w -> now;
+  wheel_timer *head;
+  int level = 0;
+
+  while (level < WHEEL_LEVELS - 1 &&
+         delta >= 1UL << (WHEEL_BITS * (level + 1))) {
+    level++;
+  }
+  head = &w -> slots[level][(t -> expires >> (WHEEL_BITS * level)) &
+                            WHEEL_MASK];
+  t -> next = head;
+  t -> prev = head -> prev;
+  head -> prev -> next = t;
+  head -> prev = t;
+}
+
+/* unlink_timer - Take t off whatever list it is on */
+static void unlink_timer(wheel_timer *t) {
+  t -> prev -> next = t -> next;
+  t -> next -> prev = t -> prev;
+  t -> next = t -> prev = NULL;
+}
+
+/*
+ * wheel_add - Fire t once msecs have passed, rounded up to a whole tick
+ *   and to at least one. t is taken off the wheel first if pending.
+ */
+void wheel_add(timer_wheel *w, wheel_timer *t, long msecs) {
+  unsigned long ticks = (msecs + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+  wheel_del(w, t);
+  if (msecs <= 0) {
+    ticks = 1;
+  } else if (ticks > WHEEL_REACH) {
+    ticks = WHEEL_REACH;
+  }
+  t -> expires = w -> now + ticks;
+  place(w, t);
+  w -> pending++;
+}
+
+/* wheel_del - Take t off the wheel, if it is on it */
+void wheel_del(timer_wheel *w, wheel_timer *t) {
+  if (t -> next != NULL) {
+    unlink_timer(t);
+    w -> pending--;
+  }
+}
+
+/* cascade - Place again the timers of a slot above level 0 */
+static void cascade(timer_wheel *w, int level, int slot) {
+  wheel_timer *head = &w -> slots[level][slot], *t;
+  while ((t = head -> next) != head) {
+    unlink_timer(t);
+    place(w, t);
+  }
+}
+
+/*
+ * wheel_advance - Tick the wheel up to time now, firing every timer due
+ *   on the way. A fired timer is off the wheel before its routine runs,
+ *   so the routine may add it back.
+ */
+void wheel_advance(timer_wheel *w, long now) {
+  unsigned long target = (now - w -> start) / TIMER_TICK_MS;
+  wheel_timer due, *head, *t;
+  int level;
+
+  while (w -> now < target) {
+    if (w -> pending == 0) {
+      w -> now = target; // nothing on the way
+      return;
+    }
+    w -> now++;
+    for (level = 1; level < WHEEL_LEVELS &&
+         ((w -> now >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK) == 0;
+         level++) {
+    }
+    while (--level > 0) { // the levels that came round, top down
+      cascade(w, level, (w -> now >> (WHEEL_BITS * level)) & WHEEL_MASK);
+    }
+    head = &w -> slots[0][w -> now & WHEEL_MASK];
+    if (head -> next == head) {
+      continue;
+    }
+    // move the slot to a list of its own, then fire the timers off it
+    due.next = head -> next;
+    due.prev = head -> prev;
+    due.next -> prev = due.prev -> next = &due;
+    head -> next = head -> prev = head;
+    while ((t = due.next) != &due) {
+      unlink_timer(t);
+      w -> pending--;
+      t -> fn(t -> arg);
+    }
+  }
+}
+
+/* deadline_set_limits - Limits in seconds of the deadline kinds, 0 for none */
+void deadline_set_limits(long idle, long header, long transfer) {
+  limits[DEADLINE_IDLE] = idle * 1000;
+  limits[DEADLINE_HEADER] = header * 1000;
+  limits[DEADLINE_TRANSFER] = transfer * 1000;
+}
+
+/* deadline_limit - Milliseconds a deadline of kind allows, 0 for no limit */
+long deadline_limit(int kind) {
+  return limits[kind & ~DEADLINE_QUIET];
+}
+
+/*
+ * deadline_begin - Start d over as a deadline of kind, counting from now.
+ *   Return the milliseconds until it may be due, 0 if it never is.
+ */
+long deadline_begin(deadline_t *d, int kind) {
+  long now = timer_now(), limit = limits[kind & ~DEADLINE_QUIET];
+
+  d -> due = limit > 0 ? now + limit : 0;
+  d -> quiet = (kind & DEADLINE_QUIET) ? limits[DEADLINE_IDLE] : 0;
+  __atomic_store_n(&d -> active, now, __ATOMIC_RELAXED);
+  d -> fired = 0;
+  if (d -> due == 0 && d -> quiet == 0) {
+    return 0;
+  }
+  return deadline_left(d, now);
+}
+
+/* deadline_left - Milliseconds until d is due, 0 or less once it is */
+long deadline_left(deadline_t *d, long now) {
+  long left = d -> due > 0 ? d -> due - now : LONG_MAX, quiet;
+
+  if (d -> quiet > 0) {
+    quiet = __atomic_load_n(&d -> active, __ATOMIC_RELAXED) + d -> quiet - now;
+    left = quiet < left ? quiet : left;
+  }
+  return left;
+}
+
+/* deadline_touch - d's connection made progress */
+void deadline_touch(deadline_t *d) {
+  __atomic_store_n(&d -> active, timer_now(), __ATOMIC_RELAXED);
+}
+
+/* cut - Timer routine of a threads' deadline, run under its shard's lock */
+static void cut(void *arg) {
+  deadline_t *d = (deadline_t *)arg;
+  long left = deadline_left(d, timer_now());
+
+  if (left > 0) { // made progress since, look again when it may be due
+    wheel_add(&shards[d -> shard].wheel, &d -> t, left);
+    return;
+  }
+  d -> fired = 1;
+  shutdown(d -> fd, SHUT_RDWR);
+  if (d -> peer >= 0) {
+    shutdown(d -> peer, SHUT_RDWR);
+  }
+  stats_add(STAT_TIMEOUTS, 1);
+  log_debug("Deadline passed on descriptor %d, cut it.", d -> fd);
+}
+
+/* reaper - Thread routine advancing the shared wheels every tick */
+static void *reaper(void *vargp) {
+  int i;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    usleep(TIMER_TICK_MS * 1000);
+    for (i = 0; i < DEADLINE_SHARDS; i++) {
+      P(&shards[i].mutex);
+      wheel_advance(&shards[i].wheel, timer_now());
+      V(&shards[i].mutex);
+    }
+  }
+  return NULL;
+}
+
+/* timer_init - Set up the shared wheels and start their reaper thread */
+void timer_init() {
+  pthread_t tid;
+  int i;
+
+  for (i = 0; i < DEADLINE_SHARDS; i++) {
+    Sem_init(&shards[i].mutex, 0, 1);
+    wheel_init(&shards[i].wheel, timer_now());
+  }
+  Pthread_create(&tid, NULL, reaper, NULL);
+}
+
+/*
+ * deadline_init - Make d a disarmed deadline on the calling thread's
+ *   shared wheel. The threads are spread over the wheels in turn.
+ */
+void deadline_init(deadline_t *d) {
+  if (my_shard < 0) {
+    my_shard = __atomic_fetch_add(&shards_used, 1, __ATOMIC_RELAXED) %
+               DEADLINE_SHARDS;
+  }
+  d -> t.next = d -> t.prev = NULL;
+  d -> t.fn = cut;
+  d -> t.arg = d;
+  d -> shard = my_shard;
+  d -> fired = 0;
+}
+
+/*
+ * deadline_arm - Start d over as a deadline of kind on socket fd, and on
+ *   peer too unless it is -1. Both are shut down once it passes.
+ */
+void deadline_arm(deadline_t *d, int kind, int fd, int peer) {
+  deadline_shard *s = &shards[d -> shard];
+  long left;
+
+  P(&s -> mutex);
+  wheel_del(&s -> wheel, &d -> t);
+  d -> fd = fd;
+  d -> peer = peer;
+  if ((left = deadline_begin(d, kind)) > 0) {
+    wheel_add(&s -> wheel, &d -> t, left);
+  }
+  V(&s -> mutex);
+}
+
+/*
+ * deadline_disarm - Stop d, its sockets are left alone from now on.
+ *   Return 1 if it had passed and shut them down, 0 otherwise.
+ */
+int deadline_disarm(deadline_t *d) {
+  deadline_shard *s = &shards[d -> shard];
+  int fired;
+
+  P(&s -> mutex);
+  wheel_del(&s -> wheel, &d -> t);
+  fired = d -> fired;
+  V(&s -> mutex);
+  return fired;
+}
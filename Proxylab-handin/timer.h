@@ -0,0 +1,75 @@
+/*
+ * timer.h - hierarchical timer wheel and connection deadlines
+ */
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include "csapp.h"
+
+#define TIMER_TICK_MS 100 /* Wheel resolution */
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS) /* Slots per level */
+#define WHEEL_LEVELS 3 /* Reach of 2^24 ticks, about 19 days */
+#define DEADLINE_SHARDS 8 /* Wheels of the threaded deadlines, one lock each */
+
+/* Deadline kinds, each with its limit in seconds */
+#define DEADLINE_IDLE 0 /* a kept-alive client's next request to start */
+#define DEADLINE_HEADER 1 /* a request or response header to come in whole */
+#define DEADLINE_TRANSFER 2 /* a response to go through */
+#define DEADLINE_KINDS 3
+#define DEADLINE_QUIET 8 /* or'd in: also cut after the idle limit of no
+                            progress, as told by deadline_touch */
+
+/* Default limits */
+#define IDLE_SECS 5
+#define HEADER_SECS 10
+#define TRANSFER_SECS 300
+#define DEADLINE_MAX_SECS 86400 /* Longest limit that may be set */
+
+typedef struct wheel_timer {
+  struct wheel_timer *next, *prev; /* NULL while not pending */
+  unsigned long expires; /* tick it fires at */
+  void (*fn)(void *arg); /* run by wheel_advance, may touch the wheel */
+  void *arg;
+} wheel_timer;
+
+typedef struct {
+  wheel_timer slots[WHEEL_LEVELS][WHEEL_SLOTS]; /* list heads */
+  unsigned long now; /* ticks since start, every timer due by it fired */
+  long start; /* timer_now at tick 0 */
+  int pending;
+} timer_wheel;
+
+/*
+ * A connection's deadline. The event loops keep it on their own wheel;
+ * otherwise deadline_arm puts it on a shared one, whose reaper thread
+ * shuts its sockets down once it passes.
+ */
+typedef struct {
+  wheel_timer t;
+  long due; /* timer_now past which it is cut, 0 for never */
+  long quiet; /* ms of no progress it is cut after, 0 for never */
+  long active; /* timer_now of the last progress */
+  int fd, peer; /* sockets shut down, peer -1 if none */
+  int fired;
+  int shard;
+} deadline_t;
+
+long timer_now();
+void wheel_init(timer_wheel *w, long now);
+void wheel_add(timer_wheel *w, wheel_timer *t, long msecs);
+void wheel_del(timer_wheel *w, wheel_timer *t);
+void wheel_advance(timer_wheel *w, long now);
+
+void deadline_set_limits(long idle, long header, long transfer);
+long deadline_limit(int kind);
+long deadline_begin(deadline_t *d, int kind);
+long deadline_left(deadline_t *d, long now);
+void deadline_touch(deadline_t *d);
+
+void timer_init();
+void deadline_init(deadline_t *d);
+void deadline_arm(deadline_t *d, int kind, int fd, int peer);
+int deadline_disarm(deadline_t *d);
+
+#endif /* __TIMER_H__ */
@@ -0,0 +1,212 @@
+/*
+ * upstream.c - pool of idle persistent connections to servers
+ *
+ * Each (host, port) gets an entry holding up to UPSTREAM_MAX_IDLE idle
+ * sockets, most recently returned last. upstream_get hands out the newest
+ * idle socket that still looks healthy, or opens a new connection;
+ * upstream_put takes a socket back once a response has been read from it
+ * completely. An entry is freed once its last socket is taken, and there
+ * are at most UPSTREAM_MAX_HOSTS of them. A full table is swept of the
+ * entries whose sockets have all been idle too long, at most once a
+ * second; if that frees none, a socket to a new (host, port) is closed
+ * rather than kept. One semaphore protects the
+ * whole table. It is only held to move sockets in and out: a socket's
+ * health is checked and a socket is closed with it released.
+ */
+#include "csapp.h"
+#include "upstream.h"
+#include "hash.h"
+#include "dns.h"
+
+typedef struct upstream {
+  char *host;
+  char *port;
+  int fds[UPSTREAM_MAX_IDLE]; /* idle sockets, oldest first */
+  time_t idle_since[UPSTREAM_MAX_IDLE];
+  int nidle;
+  struct upstream *next; /* next entry in the same bucket */
+} upstream_t;
+
+static upstream_t **buckets;
+static int nentries;
+static time_t last_sweep; /* when a full table was last swept */
+static sem_t mutex; /* Initially = 1, protects the above */
+
+/* upstream_init - Initialize an empty pool */
+void upstream_init() {
+  buckets = (upstream_t **)Calloc(UPSTREAM_BUCKETS, sizeof(upstream_t *));
+  Sem_init(&mutex, 0, 1);
+}
+
+/* key_hash - Hash of a (host, port) key */
+static unsigned int key_hash(char *host, char *port) {
+  return hash_add(hash_add(HASH_SEED, host), port);
+}
+
+/*
+ * find - Return the link pointing at the entry of (host, port), or the
+ *   NULL link ending its bucket if there is none. Caller holds the mutex.
+ */
+static upstream_t **find(char *host, char *port) {
+  upstream_t **link = &buckets[key_hash(host, port) & (UPSTREAM_BUCKETS - 1)];
+
+  for (; *link != NULL; link = &(*link) -> next) {
+    if (!strcasecmp((*link) -> host, host) && !strcmp((*link) -> port, port)) {
+      break;
+    }
+  }
+  return link;
+}
+
+/* unlink_entry - Take the entry at link off the table and free it */
+static void unlink_entry(upstream_t **link) {
+  upstream_t *up = *link;
+
+  *link = up -> next;
+  nentries--;
+  free(up -> host);
+  free(up -> port);
+  Free(up);
+}
+
+/*
+ * sweep - Free the entries whose newest socket has been idle too long,
+ *   closing their sockets. Caller holds the mutex.
+ */
+static void sweep(time_t now) {
+  upstream_t **link, *up;
+  int i;
+
+  for (i = 0; i < UPSTREAM_BUCKETS; i++) {
+    for (link = &buckets[i]; (up = *link) != NULL; ) {
+      if (now - up -> idle_since[up -> nidle - 1] <= UPSTREAM_IDLE_SECS) {
+        link = &up -> next;
+        continue;
+      }
+      while (up -> nidle > 0) {
+        close(up -> fds[--up -> nidle]);
+      }
+      unlink_entry(link);
+    }
+  }
+  last_sweep = now;
+}
+
+/*
+ * pop - Take the newest idle socket to (host, port) out of the pool, with
+ *   the time it went idle in *since, freeing the entry if it was the last.
+ *   Return -1 if there is none.
+ */
+static int pop(char *host, char *port, time_t *since) {
+  upstream_t **link, *up;
+  int fd = -1;
+
+  P(&mutex);
+  if ((up = *(link = find(host, port))) != NULL) {
+    up -> nidle--;
+    fd = up -> fds[up -> nidle];
+    *since = up -> idle_since[up -> nidle];
+    if (up -> nidle == 0) {
+      unlink_entry(link);
+    }
+  }
+  V(&mutex);
+  return fd;
+}
+
+/*
+ * healthy - An idle socket should have nothing to read. EOF means the
+ *   server closed it, and stray bytes mean we can't trust the framing.
+ */
+static int healthy(int fd) {
+  char c;
+  ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * upstream_get - Return a connection to (host, port), reusing an idle one
+ *   if possible. *reused tells the caller whether it may have been closed
+ *   by the server meanwhile and is worth retrying on a fresh connection.
+ *   A new connection is given msecs to be accepted, unless 0.
+ *   Return -1 if a new connection can't be opened.
+ */
+int upstream_get(char *host, char *port, int *reused, long msecs) {
+  time_t now = time(NULL), since;
+  int fd, rc;
+
+  while ((fd = pop(host, port, &since)) >= 0) {
+    if (now - since <= UPSTREAM_IDLE_SECS && healthy(fd)) {
+      *reused = 1;
+      return fd;
+    }
+    close(fd);
+  }
+  *reused = 0;
+  return dns_connect(host, port, &rc, msecs);
+}
+
+/*
+ * upstream_put - Keep fd as an idle connection to (host, port). The oldest
+ *   idle connection is closed if the entry is full, and fd itself if the
+ *   table is and (host, port) has no entry.
+ */
+void upstream_put(char *host, char *port, int fd) {
+  upstream_t **link, *up;
+  time_t now = time(NULL);
+  int old = -1;
+
+  P(&mutex);
+  if ((up = *(link = find(host, port))) == NULL) {
+    if (nentries == UPSTREAM_MAX_HOSTS && now != last_sweep) {
+      sweep(now);
+      link = find(host, port); // the bucket may have changed
+    }
+    if (nentries == UPSTREAM_MAX_HOSTS) {
+      V(&mutex);
+      close(fd);
+      return;
+    }
+    up = (upstream_t *)Calloc(1, sizeof(upstream_t));
+    up -> host = strdup(host);
+    up -> port = strdup(port);
+    *link = up; // at the end of its bucket
+    nentries++;
+  }
+  if (up -> nidle == UPSTREAM_MAX_IDLE) {
+    old = up -> fds[0];
+    memmove(up -> fds, up -> fds + 1, (UPSTREAM_MAX_IDLE - 1) * sizeof(int));
+    memmove(up -> idle_since, up -> idle_since + 1,
+            (UPSTREAM_MAX_IDLE - 1) * sizeof(time_t));
+    up -> nidle--;
+  }
+  up -> fds[up -> nidle] = fd;
+  up -> idle_since[up -> nidle] = now;
+  up -> nidle++;
+  V(&mutex);
+  if (old >= 0) {
+    close(old);
+  }
+}
+
+/* upstream_free - Close every idle connection and free the pool */
+void upstream_free() {
+  upstream_t *up, *next;
+  int i;
+
+  P(&mutex);
+  for (i = 0; i < UPSTREAM_BUCKETS; i++) {
+    for (up = buckets[i]; up != NULL; up = next) {
+      next = up -> next;
+      while (up -> nidle > 0) {
+        close(up -> fds[--up -> nidle]);
+      }
+      free(up -> host);
+      free(up -> port);
+      Free(up);
+    }
+    buckets[i] = NULL;
+  }
+  nentries = 0;
+  V(&mutex);
+}
@@ -0,0 +1,17 @@
+/*
+ * upstream.h - pool of idle persistent connections to servers
+ */
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#define UPSTREAM_BUCKETS 256 /* Must be a power of 2 */
+#define UPSTREAM_MAX_IDLE 8 /* Idle connections kept per (host, port) */
+#define UPSTREAM_IDLE_SECS 30 /* Idle connections older than this are closed */
+#define UPSTREAM_MAX_HOSTS 256 /* Entries kept at most, one per (host, port) */
+
+void upstream_init();
+int upstream_get(char *host, char *port, int *reused, long msecs);
+void upstream_put(char *host, char *port, int fd);
+void upstream_free();
+
+#endif /* __UPSTREAM_H__ */
@@ -0,0 +1,132 @@
+/*
+ * workers.c - worker processes sharing the proxy's port with SO_REUSEPORT
+ *
+ * With -p the proxy forks its workers before starting any thread. Each
+ * worker opens its own listening socket on the port with SO_REUSEPORT, so
+ * the kernel spreads the accepts over them rather than every worker
+ * contending for one queue, and then serves as a whole proxy of its own.
+ * What they share is the cache tier in shm.c.
+ *
+ * The parent only supervises: a worker killed by a signal, a crash, is
+ * replaced by a new one, while one that exits on its own, say because it
+ * could not listen, is not. The parent exits with the last worker, and
+ * passes SIGINT on to them. A worker gets SIGINT too if the parent dies
+ * first.
+ */
+#include <sys/prctl.h>
+#include "workers.h"
+#include "log.h"
+
+static pid_t *pids; /* each worker's pid, by index */
+static int nworkers;
+static handler_t *worker_sigint; /* the workers' SIGINT handler */
+
+/* stop - SIGINT handler of the parent, stop the workers then exit */
+static void stop(int sig) {
+  int i;
+  for (i = 0; i < nworkers; i++) {
+    if (pids[i] > 0) {
+      kill(pids[i], SIGINT);
+    }
+  }
+  while (wait(NULL) > 0 || errno == EINTR) {
+    ;
+  }
+  _exit(0);
+}
+
+/* fork_worker - Fork worker i. Return 0 in the worker, its pid in the parent */
+static pid_t fork_worker(int i) {
+  pid_t pid;
+
+  if ((pid = Fork()) == 0) {
+    Signal(SIGINT, worker_sigint);
+    prctl(PR_SET_PDEATHSIG, SIGINT);
+    return 0;
+  }
+  pids[i] = pid;
+  return pid;
+}
+
+/*
+ * workers_spawn - Fork nprocs worker processes. The parent stays behind to
+ *   replace any worker that crashes, and exits with the last one. Return
+ *   the worker's index, 0 to nprocs - 1, in each worker.
+ */
+int workers_spawn(int nprocs) {
+  pid_t pid;
+  int i, status;
+
+  pids = (pid_t *)Calloc(nprocs, sizeof(pid_t));
+  nworkers = nprocs;
+  worker_sigint = Signal(SIGINT, SIG_IGN); // no stop before all are listed
+  for (i = 0; i < nprocs; i++) {
+    if (fork_worker(i) == 0) {
+      return i;
+    }
+  }
+  Signal(SIGINT, stop);
+  while (1) {
+    if ((pid = wait(&status)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      exit(0);
+    }
+    for (i = 0; i < nprocs && pids[i] != pid; i++) {
+      ;
+    }
+    if (i == nprocs) {
+      continue;
+    }
+    pids[i] = 0;
+    if (!WIFSIGNALED(status)) {
+      log_warn("Worker %d (pid %d) exited with %d", i, (int)pid,
+               WEXITSTATUS(status));
+      continue;
+    }
+    log_warn("Worker %d (pid %d) killed by signal %d, restarting it", i,
+             (int)pid, WTERMSIG(status));
+    if (fork_worker(i) == 0) {
+      return i;
+    }
+  }
+}
+
+/*
+ * reuseport_listenfd - open_listenfd with SO_REUSEPORT, so every worker
+ *   can listen on the same port. Return the listening socket, or -1.
+ */
+int reuseport_listenfd(char *port) {
+  struct addrinfo hints, *listp, *p;
+  int listenfd = -1, optval = 1;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+  if (getaddrinfo(NULL, port, &hints, &listp) != 0) {
+    return -1;
+  }
+  for (p = listp; p; p = p -> ai_next) {
+    if ((listenfd = socket(p -> ai_family, p -> ai_socktype,
+                           p -> ai_protocol)) < 0) {
+      continue;
+    }
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval,
+                   sizeof(int)) == 0 &&
+        bind(listenfd, p -> ai_addr, p -> ai_addrlen) == 0) {
+      break;
+    }
+    close(listenfd);
+  }
+  freeaddrinfo(listp);
+  if (p == NULL) {
+    return -1;
+  }
+  if (listen(listenfd, LISTENQ) < 0) {
+    close(listenfd);
+    return -1;
+  }
+  return listenfd;
+}
@@ -0,0 +1,14 @@
+/*
+ * workers.h - worker processes sharing the proxy's port with SO_REUSEPORT
+ */
+#ifndef __WORKERS_H__
+#define __WORKERS_H__
+
+#include "csapp.h"
+
+#define WORKERS_MAX 256 /* Most worker processes -p may ask for */
+
+int workers_spawn(int nprocs);
+int reuseport_listenfd(char *port);
+
+#endif /* __WORKERS_H__ */